@@ -0,0 +1,156 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Checks that warm detours neither allocate nor make system calls, requires KHook to be built with KHOOK_AUDIT
+// Usage : khook_bench_audit [calls per hook]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "khook.hpp"
+
+static const char g_text[] = "text";
+static const char g_override_text[] = "override";
+
+// Every mode gets its own class, so its own vtable and detours
+template<int MODE>
+class Target {
+public:
+	virtual ~Target() = default;
+	virtual int Int(int value) { return value + 1; }
+	virtual float Float(float x, float y, float z) { return x + y + z; }
+	virtual void Void() { calls++; }
+	virtual const char* Pointer(int value) { return (value != 0) ? g_text : nullptr; }
+	virtual double Double(double value) { return value * 2.0; }
+
+	int calls = 0;
+};
+
+template<int MODE>
+struct Hooks {
+	using T = Target<MODE>;
+
+	static KHook::Return<int> Int_Pre(T*, int value) {
+		return { KHook::Action::Override, value + 2 };
+	}
+	static KHook::Return<int> Int_Post(T*, int) {
+		return { KHook::Action::Ignore, 0 };
+	}
+	static KHook::Return<float> Float_Post(T*, float, float, float) {
+		return { KHook::Action::Supersede, 42.0f };
+	}
+	static KHook::Return<void> Void_Pre(T*) {
+		return { KHook::Action::Ignore };
+	}
+	static KHook::Return<const char*> Pointer_Pre(T*, int) {
+		return { KHook::Action::Supersede, g_override_text };
+	}
+	static KHook::Return<double> Double_Pre(T*, double) {
+		return { KHook::Action::Ignore, 0.0 };
+	}
+	static KHook::Return<double> Double_Post(T*, double value) {
+		return { KHook::Action::Override, value * 3.0 };
+	}
+
+	KHook::Virtual<T, int, int> int_hook{&T::Int, Int_Pre, Int_Post};
+	KHook::Virtual<T, float, float, float, float> float_hook{&T::Float, nullptr, Float_Post};
+	KHook::Virtual<T, void> void_hook{&T::Void, Void_Pre, nullptr};
+	KHook::Virtual<T, const char*, int> pointer_hook{&T::Pointer, Pointer_Pre, nullptr};
+	KHook::Virtual<T, double, double> double_hook{&T::Double, Double_Pre, Double_Post};
+};
+
+// Hook ids are handed out in order, every Add below detours a single function
+static KHook::HookID_t g_next_id = 0;
+static bool g_failed = false;
+
+template<int MODE>
+static bool Call(Target<MODE>* object, int signature) {
+	switch (signature) {
+	case 0:
+		return object->Int(1) == 3;
+	case 1:
+		return object->Float(1.0f, 2.0f, 3.0f) == 42.0f;
+	case 2: {
+		int before = object->calls;
+		object->Void();
+		return object->calls == before + 1;
+	}
+	case 3:
+		return std::strcmp(object->Pointer(1), g_override_text) == 0;
+	default:
+		return object->Double(2.0) == 6.0;
+	}
+}
+
+template<int MODE>
+static void Measure(const char* mode_name, KHook::DispatchMode mode, std::size_t calls) {
+	static const char* names[] = { "int(int)", "float(float*3)", "void()", "pointer(int)", "double(double)" };
+	constexpr int SIGNATURES = sizeof(names) / sizeof(names[0]);
+
+	KHook::SetDispatchMode(mode);
+	static Target<MODE> target;
+	static Hooks<MODE> hooks;
+	Target<MODE>* volatile object = &target;
+
+	KHook::HookID_t first_id = g_next_id;
+	hooks.int_hook.Add(object);
+	hooks.float_hook.Add(object);
+	hooks.void_hook.Add(object);
+	hooks.pointer_hook.Add(object);
+	hooks.double_hook.Add(object);
+	g_next_id += SIGNATURES;
+
+	// The first calls size the per thread stacks and fill the return value pool
+	for (int signature = 0; signature < SIGNATURES; signature++) {
+		for (int i = 0; i < 16; i++) {
+			Call(object, signature);
+		}
+	}
+	KHook::ResetAuditStats();
+
+	for (int signature = 0; signature < SIGNATURES; signature++) {
+		for (std::size_t i = 0; i < calls; i++) {
+			if (!Call(object, signature)) {
+				std::fprintf(stderr, "%s %s: wrong return value\n", mode_name, names[signature]);
+				std::exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	for (int signature = 0; signature < SIGNATURES; signature++) {
+		KHook::AuditStats stats = {};
+		if (!KHook::GetAuditStats(first_id + signature, stats)) {
+			std::fprintf(stderr, "%s %s: no audit counters, is KHook built with KHOOK_AUDIT ?\n", mode_name, names[signature]);
+			std::exit(EXIT_FAILURE);
+		}
+		std::printf("%-10s %-16s %10llu %8llu %8llu %8llu %8llu\n", mode_name, names[signature],
+			static_cast<unsigned long long>(stats.calls), static_cast<unsigned long long>(stats.allocations),
+			static_cast<unsigned long long>(stats.deallocations), static_cast<unsigned long long>(stats.locks),
+			static_cast<unsigned long long>(stats.syscalls));
+		if (stats.calls != calls || stats.allocations != 0 || stats.deallocations != 0 || stats.syscalls != 0 || stats.locks != 0) {
+			std::fprintf(stderr, "%s %s: the dispatcher isn't allocation, system call and contention free\n", mode_name, names[signature]);
+			g_failed = true;
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	std::size_t calls = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 100000;
+	if (calls == 0) {
+		std::fprintf(stderr, "Usage : %s [calls per hook]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::printf("%-10s %-16s %10s %8s %8s %8s %8s\n", "mode", "signature", "calls", "allocs", "frees", "locks", "syscalls");
+	Measure<0>("dedicated", KHook::DispatchMode::Dedicated, calls);
+	Measure<1>("shared", KHook::DispatchMode::Shared, calls);
+
+	KHook::Shutdown();
+	return g_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
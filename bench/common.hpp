@@ -0,0 +1,66 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+// Helpers shared by the benchmarks hooking while calls are in flight
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "khook.hpp"
+
+// Virtual hook exposing its id, which can also be inserted synchronously
+template<typename CLASS, typename RETURN, typename... ARGS>
+class SyncVirtual : public KHook::Virtual<CLASS, RETURN, ARGS...> {
+	using Base = KHook::Virtual<CLASS, RETURN, ARGS...>;
+public:
+	using Base::Base;
+
+	// Add, inserting the hook before returning rather than from the insertion thread
+	KHook::HookID_t AddSync(CLASS* object) {
+		{
+			std::lock_guard guard(this->_m_hooked_this);
+			this->_hooked_this.insert(object);
+		}
+		void** vtable = *reinterpret_cast<void***>(object);
+		auto id = KHook::SetupVirtualHook(
+			vtable,
+			this->_vtbl_index,
+			this,
+			KHook::ExtractMFP(&SyncVirtual::_KHook_RemovedHook),
+			KHook::ExtractMFP(&SyncVirtual::_KHook_Callback_PRE),
+			KHook::ExtractMFP(&SyncVirtual::_KHook_Callback_POST),
+			KHook::ExtractMFP(&SyncVirtual::_KHook_MakeReturn),
+			KHook::ExtractMFP(&SyncVirtual::_KHook_MakeOriginalCall),
+			false
+		);
+		if (id != KHook::INVALID_HOOK) {
+			std::lock_guard guard(this->_hooks_stored);
+			this->_hook_ids_addr[id] = vtable[this->_vtbl_index];
+			this->_addr_hook_ids[vtable[this->_vtbl_index]] = id;
+		}
+		return id;
+	}
+
+	// Benchmarks add every hook to a single object
+	KHook::HookID_t Id() {
+		std::lock_guard guard(this->_hooks_stored);
+		return this->_hook_ids_addr.empty() ? KHook::INVALID_HOOK : this->_hook_ids_addr.begin()->first;
+	}
+};
+
+template<typename T>
+T Percentile(std::vector<T>& values, double percentile) {
+	if (values.empty()) {
+		return T();
+	}
+	std::sort(values.begin(), values.end());
+	return values[std::min(values.size() - 1, static_cast<std::size_t>(percentile * values.size()))];
+}
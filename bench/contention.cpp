@@ -0,0 +1,221 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Dispatch under contention: caller threads hammer a hooked function while one thread churns hooks through
+// the asynchronous API (KHook::Virtual's Add and RemoveHook(id, true)), and another one through the synchronous API every millisecond
+// Usage : khook_bench_contention [max caller threads] [milliseconds per step]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "khook.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Every mode gets its own class, so its own vtable and detour
+template<int MODE>
+class Target {
+public:
+	virtual ~Target() = default;
+	virtual int Get(int value) { return value + 1; }
+};
+
+template<int MODE>
+static KHook::Return<int> Target_Get(Target<MODE>*, int) {
+	return { KHook::Action::Ignore, 0 };
+}
+
+template<int MODE>
+class ChurnHook : public SyncVirtual<Target<MODE>, int, int> {
+	using Base = SyncVirtual<Target<MODE>, int, int>;
+public:
+	ChurnHook() : Base(&Target<MODE>::Get, Target_Get<MODE>, nullptr) {}
+};
+
+struct Caller {
+	std::size_t calls = 0;
+	// Nanoseconds taken by one call in SAMPLE_EVERY
+	std::vector<std::uint32_t> latencies;
+	bool failed = false;
+};
+
+struct Churn {
+	// Nanoseconds from Add to the insertion thread activating the hook
+	std::vector<double> activations;
+	// Asynchronous inserts still pending when the step ended
+	std::size_t pending = 0;
+	// Nanoseconds spent in the synchronous setup and removal
+	std::vector<double> sync_inserts;
+	std::vector<double> sync_removes;
+};
+
+static constexpr std::size_t SAMPLE_EVERY = 16;
+
+static double Nanoseconds(Clock::time_point start, Clock::time_point end) {
+	return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+template<int MODE>
+static void CallLoop(Target<MODE>* object, const std::atomic<bool>& stop, Caller& caller) {
+	Target<MODE>* volatile target = object;
+	caller.latencies.reserve(1 << 16);
+	for (int value = 0; !stop.load(std::memory_order_relaxed); value++) {
+		if ((caller.calls++ % SAMPLE_EVERY) == 0) {
+			auto start = Clock::now();
+			int result = target->Get(value);
+			auto end = Clock::now();
+			caller.latencies.push_back(static_cast<std::uint32_t>(std::min(Nanoseconds(start, end), 4e9)));
+			caller.failed |= (result != value + 1);
+		} else {
+			caller.failed |= (target->Get(value) != value + 1);
+		}
+	}
+}
+
+template<int MODE>
+static void AsyncChurnLoop(Target<MODE>* object, const std::atomic<bool>& stop, Churn& churn) {
+	while (!stop.load(std::memory_order_relaxed)) {
+		auto hook = std::make_unique<ChurnHook<MODE>>();
+		hook->Add(object);
+		auto id = hook->Id();
+		// Gives up once the step is over, the callers are then gone and the insertion goes through
+		while (!KHook::WaitActive(id, 10) && !stop.load(std::memory_order_relaxed)) {
+		}
+
+		KHook::HookLifecycle lifecycle = {};
+		if (KHook::GetHookLifecycle(id, lifecycle) && lifecycle.active) {
+			churn.activations.push_back(static_cast<double>(lifecycle.activated - lifecycle.enqueued));
+		} else {
+			churn.pending++;
+		}
+
+		// The hook must outlive its removal
+		KHook::RemoveHook(id, true);
+		while (KHook::GetHookLifecycle(id, lifecycle)) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+
+template<int MODE>
+static void SyncChurnLoop(Target<MODE>* object, const std::atomic<bool>& stop, Churn& churn) {
+	while (!stop.load(std::memory_order_relaxed)) {
+		auto hook = std::make_unique<ChurnHook<MODE>>();
+		auto start = Clock::now();
+		auto id = hook->AddSync(object);
+		churn.sync_inserts.push_back(Nanoseconds(start, Clock::now()));
+
+		start = Clock::now();
+		KHook::RemoveHook(id, false);
+		churn.sync_removes.push_back(Nanoseconds(start, Clock::now()));
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+template<int MODE>
+static double Step(const char* mode_name, Target<MODE>* object, std::size_t threads, std::chrono::milliseconds duration, double single_thread) {
+	std::atomic<bool> stop = false;
+	std::vector<Caller> callers(threads);
+	std::vector<std::thread> caller_threads;
+	for (auto& caller : callers) {
+		caller_threads.emplace_back(CallLoop<MODE>, object, std::cref(stop), std::ref(caller));
+	}
+	Churn async_churn, sync_churn;
+	std::thread async_thread(AsyncChurnLoop<MODE>, object, std::cref(stop), std::ref(async_churn));
+	std::thread sync_thread(SyncChurnLoop<MODE>, object, std::cref(stop), std::ref(sync_churn));
+
+	auto start = Clock::now();
+	std::this_thread::sleep_for(duration);
+	stop = true;
+	for (auto& thread : caller_threads) {
+		thread.join();
+	}
+	auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	async_thread.join();
+	sync_thread.join();
+
+	std::size_t calls = 0;
+	std::vector<std::uint32_t> latencies;
+	for (auto& caller : callers) {
+		if (caller.failed) {
+			std::fprintf(stderr, "%s %zu threads: wrong return value\n", mode_name, threads);
+			std::exit(EXIT_FAILURE);
+		}
+		calls += caller.calls;
+		latencies.insert(latencies.end(), caller.latencies.begin(), caller.latencies.end());
+	}
+
+	double throughput = calls / elapsed / 1e6;
+	double p50 = Percentile(latencies, 0.5), p99 = Percentile(latencies, 0.99), p999 = Percentile(latencies, 0.999);
+	double max = latencies.empty() ? 0.0 : static_cast<double>(latencies.back());
+	double activation50 = Percentile(async_churn.activations, 0.5), activation99 = Percentile(async_churn.activations, 0.99);
+	double insert99 = Percentile(sync_churn.sync_inserts, 0.99), remove99 = Percentile(sync_churn.sync_removes, 0.99);
+	std::printf("%-10s %7zu %9.2f %7.2fx %8.0f %8.0f %8.0f %8.0f | %6zu %6zu %9.2f %9.2f | %6zu %9.1f %9.1f\n",
+		mode_name, threads, throughput, (single_thread != 0.0) ? throughput / single_thread : 1.0,
+		p50, p99, p999, max, async_churn.activations.size(), async_churn.pending, activation50 / 1e6, activation99 / 1e6,
+		sync_churn.sync_inserts.size(), insert99 / 1e3, remove99 / 1e3);
+	std::fflush(stdout);
+	return throughput;
+}
+
+template<int MODE>
+static void Measure(const char* mode_name, KHook::DispatchMode mode, std::size_t max_threads, std::chrono::milliseconds duration) {
+	KHook::SetDispatchMode(mode);
+	static Target<MODE> target;
+
+	// Keeps the detour alive between the churned hooks
+	ChurnHook<MODE> permanent;
+	permanent.Add(&target);
+	if (!KHook::WaitActive(permanent.Id(), 1000)) {
+		std::fprintf(stderr, "%s: couldn't hook the target\n", mode_name);
+		std::exit(EXIT_FAILURE);
+	}
+
+	double single_thread = 0.0;
+	for (std::size_t threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+		double throughput = Step(mode_name, &target, threads, duration, single_thread);
+		if (threads == 1) {
+			single_thread = throughput;
+		}
+		if (threads == max_threads) {
+			break;
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	std::size_t max_threads = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 64;
+	long milliseconds = (argc > 2) ? std::strtol(argv[2], nullptr, 10) : 500;
+	if (max_threads == 0 || milliseconds <= 0) {
+		std::fprintf(stderr, "Usage : %s [max caller threads] [milliseconds per step]\n", argv[0]);
+		KHook::Shutdown();
+		return EXIT_FAILURE;
+	}
+	std::chrono::milliseconds duration(milliseconds);
+
+	std::printf("%u hardware threads, %ld ms per step, call latencies sampled every %zu calls\n",
+		std::thread::hardware_concurrency(), milliseconds, SAMPLE_EVERY);
+	std::printf("%-10s %7s %9s %8s %8s %8s %8s %8s | %6s %6s %9s %9s | %6s %9s %9s\n",
+		"mode", "callers", "Mcalls/s", "scaling", "p50_ns", "p99_ns", "p999_ns", "max_ns",
+		"async", "stuck", "act50_ms", "act99_ms",
+		"sync", "ins99_us", "rem99_us");
+	Measure<0>("dedicated", KHook::DispatchMode::Dedicated, max_threads, duration);
+	Measure<1>("shared", KHook::DispatchMode::Shared, max_threads, duration);
+
+	KHook::Shutdown();
+	return EXIT_SUCCESS;
+}
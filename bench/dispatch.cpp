@@ -0,0 +1,665 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Dispatch overhead in nanoseconds per call, for every hook template, callback count, signature and callback action
+// Usage : khook_bench [--filter <text>] [--calls <count>] [--rounds <count>] [--json <file>] [--baseline <file>] [--tolerance <percent>]
+//
+// --json writes the results, a later run given that file with --baseline reports the cases slower by more than
+// tolerance percent (10 by default) and exits with a failure.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "khook.hpp"
+#include "safetyhook.hpp"
+
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+static const char* g_arch = "x86_64";
+#else
+static const char* g_arch = "x86";
+#endif
+
+// Written by every target, keeps them from being folded into one another or optimised away
+static volatile int g_sink = 0;
+// Pre and post callbacks invoked
+static std::size_t g_callbacks = 0;
+
+static constexpr int OVERRIDE_VALUE = 1234;
+
+struct Vec3 {
+	float x, y, z;
+
+	bool operator==(const Vec3& other) const { return x == other.x && y == other.y && z == other.z; }
+};
+
+// Every case gets its own instantiation, so its own functions, vtable and detours
+template<int ID>
+class Target {
+public:
+	virtual ~Target() = default;
+
+	static int Int(int a, int b) { g_sink = a; return a + b + ID; }
+	static float Float(float x, float y, float z) { g_sink = ID; return x * y + z + ID; }
+	static double Mixed(int a, float b, double c, std::int64_t d) { g_sink = a; return a + b + c + static_cast<double>(d) + ID; }
+	static int Stack(int a0, int a1, int a2, int a3, int a4, int a5, int a6, int a7,
+		double d0, double d1, double d2, double d3, double d4, double d5, double d6, double d7, double d8, double d9) {
+		g_sink = a0;
+		return a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 + static_cast<int>(d0 + d1 + d2 + d3 + d4 + d5 + d6 + d7 + d8 + d9) + ID;
+	}
+	static void Void(int a) { g_sink = a + ID; }
+	static Vec3 Struct(float x) { g_sink = ID; return { x, x + 1.0f, x + ID }; }
+
+	BENCH_NOINLINE static int IntFree(int a, int b) { return Int(a, b); }
+	BENCH_NOINLINE static float FloatFree(float x, float y, float z) { return Float(x, y, z); }
+	BENCH_NOINLINE static double MixedFree(int a, float b, double c, std::int64_t d) { return Mixed(a, b, c, d); }
+	BENCH_NOINLINE static int StackFree(int a0, int a1, int a2, int a3, int a4, int a5, int a6, int a7,
+		double d0, double d1, double d2, double d3, double d4, double d5, double d6, double d7, double d8, double d9) {
+		return Stack(a0, a1, a2, a3, a4, a5, a6, a7, d0, d1, d2, d3, d4, d5, d6, d7, d8, d9);
+	}
+	BENCH_NOINLINE static void VoidFree(int a) { Void(a); }
+	BENCH_NOINLINE static Vec3 StructFree(float x) { return Struct(x); }
+
+	BENCH_NOINLINE int IntMember(int a, int b) { return Int(a, b) + _offset; }
+	BENCH_NOINLINE float FloatMember(float x, float y, float z) { return Float(x, y, z) + _offset; }
+	BENCH_NOINLINE double MixedMember(int a, float b, double c, std::int64_t d) { return Mixed(a, b, c, d) + _offset; }
+	BENCH_NOINLINE int StackMember(int a0, int a1, int a2, int a3, int a4, int a5, int a6, int a7,
+		double d0, double d1, double d2, double d3, double d4, double d5, double d6, double d7, double d8, double d9) {
+		return Stack(a0, a1, a2, a3, a4, a5, a6, a7, d0, d1, d2, d3, d4, d5, d6, d7, d8, d9) + _offset;
+	}
+	BENCH_NOINLINE void VoidMember(int a) { Void(a + _offset); }
+	BENCH_NOINLINE Vec3 StructMember(float x) { return Struct(x + _offset); }
+
+	virtual int IntVirtual(int a, int b) { return Int(a, b) + _offset; }
+	virtual float FloatVirtual(float x, float y, float z) { return Float(x, y, z) + _offset; }
+	virtual double MixedVirtual(int a, float b, double c, std::int64_t d) { return Mixed(a, b, c, d) + _offset; }
+	virtual int StackVirtual(int a0, int a1, int a2, int a3, int a4, int a5, int a6, int a7,
+		double d0, double d1, double d2, double d3, double d4, double d5, double d6, double d7, double d8, double d9) {
+		return Stack(a0, a1, a2, a3, a4, a5, a6, a7, d0, d1, d2, d3, d4, d5, d6, d7, d8, d9) + _offset;
+	}
+	virtual void VoidVirtual(int a) { Void(a + _offset); }
+	virtual Vec3 StructVirtual(float x) { return Struct(x + _offset); }
+
+private:
+	int _offset = 0;
+};
+
+enum class Kind {
+	Function,
+	Member,
+	Virtual
+};
+
+static const char* KindName(Kind kind) {
+	switch (kind) {
+	case Kind::Function:
+		return "function";
+	case Kind::Member:
+		return "member";
+	default:
+		return "virtual";
+	}
+}
+
+#define BENCH_SIGNATURE_POINTER(NAME) \
+	template<Kind KIND, typename T> \
+	static constexpr auto Pointer() { \
+		if constexpr (KIND == Kind::Function) { \
+			return &T::NAME##Free; \
+		} else if constexpr (KIND == Kind::Member) { \
+			return &T::NAME##Member; \
+		} else { \
+			return &T::NAME##Virtual; \
+		} \
+	}
+
+// Two integers in registers on both architectures
+struct IntSignature {
+	static constexpr const char* NAME = "int";
+	BENCH_SIGNATURE_POINTER(Int)
+	template<typename CALL>
+	static auto Invoke(CALL& call) { return call(1, 2); }
+};
+
+struct FloatSignature {
+	static constexpr const char* NAME = "float";
+	BENCH_SIGNATURE_POINTER(Float)
+	template<typename CALL>
+	static auto Invoke(CALL& call) { return call(1.0f, 2.0f, 3.0f); }
+};
+
+struct MixedSignature {
+	static constexpr const char* NAME = "mixed";
+	BENCH_SIGNATURE_POINTER(Mixed)
+	template<typename CALL>
+	static auto Invoke(CALL& call) { return call(1, 2.0f, 3.0, static_cast<std::int64_t>(4)); }
+};
+
+// More integers and floats than the x86_64 calling conventions pass in registers
+struct StackSignature {
+	static constexpr const char* NAME = "stack";
+	BENCH_SIGNATURE_POINTER(Stack)
+	template<typename CALL>
+	static auto Invoke(CALL& call) { return call(1, 2, 3, 4, 5, 6, 7, 8, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0); }
+};
+
+struct VoidSignature {
+	static constexpr const char* NAME = "void";
+	BENCH_SIGNATURE_POINTER(Void)
+	template<typename CALL>
+	static auto Invoke(CALL& call) { return call(1); }
+};
+
+struct StructSignature {
+	static constexpr const char* NAME = "struct";
+	BENCH_SIGNATURE_POINTER(Struct)
+	template<typename CALL>
+	static auto Invoke(CALL& call) { return call(1.0f); }
+};
+
+#undef BENCH_SIGNATURE_POINTER
+
+// What the pre callbacks return
+enum class Path {
+	Ignore,
+	Override,
+	Supersede,
+	Recall
+};
+
+static const char* PathName(Path path) {
+	switch (path) {
+	case Path::Ignore:
+		return "ignore";
+	case Path::Override:
+		return "override";
+	case Path::Supersede:
+		return "supersede";
+	default:
+		return "recall";
+	}
+}
+
+template<typename V>
+static V Bump(V value) {
+	if constexpr (std::is_same<V, int>::value) {
+		return value + 1;
+	} else {
+		return value;
+	}
+}
+
+template<typename R>
+static KHook::Return<R> Ignored() {
+	if constexpr (std::is_same<R, void>::value) {
+		return { KHook::Action::Ignore };
+	} else {
+		return { KHook::Action::Ignore, R{} };
+	}
+}
+
+template<Path PATH, typename R>
+struct Callbacks {
+	template<typename... A>
+	static KHook::Return<R> Pre(A... args) {
+		g_callbacks++;
+		if constexpr (PATH == Path::Recall) {
+			// Every integer argument is incremented, the recall moves on to the next hook
+			return KHook::Recall(Ignored<R>(), Bump(args)...);
+		} else if constexpr (PATH == Path::Override) {
+			return { KHook::Action::Override, OVERRIDE_VALUE };
+		} else if constexpr (PATH == Path::Supersede) {
+			return { KHook::Action::Supersede, OVERRIDE_VALUE };
+		} else {
+			return Ignored<R>();
+		}
+	}
+
+	template<typename... A>
+	static KHook::Return<R> Post(A...) {
+		g_callbacks++;
+		return Ignored<R>();
+	}
+};
+
+template<Kind KIND, typename POINTER>
+struct Hooks;
+
+template<typename R, typename... A>
+struct Hooks<Kind::Function, R (*)(A...)> {
+	using Return = R;
+	using Hook = KHook::Function<R, A...>;
+	template<typename CALLBACKS>
+	static typename Hook::fnCallback Pre() { return &CALLBACKS::template Pre<A...>; }
+	template<typename CALLBACKS>
+	static typename Hook::fnCallback Post() { return &CALLBACKS::template Post<A...>; }
+};
+
+template<typename C, typename R, typename... A>
+struct Hooks<Kind::Member, R (C::*)(A...)> {
+	using Return = R;
+	using Hook = KHook::Member<C, R, A...>;
+	template<typename CALLBACKS>
+	static typename Hook::fnCallback Pre() { return &CALLBACKS::template Pre<C*, A...>; }
+	template<typename CALLBACKS>
+	static typename Hook::fnCallback Post() { return &CALLBACKS::template Post<C*, A...>; }
+};
+
+template<typename C, typename R, typename... A>
+struct Hooks<Kind::Virtual, R (C::*)(A...)> {
+	using Return = R;
+	using Hook = KHook::Virtual<C, R, A...>;
+	template<typename CALLBACKS>
+	static typename Hook::fnCallback Pre() { return &CALLBACKS::template Pre<C*, A...>; }
+	template<typename CALLBACKS>
+	static typename Hook::fnCallback Post() { return &CALLBACKS::template Post<C*, A...>; }
+};
+
+template<typename T, typename R, typename... A, typename... V>
+static R Call(T*, R (*function)(A...), V... values) {
+	return function(values...);
+}
+
+template<typename T, typename R, typename... A, typename... V>
+static R Call(T* object, R (T::*function)(A...), V... values) {
+	return (object->*function)(values...);
+}
+
+class Case {
+public:
+	Case(std::string name, KHook::DispatchMode mode, std::size_t callbacks) : name(std::move(name)), mode(mode), callbacks(callbacks) {}
+	virtual ~Case() = default;
+
+	// Installs the hooks, false if the target couldn't be detoured
+	virtual bool Setup() = 0;
+	// Calls the target, false on a wrong return value
+	virtual bool Run(std::size_t calls) = 0;
+	// Removes the hooks
+	virtual void Teardown() = 0;
+
+	std::string name;
+	KHook::DispatchMode mode;
+	// Callbacks invoked per call, to make sure the hooks are in place
+	std::size_t callbacks;
+};
+
+
+// HOOKS hooks with a pre and a post callback each, 0 is a single hook without callbacks and -1 the unhooked target.
+// The Override, Supersede and Recall paths get a single hook with a pre callback
+template<int ID, Kind KIND, typename SIGNATURE, Path PATH, int HOOKS>
+class HookedCase : public Case {
+	using T = Target<ID>;
+	using Pointer = decltype(SIGNATURE::template Pointer<KIND, T>());
+	using Traits = Hooks<KIND, Pointer>;
+	using Hook = typename Traits::Hook;
+	using R = typename Traits::Return;
+public:
+	HookedCase(const char* mode_name, KHook::DispatchMode mode) : Case(Name(mode_name), mode, Callbacks()) {}
+
+	bool Setup() override {
+		T* object = _object;
+		Pointer pointer = _pointer;
+		if constexpr (!std::is_same<R, void>::value) {
+			if constexpr (PATH == Path::Override || PATH == Path::Supersede) {
+				_expected = OVERRIDE_VALUE;
+			} else if constexpr (PATH == Path::Recall) {
+				auto call = [object, pointer](auto... values) { return Call(object, pointer, Bump(values)...); };
+				_expected = SIGNATURE::Invoke(call);
+			} else {
+				auto call = [object, pointer](auto... values) { return Call(object, pointer, values...); };
+				_expected = SIGNATURE::Invoke(call);
+			}
+		}
+
+		if constexpr (HOOKS >= 0) {
+			typename Hook::fnCallback pre = nullptr;
+			typename Hook::fnCallback post = nullptr;
+			if constexpr (HOOKS > 0) {
+				pre = Traits::template Pre<::Callbacks<PATH, R>>();
+				if constexpr (PATH == Path::Ignore) {
+					post = Traits::template Post<::Callbacks<PATH, R>>();
+				}
+			}
+			for (int i = 0; i < std::max(HOOKS, 1); i++) {
+				_hooks.push_back(std::make_unique<Hook>(pointer, pre, post));
+				if constexpr (KIND == Kind::Virtual) {
+					_hooks.back()->Add(object);
+				}
+			}
+		}
+		return true;
+	}
+
+	bool Run(std::size_t calls) override {
+		for (std::size_t i = 0; i < calls; i++) {
+			// Reloaded every call, the compiler can't see what's being called
+			T* object = _object;
+			Pointer pointer = _pointer;
+			auto call = [object, pointer](auto... values) { return Call(object, pointer, values...); };
+			if constexpr (std::is_same<R, void>::value) {
+				SIGNATURE::Invoke(call);
+			} else if (!(SIGNATURE::Invoke(call) == _expected)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void Teardown() override {
+		_hooks.clear();
+	}
+
+private:
+	static std::string Name(const char* mode_name) {
+		if (HOOKS < 0) {
+			return std::string("direct/") + SIGNATURE::NAME;
+		}
+		return std::string(mode_name) + "/" + KindName(KIND) + "/" + SIGNATURE::NAME + "/" + PathName(PATH) + "/" + std::to_string(HOOKS);
+	}
+
+	static std::size_t Callbacks() {
+		if (HOOKS <= 0) {
+			return 0;
+		}
+		return (PATH == Path::Ignore) ? HOOKS * 2 : 1;
+	}
+
+	T _target;
+	T* volatile _object = &_target;
+	Pointer volatile _pointer = SIGNATURE::template Pointer<KIND, T>();
+	std::conditional_t<std::is_same<R, void>::value, int, R> _expected{};
+	std::vector<std::unique_ptr<Hook>> _hooks;
+};
+
+// A bare safetyhook detour calling the original function, what every KHook::Function hook is built on
+template<int ID>
+class SafetyhookCase : public Case {
+	using T = Target<ID>;
+	using Function = int (*)(int, int);
+public:
+	SafetyhookCase() : Case("safetyhook/int", KHook::DispatchMode::Dedicated, 0) {}
+
+	bool Setup() override {
+		_expected = T::Int(1, 2);
+		auto result = safetyhook::InlineHook::create(reinterpret_cast<void*>(&T::IntFree), reinterpret_cast<std::uintptr_t>(&Detour));
+		if (!result) {
+			return false;
+		}
+		_hook = std::move(result.value());
+		s_original = _hook.template original<Function>();
+		return true;
+	}
+
+	bool Run(std::size_t calls) override {
+		for (std::size_t i = 0; i < calls; i++) {
+			Function function = _function;
+			if (function(1, 2) != _expected) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void Teardown() override {
+		_hook = {};
+	}
+
+private:
+	static int Detour(int a, int b) {
+		return s_original(a, b);
+	}
+
+	static inline Function s_original = nullptr;
+	safetyhook::InlineHook _hook;
+	Function volatile _function = &T::IntFree;
+	int _expected = 0;
+};
+
+using Cases = std::vector<std::unique_ptr<Case>>;
+
+template<int ID, Kind KIND, typename SIGNATURE, Path PATH, int HOOKS>
+static void Add(Cases& cases, const char* mode_name, KHook::DispatchMode mode) {
+	cases.push_back(std::make_unique<HookedCase<ID, KIND, SIGNATURE, PATH, HOOKS>>(mode_name, mode));
+}
+
+template<int BASE, Kind KIND>
+static void AddKind(Cases& cases, const char* mode_name, KHook::DispatchMode mode) {
+	Add<BASE + 0, KIND, IntSignature, Path::Ignore, 0>(cases, mode_name, mode);
+	Add<BASE + 1, KIND, IntSignature, Path::Ignore, 1>(cases, mode_name, mode);
+	Add<BASE + 2, KIND, IntSignature, Path::Ignore, 2>(cases, mode_name, mode);
+	Add<BASE + 3, KIND, IntSignature, Path::Ignore, 4>(cases, mode_name, mode);
+	Add<BASE + 4, KIND, IntSignature, Path::Ignore, 8>(cases, mode_name, mode);
+	Add<BASE + 5, KIND, FloatSignature, Path::Ignore, 1>(cases, mode_name, mode);
+	Add<BASE + 6, KIND, MixedSignature, Path::Ignore, 1>(cases, mode_name, mode);
+	Add<BASE + 7, KIND, StackSignature, Path::Ignore, 1>(cases, mode_name, mode);
+	Add<BASE + 8, KIND, VoidSignature, Path::Ignore, 1>(cases, mode_name, mode);
+	Add<BASE + 9, KIND, StructSignature, Path::Ignore, 1>(cases, mode_name, mode);
+	Add<BASE + 10, KIND, IntSignature, Path::Override, 1>(cases, mode_name, mode);
+	Add<BASE + 11, KIND, IntSignature, Path::Supersede, 1>(cases, mode_name, mode);
+	Add<BASE + 12, KIND, IntSignature, Path::Recall, 1>(cases, mode_name, mode);
+}
+
+template<int BASE>
+static void AddMode(Cases& cases, const char* mode_name, KHook::DispatchMode mode) {
+	AddKind<BASE, Kind::Function>(cases, mode_name, mode);
+	AddKind<BASE + 20, Kind::Member>(cases, mode_name, mode);
+	AddKind<BASE + 40, Kind::Virtual>(cases, mode_name, mode);
+}
+
+struct Result {
+	std::string name;
+	double ns_per_call;
+};
+
+// Fastest of the rounds, the others were disturbed by something else
+static double Measure(Case& bench, std::size_t calls, int rounds) {
+	KHook::SetDispatchMode(bench.mode);
+	if (!bench.Setup()) {
+		std::fprintf(stderr, "%s: couldn't detour the target\n", bench.name.c_str());
+		std::exit(EXIT_FAILURE);
+	}
+
+	// The first calls size the per thread stacks. The hook templates insert asynchronously,
+	// wait for the insertion thread to get every hook in place
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (true) {
+		g_callbacks = 0;
+		if (!bench.Run(16)) {
+			std::fprintf(stderr, "%s: wrong return value\n", bench.name.c_str());
+			std::exit(EXIT_FAILURE);
+		}
+		if (g_callbacks == 16 * bench.callbacks) {
+			break;
+		}
+		if (std::chrono::steady_clock::now() > deadline) {
+			std::fprintf(stderr, "%s: %zu/%zu callbacks invoked\n", bench.name.c_str(), g_callbacks, 16 * bench.callbacks);
+			std::exit(EXIT_FAILURE);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	double best = std::numeric_limits<double>::max();
+	for (int round = 0; round < rounds; round++) {
+		auto start = std::chrono::steady_clock::now();
+		if (!bench.Run(calls)) {
+			std::fprintf(stderr, "%s: wrong return value\n", bench.name.c_str());
+			std::exit(EXIT_FAILURE);
+		}
+		auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		best = std::min(best, elapsed / calls);
+	}
+
+	bench.Teardown();
+	return best;
+}
+
+static bool WriteJson(const std::string& path, std::size_t calls, int rounds, const std::vector<Result>& results) {
+	std::ofstream file(path);
+	if (!file) {
+		return false;
+	}
+	file << "{\"arch\":\"" << g_arch << "\",\"calls\":" << calls << ",\"rounds\":" << rounds << ",\"results\":[";
+	for (std::size_t i = 0; i < results.size(); i++) {
+		char ns[32];
+		std::snprintf(ns, sizeof(ns), "%.3f", results[i].ns_per_call);
+		file << ((i != 0) ? ",\n" : "\n") << "{\"name\":\"" << results[i].name << "\",\"ns_per_call\":" << ns << "}";
+	}
+	file << "\n]}\n";
+	return static_cast<bool>(file);
+}
+
+// Only reads back what WriteJson writes
+static bool ReadJson(const std::string& path, std::string& arch, std::unordered_map<std::string, double>& results) {
+	std::ifstream file(path);
+	if (!file) {
+		return false;
+	}
+	std::stringstream stream;
+	stream << file.rdbuf();
+	std::string text = stream.str();
+
+	static const std::string arch_key = "\"arch\":\"", name_key = "\"name\":\"", ns_key = "\"ns_per_call\":";
+	auto position = text.find(arch_key);
+	if (position == std::string::npos) {
+		return false;
+	}
+	position += arch_key.size();
+	arch = text.substr(position, text.find('"', position) - position);
+
+	while ((position = text.find(name_key, position)) != std::string::npos) {
+		position += name_key.size();
+		auto end = text.find('"', position);
+		auto ns = text.find(ns_key, end);
+		if (end == std::string::npos || ns == std::string::npos) {
+			return false;
+		}
+		results[text.substr(position, end - position)] = std::strtod(text.c_str() + ns + ns_key.size(), nullptr);
+		position = ns;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	std::string filter, json, baseline;
+	std::size_t calls = 200000;
+	int rounds = 5;
+	double tolerance = 10.0;
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+		if (value == nullptr) {
+			calls = 0;
+			break;
+		}
+		if (option == "--filter") {
+			filter = value;
+		} else if (option == "--calls") {
+			calls = std::strtoul(value, nullptr, 10);
+		} else if (option == "--rounds") {
+			rounds = std::atoi(value);
+		} else if (option == "--json") {
+			json = value;
+		} else if (option == "--baseline") {
+			baseline = value;
+		} else if (option == "--tolerance") {
+			tolerance = std::strtod(value, nullptr);
+		} else {
+			calls = 0;
+			break;
+		}
+		i++;
+	}
+	if (calls == 0 || rounds <= 0) {
+		std::fprintf(stderr, "Usage : %s [--filter <text>] [--calls <count>] [--rounds <count>] [--json <file>] [--baseline <file>] [--tolerance <percent>]\n", argv[0]);
+		KHook::Shutdown();
+		return EXIT_FAILURE;
+	}
+
+	std::string baseline_arch;
+	std::unordered_map<std::string, double> baseline_results;
+	if (!baseline.empty()) {
+		if (!ReadJson(baseline, baseline_arch, baseline_results)) {
+			std::fprintf(stderr, "Couldn't read the baseline %s\n", baseline.c_str());
+			KHook::Shutdown();
+			return EXIT_FAILURE;
+		}
+		if (baseline_arch != g_arch) {
+			std::fprintf(stderr, "The baseline %s was measured on %s, not %s\n", baseline.c_str(), baseline_arch.c_str(), g_arch);
+			KHook::Shutdown();
+			return EXIT_FAILURE;
+		}
+	}
+
+	Cases cases;
+	Add<1000, Kind::Function, IntSignature, Path::Ignore, -1>(cases, "", KHook::DispatchMode::Dedicated);
+	Add<1001, Kind::Function, FloatSignature, Path::Ignore, -1>(cases, "", KHook::DispatchMode::Dedicated);
+	Add<1002, Kind::Function, MixedSignature, Path::Ignore, -1>(cases, "", KHook::DispatchMode::Dedicated);
+	Add<1003, Kind::Function, StackSignature, Path::Ignore, -1>(cases, "", KHook::DispatchMode::Dedicated);
+	Add<1004, Kind::Function, VoidSignature, Path::Ignore, -1>(cases, "", KHook::DispatchMode::Dedicated);
+	Add<1005, Kind::Function, StructSignature, Path::Ignore, -1>(cases, "", KHook::DispatchMode::Dedicated);
+	cases.push_back(std::make_unique<SafetyhookCase<1006>>());
+	AddMode<0>(cases, "dedicated", KHook::DispatchMode::Dedicated);
+	AddMode<100>(cases, "shared", KHook::DispatchMode::Shared);
+
+	std::printf("%s, fastest of %d rounds of %zu calls\n", g_arch, rounds, calls);
+	std::printf("%-36s %12s", "case", "ns/call");
+	if (!baseline.empty()) {
+		std::printf(" %12s %10s", "baseline", "change");
+	}
+	std::printf("\n");
+
+	std::vector<Result> results;
+	std::size_t regressions = 0;
+	for (auto& bench : cases) {
+		if (bench->name.find(filter) == std::string::npos) {
+			continue;
+		}
+		double ns = Measure(*bench, calls, rounds);
+		results.push_back({ bench->name, ns });
+		std::printf("%-36s %12.2f", bench->name.c_str(), ns);
+
+		auto it = baseline_results.find(bench->name);
+		if (it != baseline_results.end() && it->second > 0.0) {
+			double change = (ns - it->second) * 100.0 / it->second;
+			bool regressed = (change > tolerance);
+			regressions += regressed;
+			std::printf(" %12.2f %+9.1f%%%s", it->second, change, regressed ? " regression" : "");
+		}
+		std::printf("\n");
+	}
+
+	KHook::Shutdown();
+
+	if (!json.empty() && !WriteJson(json, calls, rounds, results)) {
+		std::fprintf(stderr, "Couldn't write %s\n", json.c_str());
+		return EXIT_FAILURE;
+	}
+	if (regressions != 0) {
+		std::fprintf(stderr, "%zu cases are more than %.1f%% slower than the baseline\n", regressions, tolerance);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Executable memory footprint of dedicated vs shared dispatch code
+// Usage : khook_bench_footprint [hook count]
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "khook.hpp"
+#include "khook/asm.hpp"
+#include "vtable_storage.hpp"
+
+class Target {
+public:
+	virtual ~Target() = default;
+	virtual int Get(int value) { return value; }
+};
+
+static std::size_t g_pre_calls = 0;
+
+static KHook::Return<int> Target_Get(Target*, int) {
+	g_pre_calls++;
+	return { KHook::Action::Ignore, 0 };
+}
+
+using TargetHook = KHook::Virtual<Target, int, int>;
+
+struct Instance {
+	std::unique_ptr<Target> object;
+	std::unique_ptr<TargetHook> hook;
+};
+
+static void Measure(const char* name, KHook::DispatchMode mode, std::size_t count, VtableStorage& vtables, std::vector<Instance>& instances) {
+	KHook::SetDispatchMode(mode);
+
+	std::size_t first = instances.size();
+	for (std::size_t i = 0; i < count; i++) {
+		Instance instance;
+		instance.object = std::make_unique<Target>();
+		void** original = *reinterpret_cast<void***>(instance.object.get());
+		*reinterpret_cast<void***>(instance.object.get()) = vtables.Copy(i, original);
+		instance.hook = std::make_unique<TargetHook>(&Target::Get, Target_Get, nullptr);
+		instances.push_back(std::move(instance));
+	}
+
+	auto before = KHook::Asm::Allocator.GetUsage();
+	for (std::size_t i = first; i < instances.size(); i++) {
+		instances[i].hook->Add(instances[i].object.get());
+	}
+	auto after = KHook::Asm::Allocator.GetUsage();
+
+	// Make sure every detour is functional
+	g_pre_calls = 0;
+	for (std::size_t i = first; i < instances.size(); i++) {
+		Target* volatile object = instances[i].object.get();
+		if (object->Get(static_cast<int>(i)) != static_cast<int>(i)) {
+			std::fprintf(stderr, "%s: wrong return value\n", name);
+			std::exit(EXIT_FAILURE);
+		}
+	}
+	if (g_pre_calls != count) {
+		std::fprintf(stderr, "%s: %zu/%zu detours called\n", name, g_pre_calls, count);
+		std::exit(EXIT_FAILURE);
+	}
+
+	std::size_t used = after.used - before.used;
+	std::size_t mapped = after.mapped - before.mapped;
+	std::printf("%-10s %8zu %12zu %12.1f %12zu\n", name, count, used, static_cast<double>(used) / count, mapped);
+}
+
+int main(int argc, char* argv[]) {
+	std::size_t count = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 1000;
+	if (count == 0) {
+		std::fprintf(stderr, "Usage : %s [hook count]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::printf("%-10s %8s %12s %12s %12s\n", "mode", "hooks", "used_bytes", "bytes/hook", "mapped_bytes");
+	// Every detour stays alive until the end, so both measures are independent
+	VtableStorage dedicated_vtables(count), shared_vtables(count);
+	std::vector<Instance> instances;
+	instances.reserve(count * 2);
+	Measure("dedicated", KHook::DispatchMode::Dedicated, count, dedicated_vtables, instances);
+	Measure("shared", KHook::DispatchMode::Shared, count, shared_vtables, instances);
+
+	KHook::Shutdown();
+	instances.clear();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Hook insertion under sustained calls: caller threads keep a hooked function in flight at all times,
+// while hooks are added through KHook::Virtual's Add and through the synchronous KHook::SetupVirtualHook.
+// Fails if any insertion takes longer than the bound, or if an inserted hook isn't called
+// Usage : khook_bench_insertion [caller threads] [hooks] [bound in milliseconds]
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "khook.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Every mode gets its own class, so its own vtable and detour
+template<int MODE>
+class Target {
+public:
+	virtual ~Target() = default;
+	virtual int Get(int value) { return value + 1; }
+};
+
+// Calls every hook went through, indexed by the order they were added in
+static std::vector<std::atomic<std::uint32_t>> g_called;
+
+template<int MODE>
+class CountingHook : public SyncVirtual<Target<MODE>, int, int> {
+	using Base = SyncVirtual<Target<MODE>, int, int>;
+public:
+	explicit CountingHook(std::size_t index) : Base(&Target<MODE>::Get, this, &CountingHook::Pre, nullptr), _index(index) {}
+
+	KHook::Return<int> Pre(Target<MODE>*, int) {
+		g_called[_index].fetch_add(1, std::memory_order_relaxed);
+		return { KHook::Action::Ignore, 0 };
+	}
+
+private:
+	std::size_t _index;
+};
+
+static double Milliseconds(std::uint64_t nanoseconds) {
+	return nanoseconds / 1e6;
+}
+
+template<int MODE>
+static bool Measure(const char* mode_name, KHook::DispatchMode mode, std::size_t threads, std::size_t hooks, std::chrono::milliseconds bound) {
+	KHook::SetDispatchMode(mode);
+	static Target<MODE> target;
+	g_called = std::vector<std::atomic<std::uint32_t>>(hooks * 2 + 1);
+
+	// The first hook of a detour is always active right away, the measured ones go into a busy detour
+	std::vector<std::unique_ptr<CountingHook<MODE>>> installed;
+	installed.push_back(std::make_unique<CountingHook<MODE>>(hooks * 2));
+	installed.back()->Add(&target);
+
+	std::atomic<bool> stop = false;
+	std::atomic<bool> failed = false;
+	std::vector<std::thread> callers;
+	for (std::size_t i = 0; i < threads; i++) {
+		callers.emplace_back([&stop, &failed]() {
+			Target<MODE>* volatile object = &target;
+			for (int value = 0; !stop.load(std::memory_order_relaxed); value++) {
+				if (object->Get(value) != value + 1) {
+					failed = true;
+				}
+			}
+		});
+	}
+	// Lets every caller get going
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	std::vector<std::uint64_t> async_latencies, sync_latencies;
+	std::size_t late = 0;
+	for (std::size_t i = 0; i < hooks; i++) {
+		auto hook = std::make_unique<CountingHook<MODE>>(i * 2);
+		hook->Add(&target);
+		auto id = hook->Id();
+		installed.push_back(std::move(hook));
+		// Waits well past the bound, a late insertion is reported rather than mistaken for a lost one
+		KHook::HookLifecycle lifecycle = {};
+		if (!KHook::WaitActive(id, static_cast<std::uint32_t>(bound.count() * 10)) || !KHook::GetHookLifecycle(id, lifecycle)) {
+			std::fprintf(stderr, "%s: hook %zu was never inserted\n", mode_name, i);
+			failed = true;
+			break;
+		}
+		auto latency = lifecycle.activated - lifecycle.enqueued;
+		late += (latency > static_cast<std::uint64_t>(std::chrono::nanoseconds(bound).count()));
+		async_latencies.push_back(latency);
+
+		hook = std::make_unique<CountingHook<MODE>>(i * 2 + 1);
+		auto start = Clock::now();
+		id = hook->AddSync(&target);
+		auto inserted = Clock::now();
+		installed.push_back(std::move(hook));
+		if (!KHook::IsActive(id)) {
+			std::fprintf(stderr, "%s: synchronous hook %zu wasn't inserted on return\n", mode_name, i);
+			failed = true;
+			break;
+		}
+		sync_latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(inserted - start).count());
+	}
+
+	// Every hook must have been called once active, the callers are still going
+	auto deadline = Clock::now() + std::chrono::seconds(5);
+	std::size_t uncalled = 0;
+	for (;;) {
+		uncalled = 0;
+		for (std::size_t i = 0; i < installed.size(); i++) {
+			std::size_t index = (i == 0) ? hooks * 2 : i - 1;
+			uncalled += (g_called[index].load(std::memory_order_relaxed) == 0);
+		}
+		if (uncalled == 0 || Clock::now() > deadline) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	stop = true;
+	for (auto& caller : callers) {
+		caller.join();
+	}
+	for (auto& hook : installed) {
+		KHook::RemoveHook(hook->Id(), false);
+	}
+
+	auto async50 = Percentile(async_latencies, 0.5), async99 = Percentile(async_latencies, 0.99);
+	auto async_max = async_latencies.empty() ? 0 : async_latencies.back();
+	auto sync50 = Percentile(sync_latencies, 0.5);
+	auto sync_max = sync_latencies.empty() ? 0 : sync_latencies.back();
+	std::printf("%-10s %7zu %6zu %9.3f %9.3f %9.3f %9.3f %9.3f %6zu %8zu\n",
+		mode_name, threads, async_latencies.size(), Milliseconds(async50), Milliseconds(async99), Milliseconds(async_max),
+		Milliseconds(sync50), Milliseconds(sync_max), late, uncalled);
+	std::fflush(stdout);
+
+	if (failed) {
+		std::fprintf(stderr, "%s: wrong return value or missing hook\n", mode_name);
+		return false;
+	}
+	if (late != 0) {
+		std::fprintf(stderr, "%s: %zu insertions took longer than %lld ms\n", mode_name, late, static_cast<long long>(bound.count()));
+		return false;
+	}
+	if (uncalled != 0) {
+		std::fprintf(stderr, "%s: %zu active hooks were never called\n", mode_name, uncalled);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	std::size_t threads = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 32;
+	std::size_t hooks = (argc > 2) ? std::strtoul(argv[2], nullptr, 10) : 100;
+	long milliseconds = (argc > 3) ? std::strtol(argv[3], nullptr, 10) : 100;
+	if (threads == 0 || hooks == 0 || milliseconds <= 0) {
+		std::fprintf(stderr, "Usage : %s [caller threads] [hooks] [bound in milliseconds]\n", argv[0]);
+		KHook::Shutdown();
+		return EXIT_FAILURE;
+	}
+	std::chrono::milliseconds bound(milliseconds);
+
+	std::printf("%u hardware threads, insertions must land within %ld ms\n", std::thread::hardware_concurrency(), milliseconds);
+	std::printf("%-10s %7s %6s %9s %9s %9s %9s %9s %6s %8s\n", "mode", "callers", "hooks",
+		"async50", "async99", "asyncmax", "sync50", "syncmax", "late", "uncalled");
+	bool success = Measure<0>("dedicated", KHook::DispatchMode::Dedicated, threads, hooks, bound)
+		&& Measure<1>("shared", KHook::DispatchMode::Shared, threads, hooks, bound);
+
+	KHook::Shutdown();
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
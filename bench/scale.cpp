@@ -0,0 +1,359 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// KHook at scale: installs 1k, 10k and up to 50k hooks through every hook template, each on a function of its own,
+// then removes them all and checks nothing was left behind
+// Usage : khook_bench_scale [max hooks]
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "khook.hpp"
+#include "khook/asm.hpp"
+#include "khook/memory.hpp"
+#include "vtable_storage.hpp"
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define BENCH_HEAP_USAGE
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+// Heap bytes in use by the whole process, -1 if unknown
+static double HeapUsed() {
+#ifdef BENCH_HEAP_USAGE
+	return static_cast<double>(mallinfo2().uordblks);
+#else
+	return -1.0;
+#endif
+}
+
+static double Milliseconds(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Functions returning their argument plus one, emitted at runtime so any number of distinct functions can be hooked.
+// They start with a 5 bytes NOP, the detour's jump never spills over the next one
+class CodeStorage {
+public:
+	static constexpr std::size_t STRIDE = 16;
+
+	CodeStorage(std::size_t count, bool member) {
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef _WIN32
+		// lea eax, [rcx + 1] or [rdx + 1] ; ret
+		static const std::uint8_t function[] = { 0x0F, 0x1F, 0x44, 0x00, 0x00, 0x8D, 0x41, 0x01, 0xC3 };
+		static const std::uint8_t method[] = { 0x0F, 0x1F, 0x44, 0x00, 0x00, 0x8D, 0x42, 0x01, 0xC3 };
+#else
+		// lea eax, [rdi + 1] or [rsi + 1] ; ret
+		static const std::uint8_t function[] = { 0x0F, 0x1F, 0x44, 0x00, 0x00, 0x8D, 0x47, 0x01, 0xC3 };
+		static const std::uint8_t method[] = { 0x0F, 0x1F, 0x44, 0x00, 0x00, 0x8D, 0x46, 0x01, 0xC3 };
+#endif
+#else
+		// mov eax, [esp + 4] ; inc eax ; ret
+		static const std::uint8_t function[] = { 0x0F, 0x1F, 0x44, 0x00, 0x00, 0x8B, 0x44, 0x24, 0x04, 0x40, 0xC3 };
+#ifdef _WIN32
+		// __thiscall, ret 4
+		static const std::uint8_t method[] = { 0x0F, 0x1F, 0x44, 0x00, 0x00, 0x8B, 0x44, 0x24, 0x04, 0x40, 0xC2, 0x04, 0x00 };
+#else
+		// this is pushed first
+		static const std::uint8_t method[] = { 0x0F, 0x1F, 0x44, 0x00, 0x00, 0x8B, 0x44, 0x24, 0x08, 0x40, 0xC3 };
+#endif
+#endif
+		static_assert(sizeof(function) <= STRIDE && sizeof(method) <= STRIDE);
+
+		std::size_t page = KHook::Asm::Allocator.GetPageSize();
+		_size = (count * STRIDE + page - 1) & ~(page - 1);
+		_buffer = std::make_unique<unsigned char[]>(_size + page);
+		_code = reinterpret_cast<unsigned char*>((reinterpret_cast<std::uintptr_t>(_buffer.get()) + page - 1) & ~(page - 1));
+		std::memset(_code, 0xCC, _size);
+		for (std::size_t i = 0; i < count; i++) {
+			if (member) {
+				std::memcpy(_code + i * STRIDE, method, sizeof(method));
+			} else {
+				std::memcpy(_code + i * STRIDE, function, sizeof(function));
+			}
+		}
+		KHook::Memory::SetAccess(_code, _size, KHook::Memory::Flags::READ | KHook::Memory::Flags::EXECUTE);
+	}
+
+	~CodeStorage() {
+		KHook::Memory::SetAccess(_code, _size, KHook::Memory::Flags::READ | KHook::Memory::Flags::WRITE);
+	}
+
+	void* Get(std::size_t i) {
+		return _code + i * STRIDE;
+	}
+private:
+	std::unique_ptr<unsigned char[]> _buffer;
+	unsigned char* _code;
+	std::size_t _size;
+};
+
+class Object {};
+
+class Target {
+public:
+	virtual ~Target() = default;
+	virtual int Get(int value) { return value + 1; }
+};
+
+static std::size_t g_pre_calls = 0;
+
+static KHook::Return<int> Function_Pre(int) {
+	g_pre_calls++;
+	return { KHook::Action::Ignore, 0 };
+}
+
+static KHook::Return<int> Member_Pre(Object*, int) {
+	g_pre_calls++;
+	return { KHook::Action::Ignore, 0 };
+}
+
+static KHook::Return<int> Virtual_Pre(Target*, int) {
+	g_pre_calls++;
+	return { KHook::Action::Ignore, 0 };
+}
+
+// Targets and hooks of one template. The targets must outlive KHook::Shutdown, their detours stay in place until then
+class Hooks {
+public:
+	virtual ~Hooks() = default;
+};
+
+class FunctionHooks final : public Hooks {
+	using Hook = KHook::Function<int, int>;
+	using Function = int (*)(int);
+public:
+	static constexpr const char* NAME = "function";
+
+	explicit FunctionHooks(std::size_t count) : _code(count, false) {
+		_hooks.reserve(count);
+	}
+
+	void Install(std::size_t i) {
+		_hooks.push_back(std::make_unique<Hook>(reinterpret_cast<Function>(_code.Get(i)), Function_Pre, nullptr));
+	}
+
+	int Call(std::size_t i, int value) {
+		Function volatile function = reinterpret_cast<Function>(_code.Get(i));
+		return function(value);
+	}
+
+	void Clear() {
+		_hooks.clear();
+	}
+private:
+	CodeStorage _code;
+	std::vector<std::unique_ptr<Hook>> _hooks;
+};
+
+class MemberHooks final : public Hooks {
+	using Hook = KHook::Member<Object, int, int>;
+public:
+	static constexpr const char* NAME = "member";
+
+	explicit MemberHooks(std::size_t count) : _code(count, true) {
+		_hooks.reserve(count);
+	}
+
+	void Install(std::size_t i) {
+		_hooks.push_back(std::make_unique<Hook>(_code.Get(i), Member_Pre, nullptr));
+	}
+
+	int Call(std::size_t i, int value) {
+		Object* volatile object = &_object;
+		return (object->*KHook::BuildMFP<Object, int, int>(_code.Get(i)))(value);
+	}
+
+	void Clear() {
+		_hooks.clear();
+	}
+private:
+	CodeStorage _code;
+	Object _object;
+	std::vector<std::unique_ptr<Hook>> _hooks;
+};
+
+class VirtualHooks final : public Hooks {
+	using Hook = KHook::Virtual<Target, int, int>;
+public:
+	static constexpr const char* NAME = "virtual";
+
+	explicit VirtualHooks(std::size_t count) : _vtables(count) {
+		_objects.reserve(count);
+		_hooks.reserve(count);
+		for (std::size_t i = 0; i < count; i++) {
+			auto object = std::make_unique<Target>();
+			void** original = *reinterpret_cast<void***>(object.get());
+			*reinterpret_cast<void***>(object.get()) = _vtables.Copy(i, original);
+			_objects.push_back(std::move(object));
+		}
+	}
+
+	void Install(std::size_t i) {
+		_hooks.push_back(std::make_unique<Hook>(&Target::Get, Virtual_Pre, nullptr));
+		_hooks.back()->Add(_objects[i].get());
+	}
+
+	int Call(std::size_t i, int value) {
+		Target* volatile object = _objects[i].get();
+		return object->Get(value);
+	}
+
+	void Clear() {
+		_hooks.clear();
+	}
+private:
+	VtableStorage _vtables;
+	std::vector<std::unique_ptr<Target>> _objects;
+	std::vector<std::unique_ptr<Hook>> _hooks;
+};
+
+template<typename HOOKS>
+static void Verify(HOOKS& hooks, std::size_t count) {
+	g_pre_calls = 0;
+	for (std::size_t i = 0; i < count; i++) {
+		if (hooks.Call(i, static_cast<int>(i)) != static_cast<int>(i) + 1) {
+			std::fprintf(stderr, "%s %zu: wrong return value\n", HOOKS::NAME, count);
+			std::exit(EXIT_FAILURE);
+		}
+	}
+	if (g_pre_calls != count) {
+		std::fprintf(stderr, "%s %zu: %zu/%zu detours called\n", HOOKS::NAME, count, g_pre_calls, count);
+		std::exit(EXIT_FAILURE);
+	}
+}
+
+// Nanoseconds per call, through a single detour then through all of them in turn
+template<typename HOOKS>
+static void Latency(HOOKS& hooks, std::size_t count, double& hot, double& spread) {
+	static constexpr std::size_t CALLS = 200000;
+	auto start = Clock::now();
+	for (std::size_t i = 0; i < CALLS; i++) {
+		hooks.Call(0, 0);
+	}
+	hot = Milliseconds(start) * 1e6 / CALLS;
+
+	std::size_t calls = std::max(count, CALLS);
+	start = Clock::now();
+	for (std::size_t i = 0; i < calls; i++) {
+		hooks.Call(i % count, 0);
+	}
+	spread = Milliseconds(start) * 1e6 / calls;
+}
+
+template<typename HOOKS>
+static void Measure(std::size_t count, std::vector<std::unique_ptr<Hooks>>& kept) {
+	auto owned = std::make_unique<HOOKS>(count);
+	auto& hooks = *owned;
+	kept.push_back(std::move(owned));
+
+	auto before = KHook::GetMemoryStats();
+	double heap_before = HeapUsed();
+
+	// Every hook gets a new detour, which doesn't wait for the insertion thread
+	auto start = Clock::now();
+	for (std::size_t i = 0; i < count; i++) {
+		hooks.Install(i);
+	}
+	double install = Milliseconds(start);
+	Verify(hooks, count);
+
+	auto installed = KHook::GetMemoryStats();
+	double heap_installed = HeapUsed();
+
+	double hot = 0.0, spread = 0.0;
+	Latency(hooks, count, hot, spread);
+
+	start = Clock::now();
+	hooks.Clear();
+	double remove = Milliseconds(start);
+
+	// The detours and their code stay until Shutdown, the hooks mustn't
+	auto removed = KHook::GetMemoryStats();
+	double heap_removed = HeapUsed();
+	if (removed.callbacks != before.callbacks || removed.associated_hooks != before.associated_hooks
+		|| removed.pending_inserts != 0 || removed.pending_deletes != 0) {
+		std::fprintf(stderr, "%s %zu: %llu callbacks, %llu associated hooks and %llu pending operations left behind\n", HOOKS::NAME, count,
+			static_cast<unsigned long long>(removed.callbacks - before.callbacks),
+			static_cast<unsigned long long>(removed.associated_hooks - before.associated_hooks),
+			static_cast<unsigned long long>(removed.pending_inserts + removed.pending_deletes));
+		std::exit(EXIT_FAILURE);
+	}
+
+	double per_hook = 1.0 / count;
+	double khook_heap = static_cast<double>((installed.detour_bytes + installed.callback_bytes + installed.table_bytes)
+		- (before.detour_bytes + before.callback_bytes + before.table_bytes));
+	std::printf("%-10s %7zu %10.2f %8.2f %10.1f %10.1f %10.1f %8.2f %9.2f %10.2f %10.1f %10.1f\n",
+		HOOKS::NAME, count, install, install * 1e3 * per_hook,
+		static_cast<double>(installed.code_used - before.code_used) * per_hook, khook_heap * per_hook,
+		(heap_before < 0.0) ? -1.0 : (heap_installed - heap_before) * per_hook,
+		hot, spread, remove,
+		static_cast<double>(removed.code_used - before.code_used) * per_hook,
+		(heap_before < 0.0) ? -1.0 : (heap_removed - heap_before) * per_hook);
+	std::fflush(stdout);
+}
+
+template<typename HOOKS>
+static void InstallForShutdown(std::size_t count, std::vector<std::unique_ptr<Hooks>>& kept) {
+	auto owned = std::make_unique<HOOKS>(count);
+	for (std::size_t i = 0; i < count; i++) {
+		owned->Install(i);
+	}
+	Verify(*owned, count);
+	kept.push_back(std::move(owned));
+}
+
+int main(int argc, char* argv[]) {
+	std::size_t max_hooks = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 50000;
+	if (max_hooks == 0) {
+		std::fprintf(stderr, "Usage : %s [max hooks]\n", argv[0]);
+		KHook::Shutdown();
+		return EXIT_FAILURE;
+	}
+	std::vector<std::size_t> counts;
+	for (std::size_t count : { 1000, 10000, 50000 }) {
+		if (count < max_hooks) {
+			counts.push_back(count);
+		}
+	}
+	counts.push_back(max_hooks);
+
+	std::printf("Per hook: install time, executable bytes, KHook heap bytes and process heap bytes (-1 if unknown).\n"
+		"Latencies in ns per call, through one detour then through every detour in turn. Kept: what removal left behind per hook.\n");
+	std::printf("%-10s %7s %10s %8s %10s %10s %10s %8s %9s %10s %10s %10s\n", "template", "hooks", "install_ms", "us/hook",
+		"exec_B", "khook_B", "heap_B", "hot_ns", "spread_ns", "remove_ms", "kept_exec", "kept_heap");
+
+	std::vector<std::unique_ptr<Hooks>> kept;
+	for (auto count : counts) {
+		Measure<FunctionHooks>(count, kept);
+		Measure<MemberHooks>(count, kept);
+		Measure<VirtualHooks>(count, kept);
+	}
+
+	// Shutdown with the biggest count of live hooks of every template
+	InstallForShutdown<FunctionHooks>(max_hooks, kept);
+	InstallForShutdown<MemberHooks>(max_hooks, kept);
+	InstallForShutdown<VirtualHooks>(max_hooks, kept);
+	auto memory = KHook::GetMemoryStats();
+	auto start = Clock::now();
+	KHook::Shutdown();
+	std::printf("\nShutdown: %.2f ms for %llu detours and %llu hooks\n", Milliseconds(start),
+		static_cast<unsigned long long>(memory.detours), static_cast<unsigned long long>(memory.associated_hooks));
+
+	kept.clear();
+	return EXIT_SUCCESS;
+}
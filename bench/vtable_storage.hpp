@@ -0,0 +1,52 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "khook.hpp"
+#include "khook/asm.hpp"
+
+// Layout of a class with a virtual destructor followed by a single virtual function
+#ifdef _WIN32
+static constexpr std::size_t VTABLE_PREFIX = 1; // Complete object locator
+static constexpr std::size_t VTABLE_COPY = VTABLE_PREFIX + 2; // Scalar deleting destructor, Get
+#else
+static constexpr std::size_t VTABLE_PREFIX = 2; // Offset to top, type info
+static constexpr std::size_t VTABLE_COPY = VTABLE_PREFIX + 3; // Complete & deleting destructors, Get
+#endif
+
+// Every object gets its own vtable copy, so every hook gets its own detour.
+// Detouring makes vtables read-only, so the copies live on their own pages
+class VtableStorage {
+public:
+	VtableStorage(std::size_t count) {
+		std::size_t page = KHook::Asm::Allocator.GetPageSize();
+		_size = (count * VTABLE_COPY * sizeof(void*) + page - 1) & ~(page - 1);
+		_buffer = std::make_unique<unsigned char[]>(_size + page);
+		_pages = reinterpret_cast<void**>((reinterpret_cast<std::uintptr_t>(_buffer.get()) + page - 1) & ~(page - 1));
+	}
+
+	~VtableStorage() {
+		KHook::Memory::SetAccess(_pages, _size, KHook::Memory::Flags::READ | KHook::Memory::Flags::WRITE);
+	}
+
+	void** Copy(std::size_t i, void** original) {
+		void** copy = _pages + i * VTABLE_COPY;
+		std::memcpy(copy, original - VTABLE_PREFIX, sizeof(void*) * VTABLE_COPY);
+		return copy + VTABLE_PREFIX;
+	}
+private:
+	std::unique_ptr<unsigned char[]> _buffer;
+	void** _pages;
+	std::size_t _size;
+};
@@ -15,6 +15,8 @@
 #include <iostream>
 #include <stdexcept>
 #include <mutex>
+#include <memory>
+#include <vector>
 
 #ifdef KHOOK_STANDALONE
 #ifdef KHOOK_EXPORT
@@ -61,6 +63,8 @@ struct Return<void> {
 };
 
 class __Hook {
+public:
+	virtual ~__Hook() = default;
 };
 
 template<typename RETURN>
@@ -87,6 +91,164 @@ inline Hook<void>::Hook() {}
 using HookID_t = std::uint32_t;
 constexpr HookID_t INVALID_HOOK = -1;
 
+enum class DispatchMode : std::uint8_t {
+	// Every detour generates its own dispatch code
+	Dedicated = 0,
+	// Detours only generate a small entry thunk jumping into dispatch code shared by all of them (x86_64 only)
+	Shared
+};
+
+enum PerfOutput : std::uint8_t {
+	// /tmp/perf-<pid>.map, read as is by perf report and perf top
+	PERF_MAP = (1 << 0),
+	// jit-<pid>.dump in $JITDUMPDIR or /tmp, merged into a recording by perf inject --jit
+	PERF_JITDUMP = (1 << 1)
+};
+
+struct CodeArenaStats {
+	// Size of the arena in bytes, 0 if there's none
+	std::size_t reserved;
+	// Bytes of the arena carved into slabs
+	std::size_t carved;
+	// Bytes of JIT code handed out from those slabs
+	std::size_t used;
+	// Whether the arena was successfully advised for transparent huge pages, which doesn't mean any is used
+	bool huge_pages_advised;
+	// Bytes of the arena actually backed by huge pages, from /proc/self/smaps. Always 0 on Windows
+	std::size_t huge_page_bytes;
+	// Whether the arena is locked in memory
+	bool locked;
+};
+
+struct MemoryStats {
+	// Address space mapped for generated code, the arena included
+	std::size_t code_mapped;
+	// Bytes of generated code handed out, rounded up to their allocation block
+	std::size_t code_used;
+	// Slabs shared by small blocks of code, the empty ones kept for reuse included
+	std::size_t code_slabs;
+	std::size_t code_spare_slabs;
+	// Mappings holding a single large block of code
+	std::size_t code_dedicated_mappings;
+	// Free bytes stranded inside the slabs, only blocks of the same size class can use them
+	std::size_t code_fragmented;
+	// Live detours and the exact size of their code, entry thunks only under DispatchMode::Shared
+	std::size_t detours;
+	std::size_t detour_code;
+	std::size_t detour_bytes;
+	// Code shared by the detours under DispatchMode::Shared, never freed
+	std::size_t shared_dispatchers;
+	std::size_t shared_dispatcher_code;
+	// Hooks attached to the detours, and the heap their nodes take
+	std::size_t callbacks;
+	std::size_t callback_bytes;
+	// Entries of the hook tables, and the heap they take
+	std::size_t associated_hooks;
+	std::size_t pending_inserts;
+	std::size_t pending_deletes;
+	std::size_t table_bytes;
+	// Threads that went through a detour and the heap they hold to dispatch, freed when they exit
+	std::size_t dispatch_threads;
+	std::size_t dispatch_thread_bytes;
+	// Instances added to every KHook::Virtual, and those removed by their cleanup detour so far (see Virtual::SetCleanup)
+	std::size_t hooked_instances;
+	std::size_t instance_cleanups;
+};
+
+// One entry of SetupHooks, the parameters are those of SetupHook and SetupVirtualHook
+struct HookSetup {
+	// Address of the function to hook, if nullptr vtable[index] is hooked instead
+	void* function;
+	void** vtable;
+	int index;
+	void* context;
+	void* removed_function;
+	void* pre;
+	void* post;
+	void* make_return;
+	void* make_call_original;
+	bool async;
+	const char* name;
+	// Filled by SetupHooks, the created hook id on success, INVALID_HOOK otherwise
+	HookID_t id;
+};
+
+constexpr std::size_t STATS_HISTOGRAM_BUCKETS = 32;
+
+struct HookStats {
+	// One call in sample_rate is timed, every counter below is estimated from those
+	std::uint32_t sample_rate;
+	// Hooked calls, recalls excluded
+	std::uint64_t calls;
+	// Calls whose final action was Supersede
+	std::uint64_t supersedes;
+	// Calls whose final action was Override
+	std::uint64_t overrides;
+	// Timestamp counter cycles spent in those calls, from the detour entry to the end of the post callbacks
+	std::uint64_t cycles;
+	// Bucket i counts the calls that took [2^i, 2^(i+1)) cycles, the last bucket also holds every longer call
+	std::uint64_t histogram[STATS_HISTOGRAM_BUCKETS];
+};
+
+constexpr std::size_t LIFECYCLE_HISTOGRAM_BUCKETS = 32;
+
+struct HookLifecycle {
+	// Steady clock nanoseconds, 0 for the steps that didn't happen (yet)
+	std::uint64_t enqueued;
+	std::uint64_t activated;
+	// Only set by asynchronous removals
+	std::uint64_t removal_requested;
+	// Whether the callbacks are called
+	bool active;
+};
+
+struct LifecycleStats {
+	// Asynchronous insertions that landed
+	std::uint64_t inserts;
+	// Asynchronous removals that completed
+	std::uint64_t removals;
+	// Hooks waiting for their insertion
+	std::uint64_t pending;
+	// Bucket i counts the operations that took [2^i, 2^(i+1)) nanoseconds, the last bucket also holds every longer one.
+	// From the asynchronous setup to the activation
+	std::uint64_t insert_histogram[LIFECYCLE_HISTOGRAM_BUCKETS];
+	// From the asynchronous RemoveHook to the removed callback
+	std::uint64_t remove_histogram[LIFECYCLE_HISTOGRAM_BUCKETS];
+};
+
+struct AuditStats {
+	// Detour entries, recalls excluded
+	std::uint64_t calls;
+	// Heap operations made by the dispatcher, copies of the return values included
+	std::uint64_t allocations;
+	std::uint64_t deallocations;
+	// Locks taken by the dispatcher
+	std::uint64_t locks;
+	// System calls made by the dispatcher
+	std::uint64_t syscalls;
+};
+
+enum class CallbackPhase : std::uint8_t {
+	Pre = 0,
+	Original,
+	Post
+};
+
+struct CallbackStats {
+	// Hook the callback belongs to, INVALID_HOOK for the original function
+	HookID_t id;
+	// Context pointer of that hook, nullptr for the original function
+	void* context;
+	CallbackPhase phase;
+	std::uint64_t calls;
+	// Timestamp counter cycles spent in the callback, including any nested recall
+	std::uint64_t cycles;
+	// Percentiles of the cycles per call, within 1/8 of the exact value
+	std::uint64_t p50;
+	std::uint64_t p99;
+	std::uint64_t p999;
+};
+
 template<typename CLASS, typename RETURN, typename... ARGS>
 using __mfp_const__ = RETURN (CLASS::*)(ARGS...) const;
 
@@ -146,9 +308,10 @@ inline __mfp_const__<C, R, A...> BuildMFP(const void* addr) {
  * @param make_return Function to call with the original this ptr (if any), to make the final return value.
  * @param make_call_original Function to call with the original this ptr (if any), to call the original function and store the return value if needed.
  * @param async By default set to false. If set to true, the hook will be added synchronously. Beware if performed while the hooked function is processing this could deadlock.
+ * @param name Symbol naming the detour code for profilers, see SetPerfOutput. Only used if the detour is created by this call, nullptr names it after the function address.
  * @return The created hook id on success, INVALID_HOOK otherwise.
  */
-KHOOK_API HookID_t SetupHook(void* function, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async = false);
+KHOOK_API HookID_t SetupHook(void* function, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async = false, const char* name = nullptr);
 
 /**
  * Creates a hook around the given function retrieved from a vtable.
@@ -162,18 +325,43 @@ KHOOK_API HookID_t SetupHook(void* function, void* context, void* removed_functi
  * @param make_return Function to call with the original this ptr (if any), to make the final return value.
  * @param make_call_original Function to call with the original this ptr (if any), to call the original function and store the return value if needed.
  * @param async By default set to false. If set to true, the hook will be added synchronously. Beware if performed while the hooked function is processing this could deadlock.
+ * @param name Symbol naming the detour code for profilers, see SetPerfOutput. Only used if the detour is created by this call, nullptr names it after the vtable entry address.
  * @return The created hook id on success, INVALID_HOOK otherwise.
  */
-KHOOK_API HookID_t SetupVirtualHook(void** vtable, int index, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async = false);
+KHOOK_API HookID_t SetupVirtualHook(void** vtable, int index, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async = false, const char* name = nullptr);
+
+/**
+ * Creates many hooks at once, equivalent to calling SetupHook or SetupVirtualHook for each entry.
+ * The detours missing for those hooks have their code generated in parallel, then are all published at once.
+ * Meant for bulk installation at startup, where it's much faster than creating every hook one by one.
+ *
+ * @param hooks Hooks to create, the id of every entry is filled.
+ * @param count Number of entries.
+ * @param threads Maximum number of threads generating code, including the calling one. 0 uses one per hardware thread.
+ * @return The number of hooks successfully created.
+ */
+KHOOK_API std::size_t SetupHooks(HookSetup* hooks, std::size_t count, std::size_t threads = 0);
 
 /**
- * Removes a given hook. Beware if this is performed synchronously under a hook callback this could deadlock or crash.
+ * Removes a given hook. Its callbacks aren't called by the calls beginning afterwards, and it's told it's gone once
+ * the calls in flight are over. Beware if this is performed synchronously under a hook callback, the calls in flight
+ * on the calling thread can't be waited for and may still call the hook once this returns.
  * 
  * @param id The hook id.
  * @param async By default set to false. If set to true the hook will be removed asynchronously, you should make sure the associated functions and pointer are still loaded in memory until the hook is removed.
 */
 KHOOK_API void RemoveHook(HookID_t id, bool async = false);
 
+/**
+ * Removes several hooks. Synchronously, it waits once for the calls in flight through their detours instead of once
+ * per hook.
+ *
+ * @param ids The hook ids.
+ * @param count Number of ids.
+ * @param async By default set to false. Same as RemoveHook.
+*/
+KHOOK_API void RemoveHooks(const HookID_t* ids, std::size_t count, bool async = false);
+
 /**
  * Thread local function, only to be called under KHook callbacks. It returns the context pointer provided during SetupHook.
  *
@@ -340,6 +528,269 @@ KHOOK_API void* FindOriginalVirtual(void** vtable, int index);
  */
 KHOOK_API void Shutdown();
 
+/**
+ * Selects how the detours created from now on generate their code. Existing detours are left untouched.
+ * Shared dispatch cuts the executable memory per detour by an order of magnitude, at the cost of a jump
+ * and a few loads per call. On x86 it has no effect, Dedicated is always used.
+ *
+ * @param mode The dispatch mode, Dedicated by default.
+ */
+KHOOK_API void SetDispatchMode(DispatchMode mode);
+
+/**
+ * Reserves a contiguous arena that all subsequently generated code is packed into.
+ * The arena is 2MB aligned, backed by transparent huge pages if the system allows it and pre-faulted.
+ * Code generated before this call stays where it is, so it should be called before creating any hook.
+ *
+ * @param size Size of the arena in bytes, rounded up to 2MB. Generated code goes back to regular allocations once it's full.
+ * @param lock If set to true, the arena is also locked in memory (mlock/VirtualLock).
+ * @return True on success, false if an arena already exists or it couldn't be mapped.
+ */
+KHOOK_API bool SetupCodeArena(std::size_t size, bool lock = false);
+
+/**
+ * Reports the occupancy of the code arena.
+ *
+ * @return The arena statistics, reserved is 0 if SetupCodeArena was never successfully called.
+ */
+KHOOK_API CodeArenaStats GetCodeArenaStats();
+
+/**
+ * Reports the memory taken by KHook, to keep an eye on it as hooks come and go.
+ * Generated code is labelled khook-jit in /proc/<pid>/smaps on Linux, through the memfd name or PR_SET_VMA_ANON_NAME.
+ * Heap sizes are estimated from the container sizes, the allocator's own overhead isn't accounted.
+ *
+ * @return The memory statistics.
+ */
+KHOOK_API MemoryStats GetMemoryStats();
+
+/**
+ * Used by KHook::Virtual to keep the instance counters of GetMemoryStats.
+ *
+ * @param added Instances added, negative if removed.
+ * @param cleanup Whether they were removed by a cleanup detour.
+ */
+KHOOK_API void CountInstances(std::ptrdiff_t added, bool cleanup = false);
+
+/**
+ * Selects whether the detours created from now on are instrumented. Existing detours are left untouched.
+ * Instrumented detours time every call with the timestamp counter and count them per thread,
+ * detours created without it run the exact same code as before.
+ *
+ * @param enabled False by default.
+ */
+KHOOK_API void SetStatsEnabled(bool enabled);
+
+/**
+ * Aggregates the statistics of the detour a hook is attached to, all the hooks on that detour share them.
+ * It never blocks the hooked function, calls in flight may or may not be accounted.
+ *
+ * @param id The hook id.
+ * @param stats Filled with the statistics.
+ * @return True on success, false if the hook doesn't exist or its detour isn't instrumented.
+ */
+KHOOK_API bool GetStats(HookID_t id, HookStats& stats);
+
+/**
+ * Sets the sample rate of the instrumented detours created from now on.
+ *
+ * @param rate One call in rate is timed, 1 (the default) times every call.
+ */
+KHOOK_API void SetDefaultSampleRate(std::uint32_t rate);
+
+/**
+ * Changes the sample rate of the detour a hook is attached to, it takes effect immediately.
+ * Calls that aren't sampled skip the timing entirely, the statistics are scaled to estimate the totals.
+ *
+ * @param id The hook id.
+ * @param rate One call in rate is timed, 1 times every call.
+ * @return True on success, false if the hook doesn't exist or its detour isn't instrumented.
+ */
+KHOOK_API bool SetSampleRate(HookID_t id, std::uint32_t rate);
+
+using fnStatsCallback = void (*)(void* function, const HookStats& stats, void* user);
+
+/**
+ * Aggregates the statistics of every instrumented detour.
+ *
+ * @param callback Called once per detour with the hooked function address (the vtable entry address for virtual hooks).
+ * @param user Forwarded to the callback.
+ */
+KHOOK_API void ForEachCapsuleStats(fnStatsCallback callback, void* user);
+
+using fnCallbackStatsCallback = void (*)(void* function, const CallbackStats& stats, void* user);
+
+/**
+ * Reports the time spent in every pre and post callback, and in the original function, of every instrumented detour.
+ *
+ * @param callback Called once per callback with the hooked function address (the vtable entry address for virtual hooks).
+ * @param user Forwarded to the callback.
+ */
+KHOOK_API void ForEachCallbackStats(fnCallbackStatsCallback callback, void* user);
+
+/**
+ * Writes the time spent in every callback as folded stacks (`function;hook;phase cycles` per line),
+ * the format flamegraph tools take as input. Hooks are named after their id and context pointer.
+ *
+ * @param path File to write, it's overwritten.
+ * @return True on success, false if the file couldn't be written.
+ */
+KHOOK_API bool ExportFoldedStacks(const char* path);
+
+/**
+ * Starts recording every hooked call, on entry its arguments and return address, on exit the action taken and by which hook.
+ * Each thread records into its own ring buffer without locking nor allocating, the oldest records are overwritten once it's full.
+ * The rings are allocated by the first call and kept until the process exits, later calls only resume recording.
+ *
+ * @param records_per_thread Capacity of each ring, rounded up to a power of two. Calls take two records.
+ * @param threads Number of rings, threads making hooked calls once they're all taken aren't recorded.
+ * @return True on success, false if the rings couldn't be allocated.
+ */
+KHOOK_API bool StartTracing(std::size_t records_per_thread = 1024, std::size_t threads = 32);
+
+/**
+ * Stops recording hooked calls, the records are kept until they're dumped.
+ */
+KHOOK_API void StopTracing();
+
+/**
+ * Writes every record since the previous dump into a memory mapped file, recording goes on meanwhile.
+ * The file layout is described in khook/trace.hpp, the khook_trace tool converts it to CSV or JSON.
+ *
+ * @param path File to write, it's overwritten.
+ * @return True on success, false if tracing never started or the file couldn't be written.
+ */
+KHOOK_API bool DumpTrace(const char* path);
+
+/**
+ * Describes the generated code to perf, so samples within it are attributed to a named symbol instead of [unknown].
+ * Detours are named khook_capsule<function address> unless a name was given on setup, shared dispatch code khook_dispatcher (khook_dispatcher_stats when instrumented).
+ * Everything generated so far is written when an output is enabled, then every new detour as it's created.
+ * Detours freed by Shutdown are removed from the map file, jitdump has no way to express it.
+ *
+ * @param outputs Combination of PerfOutput, 0 (the default) disables both.
+ * @return True on success, false if a file couldn't be created or on Windows.
+ */
+KHOOK_API bool SetPerfOutput(std::uint8_t outputs);
+
+/**
+ * Selects whether the detours created from now on describe their code to the unwinder, through .eh_frame data registered with __register_frame.
+ * Stack walks through a hooked call, such as backtrace() or profilers unwinding in process, then carry on to the hooked function's caller.
+ * Existing detours are left untouched, the data is deregistered when the detour is freed.
+ * Exceptions must still not be thrown through a detour, it would never get to clean up after the call.
+ *
+ * @param enabled False by default, has no effect on Windows.
+ */
+KHOOK_API void SetUnwindInfoEnabled(bool enabled);
+
+enum class TracePoint : std::uint8_t {
+	// After the detour is entered
+	Entry,
+	// Right before the original function is called, and after it returns
+	BeforeOriginal,
+	AfterOriginal,
+	// Before the detour returns
+	Exit
+};
+
+/**
+ * Called by the probe sites of the traced detours.
+ *
+ * @param point Where the detour is.
+ * @param function Address the detour was setup on, the vtable entry address for virtual hooks.
+ * @param user Pointer given to SetTracepointCallback.
+ */
+using fnTracepointCallback = void (*)(TracePoint point, void* function, void* user);
+
+/**
+ * Sets the callback of the probe sites enabled by SetTracing, it runs on the hooked thread and must be quick.
+ * The user pointer isn't updated atomically with the callback, set both before enabling any probe.
+ *
+ * @param callback Called on every probe site of the traced detours, nullptr makes the probes return immediately.
+ * @param user Handed over to the callback.
+ */
+KHOOK_API void SetTracepointCallback(fnTracepointCallback callback, void* user);
+
+/**
+ * Enables or disables the probe sites of the detour a hook is attached to, all the hooks on that detour share them.
+ * Every detour has a probe site at each TracePoint, a single 8 bytes NOP while disabled. Enabling atomically patches
+ * them into a call to the tracepoint callback, the detour code is never rebuilt nor paused.
+ * Under DispatchMode::Shared, the probe sites belong to the code shared by every detour of the same stack size:
+ * they're enabled as long as one of those detours is traced, the untraced ones then pay for a call that returns immediately.
+ *
+ * @param id The hook to find the detour of.
+ * @param enabled False by default.
+ * @return True on success, false if the hook isn't associated with any detour or its code couldn't be patched.
+ */
+KHOOK_API bool SetTracing(HookID_t id, bool enabled);
+
+/**
+ * Reports what the detour a hook is attached to did while dispatching, all the hooks on that detour share it.
+ * Only available when KHook is built with KHOOK_AUDIT, which replaces the global operator new and delete to count heap operations.
+ * A warm detour is expected to report no allocation, deallocation nor system call.
+ *
+ * @param id The hook id.
+ * @param stats Filled with the counters.
+ * @return True on success, false if the hook doesn't exist or KHook wasn't built with KHOOK_AUDIT.
+ */
+KHOOK_API bool GetAuditStats(HookID_t id, AuditStats& stats);
+
+/**
+ * Zeroes the audit counters of every detour, typically once the hooked functions are warm.
+ */
+KHOOK_API void ResetAuditStats();
+
+/**
+ * Whether the callbacks of a hook are called. Asynchronous hooks become active once the insertion thread
+ * picks them up, the calls in flight through their detour at that moment don't call them.
+ *
+ * @param id The hook id.
+ * @return True if the hook is active, false if it's still pending, was removed or never existed.
+ */
+KHOOK_API bool IsActive(HookID_t id);
+
+/**
+ * Blocks until a hook becomes active.
+ *
+ * @param id The hook id.
+ * @param timeout_ms Milliseconds to wait at most.
+ * @return True if the hook is active, false on timeout or if the hook was removed or never existed.
+ */
+KHOOK_API bool WaitActive(HookID_t id, std::uint32_t timeout_ms);
+
+/**
+ * Reports when a hook was set up, activated and asked to be removed.
+ *
+ * @param id The hook id.
+ * @param lifecycle Filled with the timestamps.
+ * @return True on success, false if the hook was removed or never existed.
+ */
+KHOOK_API bool GetHookLifecycle(HookID_t id, HookLifecycle& lifecycle);
+
+/**
+ * Reports how long the asynchronous insertions and removals took to land, since the library was loaded.
+ *
+ * @param stats Filled with the counters and histograms.
+ */
+KHOOK_API void GetLifecycleStats(LifecycleStats& stats);
+
+/**
+ * Publishes the statistics of every detour, the pending asynchronous operations and the memory stats into a shared memory block,
+ * /dev/shm/khook-<pid>, for monitoring processes to read without talking to this one. The block is rewritten in place under
+ * a seqlock from a background thread, its layout is documented in include/khook/metrics.hpp and khook_metrics prints it.
+ * Only detours instrumented with SetStatsEnabled count their calls.
+ *
+ * @param interval_ms Milliseconds between two updates.
+ * @param capacity Detours the block has room for, the others are only counted as dropped.
+ * @return True on success, false if the block couldn't be created, the export is already running or on Windows.
+ */
+KHOOK_API bool StartMetricsExport(std::uint32_t interval_ms = 1000, std::size_t capacity = 4096);
+
+/**
+ * Stops the updates and removes the shared memory block.
+ */
+KHOOK_API void StopMetricsExport();
+
 template<typename C, typename R, typename... A>
 inline void* ExtractMFP(R (C::*mfp)(A...)) {
 	union {
@@ -508,14 +959,13 @@ public:
 	virtual ~Function() {
 		_in_deletion = true;
 		// Deep copy the whole vector, because it can be modifed by removehook
-		std::unordered_set<HookID_t> hook_ids;
+		std::vector<HookID_t> hook_ids;
 		{
 			std::lock_guard guard(_hooks_stored);
-			hook_ids = _hook_ids;
-		}
-		for (auto it : hook_ids) {
-			::KHook::RemoveHook(it, false);
+			hook_ids.assign(_hook_ids.begin(), _hook_ids.end());
 		}
+		// All at once, they're waited for together
+		::KHook::RemoveHooks(hook_ids.data(), hook_ids.size(), false);
 	}
 
 	void Configure(const void* address) {
@@ -1061,14 +1511,13 @@ public:
 	virtual ~Member() {
 		_in_deletion = true;
 		// Deep copy the whole vector, because it can be modifed by removehook
-		std::unordered_set<HookID_t> hook_ids;
+		std::vector<HookID_t> hook_ids;
 		{
 			std::lock_guard guard(_hooks_stored);
-			hook_ids = _hook_ids;
-		}
-		for (auto it : hook_ids) {
-			::KHook::RemoveHook(it, false);
+			hook_ids.assign(_hook_ids.begin(), _hook_ids.end());
 		}
+		// All at once, they're waited for together
+		::KHook::RemoveHooks(hook_ids.data(), hook_ids.size(), false);
 	}
 
 	void Configure(const void* address) {
@@ -1485,29 +1934,81 @@ public:
 	virtual ~Virtual() {
 		_in_deletion = true;
 		// Deep copy the whole vector, because it can be modifed by removehook
-		std::unordered_map<HookID_t, void*> hook_ids;
+		std::vector<HookID_t> hook_ids;
 		{
 			std::lock_guard guard(_hooks_stored);
-			hook_ids = _hook_ids_addr;
+			for (auto& it : _hook_ids_addr) {
+				hook_ids.push_back(it.first);
+			}
 		}
-		for (auto it : hook_ids) {
-			::KHook::RemoveHook(it.first, false);
+		// All at once, they're waited for together
+		::KHook::RemoveHooks(hook_ids.data(), hook_ids.size(), false);
+
+		std::lock_guard guard(_m_hooked_this);
+		if (_count_instances) {
+			::KHook::CountInstances(-static_cast<std::ptrdiff_t>(_hooked_this.size()));
 		}
+		// The cleanup detour may still be removing some until it's destroyed, they're already accounted
+		_hooked_this.clear();
 	}
 
 	void Add(CLASS* this_ptr) {
 		{
 			std::lock_guard guard(_m_hooked_this);
-			_hooked_this.insert(this_ptr);
+			if (_hooked_this.insert(this_ptr).second && _count_instances) {
+				::KHook::CountInstances(1);
+			}
+			if (_cleanup_hook) {
+				(*_cleanup_track)(_cleanup_hook.get(), this_ptr, true);
+			}
 		}
 		Configure(*(void***)this_ptr);
 	}
 
 	void Remove(CLASS* this_ptr) {
-		{
-			std::lock_guard guard(_m_hooked_this);
-			_hooked_this.erase(this_ptr);
-		}
+		_Remove(this_ptr, false);
+	}
+
+	/**
+	 * Opt-in, detours the given vtable entry (usually the virtual destructor) and automatically
+	 * removes the instance from this hook once the entry is invoked. On Itanium ABI (Linux) a virtual
+	 * destructor occupies two entries, the complete destructor followed by the deleting destructor.
+	 * Only destructions dispatched through the vtable (e.g delete on a base pointer) can be tracked.
+	 *
+	 * @param vtbl_index Index of the destructor into the vtable.
+	 */
+	void SetCleanup(std::int32_t vtbl_index) {
+#ifdef _WIN32
+		// Scalar deleting destructor
+		_SetCleanup<void*, unsigned int>(vtbl_index);
+#else
+		_SetCleanup<void>(vtbl_index);
+#endif
+	}
+
+	/**
+	 * Opt-in, detours the given teardown method and automatically removes the instance from this hook once the method is invoked.
+	 *
+	 * @param teardown Virtual member function marking the end of life of an instance.
+	 */
+	template<typename R, typename... A>
+	void SetCleanup(R (CLASS::*teardown)(A...)) {
+		_SetCleanup<R, A...>(GetVtableIndex(teardown));
+	}
+
+	template<typename R, typename... A>
+	void SetCleanup(R (CLASS::*teardown)(A...) const) {
+		_SetCleanup<R, A...>(GetVtableIndex(teardown));
+	}
+
+	/**
+	 * Returns the amount of instances currently hooked (see Add).
+	 *
+	 * @return The instance table size.
+	 */
+	std::size_t GetInstanceCount() {
+		std::lock_guard guard(_m_hooked_this);
+		return _hooked_this.size();
 	}
 
 	RETURN CallOriginal(CLASS* this_ptr, ARGS... args) {
@@ -1523,6 +2024,14 @@ public:
 		// If index changes, empty all our previous hooks
 		{
 			std::lock_guard guard(_m_hooked_this);
+			if (_cleanup_hook) {
+				for (auto it : _hooked_this) {
+					(*_cleanup_track)(_cleanup_hook.get(), it, false);
+				}
+			}
+			if (_count_instances) {
+				::KHook::CountInstances(-static_cast<std::ptrdiff_t>(_hooked_this.size()));
+			}
 			_hooked_this.clear();
 		}
 
@@ -1553,6 +2062,15 @@ protected:
 
 	std::mutex _m_hooked_this;
 	std::unordered_set<CLASS*> _hooked_this;
+	// Whether _hooked_this is accounted in GetMemoryStats, cleanup detours mirror the instances of their owner
+	bool _count_instances = true;
+	// Owners set it on their cleanup detour
+	template<typename, typename, typename...>
+	friend class Virtual;
+
+	// Teardown detour, see SetCleanup. Guarded by _m_hooked_this, declared last so it's destroyed first
+	void (*_cleanup_track)(__Hook*, CLASS*, bool) = nullptr;
+	std::unique_ptr<__Hook> _cleanup_hook;
 
 	// Called by KHook
 	void _KHook_RemovedHook(HookID_t id) {
@@ -1563,6 +2081,60 @@ protected:
 		}
 	}
 
+	void _Remove(CLASS* this_ptr, bool cleanup) {
+		std::lock_guard guard(_m_hooked_this);
+		if (_hooked_this.erase(this_ptr) != 0 && _count_instances) {
+			::KHook::CountInstances(-1, cleanup);
+		}
+		if (_cleanup_hook) {
+			(*_cleanup_track)(_cleanup_hook.get(), this_ptr, false);
+		}
+	}
+
+	template<typename R, typename... A>
+	void _SetCleanup(std::int32_t vtbl_index) {
+		using Cleanup = ::KHook::Virtual<CLASS, R, A...>;
+		if (vtbl_index == -1 || _in_deletion) {
+			return;
+		}
+
+		auto cleanup = std::make_unique<Cleanup>(this, &Self::template _KHook_Cleanup<R, A...>, nullptr);
+		cleanup->_count_instances = false;
+		cleanup->SetIndex(vtbl_index);
+
+		std::unique_ptr<__Hook> previous;
+		{
+			std::lock_guard guard(_m_hooked_this);
+			// Instances added before cleanup was enabled must be tracked as well
+			for (auto it : _hooked_this) {
+				cleanup->Add(it);
+			}
+
+			_cleanup_track = [](__Hook* hook, CLASS* this_ptr, bool add) {
+				if (add) {
+					static_cast<Cleanup*>(hook)->Add(this_ptr);
+				} else {
+					static_cast<Cleanup*>(hook)->Remove(this_ptr);
+				}
+			};
+			previous = std::move(_cleanup_hook);
+			_cleanup_hook = std::move(cleanup);
+		}
+		// Its detour may be calling Remove, which needs the lock
+		previous.reset();
+	}
+
+	// Called by the teardown detour
+	template<typename R, typename... A>
+	::KHook::Return<R> _KHook_Cleanup(CLASS* hooked_this, A...) {
+		_Remove(hooked_this, true);
+		if constexpr(std::is_same<R, void>::value) {
+			return { ::KHook::Action::Ignore };
+		} else {
+			return { ::KHook::Action::Ignore, R() };
+		}
+	}
+
 	void Configure(void** vtable) {
 		if (vtable == nullptr || _in_deletion || _vtbl_index == INVALID_VTBL_INDEX) {
 			return;
@@ -1789,9 +2361,11 @@ inline RETURN CallOriginal(const void* func, const CLASS* this_ptr, ARGS... args
 
 class IKHook {
 public:
-	virtual HookID_t SetupHook(void* function, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async = false) = 0;
-	virtual HookID_t SetupVirtualHook(void** vtable, int index, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async = false) = 0;
+	virtual HookID_t SetupHook(void* function, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async = false, const char* name = nullptr) = 0;
+	virtual HookID_t SetupVirtualHook(void** vtable, int index, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async = false, const char* name = nullptr) = 0;
+	virtual std::size_t SetupHooks(HookSetup* hooks, std::size_t count, std::size_t threads = 0) = 0;
 	virtual void RemoveHook(HookID_t id, bool async = false) = 0;
+	virtual void RemoveHooks(const HookID_t* ids, std::size_t count, bool async = false) = 0;
 	virtual void* GetContext() = 0;
 	virtual void* GetOriginalFunction() = 0;
 	virtual void* GetOriginalValuePtr() = 0;
@@ -1802,12 +2376,39 @@ public:
 	virtual void* FindOriginalVirtual(void** vtable, int index) = 0;
 	virtual void* DoRecall(KHook::Action action, void* ptr_to_return, std::size_t return_size, void* init_op, void* deinit_op) = 0;
 	virtual void SaveReturnValue(KHook::Action action, void* ptr_to_return, std::size_t return_size, void* init_op, void* deinit_op, bool original) = 0;
+	virtual void SetDispatchMode(DispatchMode mode) = 0;
+	virtual bool SetupCodeArena(std::size_t size, bool lock = false) = 0;
+	virtual CodeArenaStats GetCodeArenaStats() = 0;
+	virtual void SetStatsEnabled(bool enabled) = 0;
+	virtual bool GetStats(HookID_t id, HookStats& stats) = 0;
+	virtual void SetDefaultSampleRate(std::uint32_t rate) = 0;
+	virtual bool SetSampleRate(HookID_t id, std::uint32_t rate) = 0;
+	virtual void ForEachCapsuleStats(fnStatsCallback callback, void* user) = 0;
+	virtual void ForEachCallbackStats(fnCallbackStatsCallback callback, void* user) = 0;
+	virtual bool ExportFoldedStacks(const char* path) = 0;
+	virtual bool StartTracing(std::size_t records_per_thread = 1024, std::size_t threads = 32) = 0;
+	virtual void StopTracing() = 0;
+	virtual bool DumpTrace(const char* path) = 0;
+	virtual bool SetPerfOutput(std::uint8_t outputs) = 0;
+	virtual void SetUnwindInfoEnabled(bool enabled) = 0;
+	virtual void SetTracepointCallback(fnTracepointCallback callback, void* user) = 0;
+	virtual bool SetTracing(HookID_t id, bool enabled) = 0;
+	virtual bool GetAuditStats(HookID_t id, AuditStats& stats) = 0;
+	virtual void ResetAuditStats() = 0;
+	virtual MemoryStats GetMemoryStats() = 0;
+	virtual void CountInstances(std::ptrdiff_t added, bool cleanup = false) = 0;
+	virtual bool IsActive(HookID_t id) = 0;
+	virtual bool WaitActive(HookID_t id, std::uint32_t timeout_ms) = 0;
+	virtual bool GetHookLifecycle(HookID_t id, HookLifecycle& lifecycle) = 0;
+	virtual void GetLifecycleStats(LifecycleStats& stats) = 0;
+	virtual bool StartMetricsExport(std::uint32_t interval_ms = 1000, std::size_t capacity = 4096) = 0;
+	virtual void StopMetricsExport() = 0;
 };
 #ifndef KHOOK_STANDALONE
 // KHOOK is exposed by something
 extern IKHook* __exported__khook;
 
-KHOOK_API HookID_t SetupHook(void* function, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async) {
+KHOOK_API HookID_t SetupHook(void* function, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async, const char* name) {
 	// For some hooks this is too early
 	if (__exported__khook == nullptr) {
 		std::cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
@@ -1818,10 +2419,10 @@ KHOOK_API HookID_t SetupHook(void* function, void* context, void* removed_functi
 		std::cerr << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
 		return INVALID_HOOK;
 	}
-	return __exported__khook->SetupHook(function, context, removed_function, pre, post, make_return, make_call_original, async);
+	return __exported__khook->SetupHook(function, context, removed_function, pre, post, make_return, make_call_original, async, name);
 }
 
-KHOOK_API HookID_t SetupVirtualHook(void** vtable, int index, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async) {
+KHOOK_API HookID_t SetupVirtualHook(void** vtable, int index, void* context, void* removed_function, void* pre, void* post, void* make_return, void* make_call_original, bool async, const char* name) {
 	// For some hooks this is too early
 	if (__exported__khook == nullptr) {
 		std::cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
@@ -1832,13 +2433,34 @@ KHOOK_API HookID_t SetupVirtualHook(void** vtable, int index, void* context, voi
 		std::cerr << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
 		return INVALID_HOOK;
 	}
-	return __exported__khook->SetupVirtualHook(vtable, index, context, removed_function, pre, post, make_return, make_call_original, async);
+	return __exported__khook->SetupVirtualHook(vtable, index, context, removed_function, pre, post, make_return, make_call_original, async, name);
+}
+
+KHOOK_API std::size_t SetupHooks(HookSetup* hooks, std::size_t count, std::size_t threads) {
+	// For some hooks this is too early
+	if (__exported__khook == nullptr) {
+		std::cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
+		std::cout << "!!!!!!!!!!!!!!! WARNING YOU HAVE SETUP YOUR HOOK TOO EARLY, IT WONT WORK !!!!!!!!!!!!!!!\n";
+		std::cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
+		std::cerr << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
+		std::cerr << "!!!!!!!!!!!!!!! WARNING YOU HAVE SETUP YOUR HOOK TOO EARLY, IT WONT WORK !!!!!!!!!!!!!!!\n";
+		std::cerr << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
+		for (std::size_t i = 0; i < count; i++) {
+			hooks[i].id = INVALID_HOOK;
+		}
+		return 0;
+	}
+	return __exported__khook->SetupHooks(hooks, count, threads);
 }
 
 KHOOK_API void RemoveHook(HookID_t id, bool async) {
 	return __exported__khook->RemoveHook(id, async);
 }
 
+KHOOK_API void RemoveHooks(const HookID_t* ids, std::size_t count, bool async) {
+	return __exported__khook->RemoveHooks(ids, count, async);
+}
+
 KHOOK_API void* GetContext() {
 	return __exported__khook->GetContext();
 }
@@ -1879,6 +2501,114 @@ KHOOK_API void SaveReturnValue(KHook::Action action, void* ptr_to_return, std::s
 	return __exported__khook->SaveReturnValue(action, ptr_to_return, return_size, init_op, deinit_op, original);
 }
 
+KHOOK_API void SetDispatchMode(DispatchMode mode) {
+	return __exported__khook->SetDispatchMode(mode);
+}
+
+KHOOK_API bool SetupCodeArena(std::size_t size, bool lock) {
+	return __exported__khook->SetupCodeArena(size, lock);
+}
+
+KHOOK_API CodeArenaStats GetCodeArenaStats() {
+	return __exported__khook->GetCodeArenaStats();
+}
+
+KHOOK_API void SetStatsEnabled(bool enabled) {
+	return __exported__khook->SetStatsEnabled(enabled);
+}
+
+KHOOK_API bool GetStats(HookID_t id, HookStats& stats) {
+	return __exported__khook->GetStats(id, stats);
+}
+
+KHOOK_API void SetDefaultSampleRate(std::uint32_t rate) {
+	return __exported__khook->SetDefaultSampleRate(rate);
+}
+
+KHOOK_API bool SetSampleRate(HookID_t id, std::uint32_t rate) {
+	return __exported__khook->SetSampleRate(id, rate);
+}
+
+KHOOK_API void ForEachCapsuleStats(fnStatsCallback callback, void* user) {
+	return __exported__khook->ForEachCapsuleStats(callback, user);
+}
+
+KHOOK_API void ForEachCallbackStats(fnCallbackStatsCallback callback, void* user) {
+	return __exported__khook->ForEachCallbackStats(callback, user);
+}
+
+KHOOK_API bool ExportFoldedStacks(const char* path) {
+	return __exported__khook->ExportFoldedStacks(path);
+}
+
+KHOOK_API bool StartTracing(std::size_t records_per_thread, std::size_t threads) {
+	return __exported__khook->StartTracing(records_per_thread, threads);
+}
+
+KHOOK_API void StopTracing() {
+	return __exported__khook->StopTracing();
+}
+
+KHOOK_API bool DumpTrace(const char* path) {
+	return __exported__khook->DumpTrace(path);
+}
+
+KHOOK_API bool SetPerfOutput(std::uint8_t outputs) {
+	return __exported__khook->SetPerfOutput(outputs);
+}
+
+KHOOK_API void SetUnwindInfoEnabled(bool enabled) {
+	return __exported__khook->SetUnwindInfoEnabled(enabled);
+}
+
+KHOOK_API void SetTracepointCallback(fnTracepointCallback callback, void* user) {
+	return __exported__khook->SetTracepointCallback(callback, user);
+}
+
+KHOOK_API bool SetTracing(HookID_t id, bool enabled) {
+	return __exported__khook->SetTracing(id, enabled);
+}
+
+KHOOK_API bool GetAuditStats(HookID_t id, AuditStats& stats) {
+	return __exported__khook->GetAuditStats(id, stats);
+}
+
+KHOOK_API void ResetAuditStats() {
+	return __exported__khook->ResetAuditStats();
+}
+
+KHOOK_API MemoryStats GetMemoryStats() {
+	return __exported__khook->GetMemoryStats();
+}
+
+KHOOK_API void CountInstances(std::ptrdiff_t added, bool cleanup) {
+	return __exported__khook->CountInstances(added, cleanup);
+}
+
+KHOOK_API bool IsActive(HookID_t id) {
+	return __exported__khook->IsActive(id);
+}
+
+KHOOK_API bool WaitActive(HookID_t id, std::uint32_t timeout_ms) {
+	return __exported__khook->WaitActive(id, timeout_ms);
+}
+
+KHOOK_API bool GetHookLifecycle(HookID_t id, HookLifecycle& lifecycle) {
+	return __exported__khook->GetHookLifecycle(id, lifecycle);
+}
+
+KHOOK_API void GetLifecycleStats(LifecycleStats& stats) {
+	return __exported__khook->GetLifecycleStats(stats);
+}
+
+KHOOK_API bool StartMetricsExport(std::uint32_t interval_ms, std::size_t capacity) {
+	return __exported__khook->StartMetricsExport(interval_ms, capacity);
+}
+
+KHOOK_API void StopMetricsExport() {
+	return __exported__khook->StopMetricsExport();
+}
+
 #endif
 
 }
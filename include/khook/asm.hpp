@@ -25,6 +25,16 @@
 #include <memory>
 #include <cstring>
 #include <cassert>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#ifndef _WIN32
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
 
 #define assertm(exp, msg) assert((void(msg), exp))
 
@@ -316,227 +326,722 @@ namespace KHook
 		Allocating one page per code generation session is usually a waste of memory and on some platforms also
 		a waste of virtual address space (Windows’ VirtualAlloc has a granularity of 64K).
 
+		Memory is handed out from slabs of SLAB_SIZE bytes, aligned on SLAB_SIZE. Each slab serves a single
+		size class (power of 2), so any block is found back in O(1) by masking its address. Requests bigger than
+		the biggest size class get a dedicated mapping. Every operation is thread-safe.
+
+		Whenever possible (memfd on Linux, section objects on Windows) a slab is mapped twice : once read+exec,
+		once read+write. Alloc() returns the executable view, code must be written through GetWritable() and no
+		page protection is ever changed at runtime.
+		Beware the views are shared mappings, a forked process writes into the parent's code.
+
+		Slabs are preferably placed within NEAR_RANGE of the KHook library, AllocNear() only hands out memory from
+		those. Code living there can reach anything within NEAR_RANGE of the library with rel32 displacements.
+
+		SetupArena() optionally reserves one contiguous, pre-faulted region (huge pages if the system allows it),
+		slabs are then carved from it lowest address first so the code stays densely packed.
 
-		IMPORTANT: the memory that Alloc() returns is not a in a defined state!
-		It could be in read+exec OR read+write mode.
-		-> call SetRE() or SetRW() before using allocated memory!
+		If the memory can't be dual mapped (see IsDualMapped), every block gets a single read+write view of its own
+		pages, and no arena can be set up. Its protection is toggled around writes instead, memory is never writable
+		and executable at once except while SetRWX() is in effect.
+		-> call SetRE() once the code is written, and SetRWX() then SetRE() around patches of running code!
 		*/
 		class CPageAlloc
 		{
-			struct AllocationUnit
+		public:
+			static constexpr std::size_t SLAB_SIZE = 64 * 1024;
+			static constexpr std::size_t MIN_CLASS_SHIFT = 6; // 64 bytes
+			static constexpr std::size_t MAX_CLASS_SHIFT = 13; // 8 KB
+			static constexpr std::size_t CLASS_COUNT = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+			// Dedicated mappings are all handled by this extra class
+			static constexpr std::size_t LARGE_CLASS = CLASS_COUNT;
+			// Half of the rel32 reach, code and target both within this range of the library are always reachable
+			static constexpr std::uintptr_t NEAR_RANGE = 0x40000000;
+			static constexpr std::size_t NEAR_PROBES = 16;
+			static constexpr std::uintptr_t NEAR_PROBE_STEP = NEAR_RANGE / (NEAR_PROBES + 1);
+			static constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+			struct ArenaStats
 			{
-				std::size_t begin_offset;
-				std::size_t size;
+				// Executable view of the arena
+				void* start;
+				// Size of the arena, 0 if there's none
+				std::size_t reserved;
+				// Bytes carved into slabs
+				std::size_t carved;
+				// Bytes handed out from those slabs
+				std::size_t used;
+				// Accepted by madvise, the system may still not back the arena with any huge page
+				bool hugePagesAdvised;
+				bool locked;
+			};
 
-				AllocationUnit(std::size_t p_offs, std::size_t p_size) : begin_offset(p_offs), size(p_size)
-				{
-				}
+			struct Usage
+			{
+				// Bytes of address space mapped for code
+				std::size_t mapped;
+				// Bytes handed out by Alloc/AllocIsolated/AllocNear
+				std::size_t used;
+			};
+
+			struct SlabStats
+			{
+				// Slabs shared by the blocks of a size class, spares included
+				std::size_t slabs;
+				// Slabs holding a single large or isolated block
+				std::size_t dedicated;
+				// Empty slabs kept around for the next allocation
+				std::size_t spares;
+				// Free blocks inside the shared slabs, only usable by their own size class
+				std::size_t freeBytes;
+			};
 
-				bool operator < (const AllocationUnit &other) const
+		private:
+			struct Slab
+			{
+				// Executable view
+				unsigned char* startPtr;
+				// Writable view, same as startPtr if not dual mapped
+				unsigned char* writePtr;
+				// Size of the mapping
+				std::size_t size;
+				// Size of every block inside the slab
+				std::size_t blockSize;
+				std::size_t sizeClass;
+				// Indexes of the blocks that can be handed out
+				std::vector<std::uint16_t> freeBlocks;
+				// One entry per block, true if handed out
+				std::vector<bool> usedMap;
+				std::size_t usedBlocks;
+				// Slabs of a class which still have free blocks
+				Slab* prev;
+				Slab* next;
+				bool inPartial;
+				// Carved from the arena, never unmapped
+				bool inArena;
+
+				std::size_t BlockCount() const
 				{
-					return begin_offset < other.begin_offset;
+					return size / blockSize;
 				}
 			};
 
-			typedef List<AllocationUnit> AUList;
-			struct AllocatedRegion
+			struct SizeClass
 			{
-				void *startPtr;
-				std::size_t size;
-				bool isolated;
-				std::size_t minAlignment;
-				AUList allocUnits;
-				bool isRE;
+				std::mutex lock;
+				Slab* partial = nullptr;
+				// One empty slab is kept around, so a free/alloc pattern doesn't map and unmap over and over
+				Slab* spare = nullptr;
+			};
 
-				void CheckGap(std::size_t gap_begin, std::size_t gap_end, std::size_t reqsize,
-					std::size_t &smallestgap_pos, std::size_t &smallestgap_size, std::size_t &outAlignBytes)
+			struct Mapping
+			{
+				void* exec;
+				void* write;
+			};
+
+			struct Arena
+			{
+				unsigned char* exec = nullptr;
+				unsigned char* write = nullptr;
+				std::size_t size = 0;
+				// One entry per SLAB_SIZE chunk, true if carved
+				std::vector<bool> chunks;
+				std::size_t carved = 0;
+				bool hugePagesAdvised = false;
+				bool locked = false;
+			};
+
+			std::size_t m_PageSize;
+			std::atomic<bool> m_DualMapping;
+			// Center of the near window, somewhere inside the KHook library
+			std::uintptr_t m_Home;
+			// Set when no free space was found in the near window, cleared once near memory is handed back.
+			// AllocNear fails right away while it's set
+			std::atomic<bool> m_NearFull;
+			// Last slab placed in the near window, the next one is tried right below it
+			std::atomic<std::uintptr_t> m_NearCursor;
+			SizeClass m_Classes[CLASS_COUNT + 1];
+			// Slab start address -> Slab, lock order is always SizeClass::lock then m_SlabsLock
+			std::shared_mutex m_SlabsLock;
+			std::unordered_map<std::uintptr_t, Slab*> m_Slabs;
+			// Slabs of the large class by start address as well, their blocks can span several SLAB_SIZE. Guarded by m_SlabsLock
+			std::map<std::uintptr_t, Slab*> m_LargeSlabs;
+			// Lock order is always SizeClass::lock then m_ArenaLock
+			std::mutex m_ArenaLock;
+			Arena m_Arena;
+			std::atomic<std::size_t> m_ArenaUsed;
+			std::atomic<std::size_t> m_MappedBytes;
+			std::atomic<std::size_t> m_UsedBytes;
+
+			static std::size_t ClassOf(std::size_t size)
+			{
+				std::size_t shift = MIN_CLASS_SHIFT;
+				while (shift <= MAX_CLASS_SHIFT && (static_cast<std::size_t>(1) << shift) < size)
 				{
-					std::size_t gapsize = gap_end - gap_begin;
-					// How many bytes do we actually need here?
-					//   = requested size + alignment bytes
-					std::size_t neededSize = reqsize;
-					std::size_t alignBytes = minAlignment - ((reinterpret_cast<intptr_t>(startPtr) + gap_begin) % minAlignment);
+					shift++;
+				}
+				return (shift > MAX_CLASS_SHIFT) ? LARGE_CLASS : shift - MIN_CLASS_SHIFT;
+			}
 
-					alignBytes %= minAlignment;
-					neededSize += alignBytes;
+			std::size_t RoundToPage(std::size_t size) const
+			{
+				return (size + m_PageSize - 1) & ~(m_PageSize - 1);
+			}
 
-					if (gapsize >= neededSize)
-					{
-						if (gapsize < smallestgap_size)
-						{
-							smallestgap_size = gapsize;
-							smallestgap_pos = gap_begin;
-							outAlignBytes = alignBytes;
-						}
-					}
+			bool InWindow(std::uintptr_t start, std::size_t size) const
+			{
+				if (sizeof(void*) == 4)
+				{
+					// rel32 wraps around, the whole address space is reachable
+					return true;
 				}
+				std::uintptr_t low = (m_Home > NEAR_RANGE) ? m_Home - NEAR_RANGE : 0;
+				return start >= low && start + size <= m_Home + NEAR_RANGE;
+			}
 
-				bool TryAlloc(std::size_t reqsize, void * &outAddr)
+			bool InWindow(Slab* slab) const
+			{
+				return InWindow(reinterpret_cast<std::uintptr_t>(slab->startPtr), slab->size);
+			}
+
+			// i-th placement hint for a mapping of the given size. 0 lets the system choose, 1 is right below
+			// the last near slab, the others alternate below and above the library
+			std::uintptr_t NearCandidate(std::size_t i, std::size_t size) const
+			{
+				if (i == 0)
 				{
-					// Check for isolated
-					if (isolated && !allocUnits.empty())
-						return false;
+					return 0;
+				}
+				if (i == 1)
+				{
+					std::uintptr_t cursor = m_NearCursor;
+					return (cursor > size) ? (cursor - size) & ~(SLAB_SIZE - 1) : 0;
+				}
+				std::uintptr_t home = m_Home & ~(SLAB_SIZE - 1);
+				std::uintptr_t distance = (i / 2) * NEAR_PROBE_STEP;
+				if (i % 2 == 0)
+				{
+					return (home > distance) ? home - distance : 0;
+				}
+				return home + distance;
+			}
 
-					// Find the smallest gap where req fits
-					std::size_t lastend = 0;
-					std::size_t smallestgap_pos = size + 1;
-					std::size_t smallestgap_size = size + 1;
-					std::size_t alignmentbytes = 0;
+			void PlacedAt(std::uintptr_t start, std::size_t size)
+			{
+				if (InWindow(start, size))
+				{
+					m_NearCursor = start;
+				}
+			}
 
-					for (AUList::iterator iter = allocUnits.begin(); iter != allocUnits.end(); ++iter)
+#ifndef _WIN32
+			// Reserves address space aligned on alignment, within the near window if there's room
+			std::uintptr_t Reserve(std::size_t size, std::size_t alignment)
+			{
+				std::size_t reserve = size + alignment;
+				std::size_t probes = m_NearFull ? 1 : 2 * NEAR_PROBES + 2;
+				for (std::size_t i = 0; i < probes + 1; i++)
+				{
+					// Last attempt settles for anywhere
+					bool last = (i == probes);
+					std::uintptr_t hint = last ? 0 : NearCandidate(i, reserve);
+					if (i != 0 && !last && hint == 0)
 					{
-						CheckGap(lastend, iter->begin_offset, reqsize, smallestgap_pos, smallestgap_size, alignmentbytes);
-						lastend = iter->begin_offset + iter->size;
+						continue;
 					}
 
-					CheckGap(lastend, size, reqsize, smallestgap_pos, smallestgap_size, alignmentbytes);
+					void* addr = mmap(reinterpret_cast<void*>(hint), reserve, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+					if (addr == MAP_FAILED)
+					{
+						return 0;
+					}
 
-					if (smallestgap_pos < size)
+					std::uintptr_t start = reinterpret_cast<std::uintptr_t>(addr);
+					std::uintptr_t aligned = (start + alignment - 1) & ~(alignment - 1);
+					// Trim the excess on both ends
+					if (aligned != start)
 					{
-						outAddr = reinterpret_cast<void*>(reinterpret_cast<char*>(startPtr) + smallestgap_pos + alignmentbytes);
-						allocUnits.push_sorted( AllocationUnit(smallestgap_pos, reqsize + alignmentbytes) );
-						return true;
+						munmap(addr, aligned - start);
 					}
-					else
+					std::size_t tail = (start + reserve) - (aligned + size);
+					if (tail != 0)
 					{
-						return false;
+						munmap(reinterpret_cast<void*>(aligned + size), tail);
+					}
+
+					if (last || InWindow(aligned, size))
+					{
+						PlacedAt(aligned, size);
+						if (last && probes != 1)
+						{
+							m_NearFull = true;
+						}
+						return aligned;
 					}
+					munmap(reinterpret_cast<void*>(aligned), size);
 				}
+				return 0;
+			}
+#endif
 
-				bool TryFree(void *addr)
+			// Maps memory aligned on alignment, executable and writable views are distinct if dual mapped
+			Mapping MapAligned(std::size_t size, std::size_t alignment = SLAB_SIZE)
+			{
+				Mapping mapping = { nullptr, nullptr };
+#ifdef _WIN32
+				// Allocation granularity is already 64K, bigger alignments aren't needed without large pages
+				static_assert(SLAB_SIZE == 64 * 1024);
+				HANDLE section = nullptr;
+				if (m_DualMapping)
 				{
-					if (addr < startPtr || addr >= reinterpret_cast<void*>(reinterpret_cast<char*>(startPtr) + size))
-						return false;
-
-					intptr_t start = reinterpret_cast<intptr_t>(startPtr);
-
-					for (AUList::iterator iter = allocUnits.begin(); iter != allocUnits.end(); ++iter)
+					section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE,
+						static_cast<DWORD>(static_cast<std::uint64_t>(size) >> 32), static_cast<DWORD>(size), nullptr);
+					if (section != nullptr)
 					{
-						size_t AUBegin = start + iter->begin_offset;
-						void *alignedAUBegin = reinterpret_cast<void*>(
-							AUBegin + ((minAlignment - AUBegin % minAlignment) % minAlignment)
-							);
-
-						if (addr == alignedAUBegin)
+						mapping.write = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, size);
+						if (mapping.write == nullptr)
 						{
-							DebugCleanMemory(reinterpret_cast<unsigned char*>(startPtr) + iter->begin_offset,
-								iter->size);
-							allocUnits.erase(iter);
-							return true;
+							CloseHandle(section);
+							section = nullptr;
 						}
 					}
-
-					return false;
+					if (section == nullptr)
+					{
+						m_DualMapping = false;
+					}
 				}
 
-				void DebugCleanMemory(unsigned char* start, size_t size)
-				{
-					bool wasRE = isRE;
-					if (isRE)
+				auto place = [&](void* hint) -> void* {
+					if (section)
 					{
-						SetRW();
+						return MapViewOfFileEx(section, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, size, hint);
 					}
+					return VirtualAlloc(hint, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+				};
+				auto release = [&](void* ptr) {
+					if (section)
+					{
+						UnmapViewOfFile(ptr);
+					}
+					else
+					{
+						VirtualFree(ptr, 0, MEM_RELEASE);
+					}
+				};
 
-					unsigned char* end = start + size;
-					for (unsigned char* p = start; p != end; ++p)
+				std::size_t probes = m_NearFull ? 1 : 2 * NEAR_PROBES + 2;
+				for (std::size_t i = 0; i < probes && mapping.exec == nullptr; i++)
+				{
+					std::uintptr_t hint = NearCandidate(i, size);
+					if (i != 0 && hint == 0)
 					{
-						*p = 0xCC;
+						continue;
 					}
+					// Fails if the range isn't free
+					void* exec = place(reinterpret_cast<void*>(hint));
+					if (exec && InWindow(reinterpret_cast<std::uintptr_t>(exec), size))
+					{
+						PlacedAt(reinterpret_cast<std::uintptr_t>(exec), size);
+						mapping.exec = exec;
+					}
+					else if (exec)
+					{
+						release(exec);
+					}
+				}
+				if (mapping.exec == nullptr)
+				{
+					// Settle for anywhere
+					if (probes != 1)
+					{
+						m_NearFull = true;
+					}
+					mapping.exec = place(nullptr);
+				}
 
-					if (wasRE)
+				if (section)
+				{
+					// Views keep the section alive
+					CloseHandle(section);
+					if (mapping.exec)
 					{
-						SetRE();
+						return mapping;
 					}
+					UnmapViewOfFile(mapping.write);
+				}
+				if (mapping.exec && mapping.write == nullptr)
+				{
+					// Not dual mapped in the first place
+					mapping.write = mapping.exec;
+					return mapping;
+				}
+				m_DualMapping = false;
+				mapping.exec = mapping.write = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+				return mapping;
+#else
+				std::uintptr_t aligned = Reserve(size, alignment);
+				if (aligned == 0)
+				{
+					return mapping;
 				}
 
-				bool Contains(void *addr)
+				int fd = -1;
+#ifdef SYS_memfd_create
+				if (m_DualMapping)
+				{
+					fd = static_cast<int>(syscall(SYS_memfd_create, "khook-jit", 1U /* MFD_CLOEXEC */));
+					if (fd != -1 && ftruncate(fd, size) != 0)
+					{
+						close(fd);
+						fd = -1;
+					}
+				}
+#endif
+				if (fd != -1)
 				{
-					return addr >= startPtr && addr < reinterpret_cast<void*>(reinterpret_cast<char*>(startPtr) + size);
+					void* exec = mmap(reinterpret_cast<void*>(aligned), size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, 0);
+					void* write = (exec != MAP_FAILED) ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+					// Mappings keep the file alive
+					close(fd);
+					if (exec != MAP_FAILED && write != MAP_FAILED)
+					{
+						mapping.exec = exec;
+						mapping.write = write;
+						return mapping;
+					}
+					if (write != MAP_FAILED)
+					{
+						munmap(write, size);
+					}
 				}
 
-				void FreeRegion()
+				// No memfd support (or sandboxed), fallback to a single view and protection toggling
+				m_DualMapping = false;
+				void* single = mmap(reinterpret_cast<void*>(aligned), size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0);
+				if (single == MAP_FAILED)
 				{
+					munmap(reinterpret_cast<void*>(aligned), size);
+					return mapping;
+				}
+				NameRegion(single, size);
+				mapping.exec = mapping.write = single;
+				return mapping;
+#endif
+			}
+
+#ifndef _WIN32
+			// Shows up as [anon:khook-jit] in /proc/<pid>/maps and smaps, memfd views are already named after their file.
+			// Kernels without CONFIG_ANON_VMA_NAME refuse it, the region is then simply left unnamed
+			static void NameRegion(void* ptr, std::size_t size)
+			{
+#ifdef PR_SET_VMA
+				prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, reinterpret_cast<unsigned long>(ptr), size, reinterpret_cast<unsigned long>("khook-jit"));
+#endif
+			}
+#endif
+
+			static void UnmapRegion(void* exec, void* write, std::size_t size)
+			{
 #ifdef _WIN32
-					VirtualFree(startPtr, 0, MEM_RELEASE);
+				if (write != exec)
+				{
+					UnmapViewOfFile(write);
+					UnmapViewOfFile(exec);
+				}
+				else
+				{
+					VirtualFree(exec, 0, MEM_RELEASE);
+				}
 #else
-					munmap(startPtr, size);
+				if (write != exec)
+				{
+					munmap(write, size);
+				}
+				munmap(exec, size);
 #endif
+			}
+
+			void Unmap(Slab* slab)
+			{
+				if (slab->inArena)
+				{
+					// Pages stay mapped and populated, the chunks are only handed back
+					DebugCleanMemory(slab, slab->startPtr, slab->size);
+					std::lock_guard guard(m_ArenaLock);
+					std::size_t first = (slab->startPtr - m_Arena.exec) / SLAB_SIZE;
+					std::size_t count = (slab->size + SLAB_SIZE - 1) / SLAB_SIZE;
+					for (std::size_t i = first; i < first + count; i++)
+					{
+						m_Arena.chunks[i] = false;
+					}
+					m_Arena.carved -= count * SLAB_SIZE;
+				}
+				else
+				{
+					UnmapRegion(slab->startPtr, slab->writePtr, slab->size);
+					m_MappedBytes -= slab->size;
+				}
+				if (InWindow(slab))
+				{
+					m_NearFull = false;
 				}
+			}
 
-				void SetRE()
+			// Must own m_ArenaLock, returns the offset of the first chunks fitting size or SIZE_MAX
+			std::size_t CarveArena(std::size_t size)
+			{
+				std::size_t count = (size + SLAB_SIZE - 1) / SLAB_SIZE;
+				std::size_t run = 0;
+				for (std::size_t i = 0; i < m_Arena.chunks.size(); i++)
 				{
-					Memory::SetAccess(startPtr, size, Memory::Flags::READ | Memory::Flags::EXECUTE);
-					isRE = true;
+					run = m_Arena.chunks[i] ? 0 : run + 1;
+					if (run == count)
+					{
+						std::size_t first = i + 1 - count;
+						for (std::size_t j = first; j <= i; j++)
+						{
+							m_Arena.chunks[j] = true;
+						}
+						m_Arena.carved += count * SLAB_SIZE;
+						return first * SLAB_SIZE;
+					}
 				}
+				return SIZE_MAX;
+			}
 
-				void SetRW()
+			// Must own the size class lock
+			Slab* NewSlab(std::size_t sizeClass, std::size_t size)
+			{
+				Mapping mapping = { nullptr, nullptr };
+				bool inArena = false;
 				{
-					Memory::SetAccess(startPtr, size, Memory::Flags::READ | Memory::Flags::WRITE);
-					isRE = false;
+					std::lock_guard guard(m_ArenaLock);
+					std::size_t offset = (m_Arena.size != 0) ? CarveArena(size) : SIZE_MAX;
+					if (offset != SIZE_MAX)
+					{
+						mapping.exec = m_Arena.exec + offset;
+						mapping.write = m_Arena.write + offset;
+						inArena = true;
+					}
+				}
+				if (!inArena)
+				{
+					mapping = MapAligned(size);
+					// A single view can't be shared by several blocks, see AllocPriv
+					if (mapping.exec != nullptr && mapping.exec == mapping.write && sizeClass != LARGE_CLASS)
+					{
+						UnmapRegion(mapping.exec, mapping.write, size);
+						return nullptr;
+					}
+				}
+				if (mapping.exec == nullptr)
+				{
+					return nullptr;
+				}
+				if (!inArena)
+				{
+					m_MappedBytes += size;
 				}
-			};
 
-			typedef List<AllocatedRegion> ARList;
+				Slab* slab = new Slab;
+				slab->startPtr = reinterpret_cast<unsigned char*>(mapping.exec);
+				slab->writePtr = reinterpret_cast<unsigned char*>(mapping.write);
+				slab->size = size;
+				slab->sizeClass = sizeClass;
+				slab->blockSize = (sizeClass == LARGE_CLASS) ? size : (static_cast<std::size_t>(1) << (sizeClass + MIN_CLASS_SHIFT));
+				slab->usedBlocks = 0;
+				slab->prev = slab->next = nullptr;
+				slab->inPartial = false;
+				slab->inArena = inArena;
+
+				// Lowest addresses are handed out first
+				std::size_t count = slab->BlockCount();
+				slab->freeBlocks.reserve(count);
+				for (std::size_t i = count; i != 0; i--)
+				{
+					slab->freeBlocks.push_back(static_cast<std::uint16_t>(i - 1));
+				}
+				slab->usedMap.assign(count, false);
 
-			std::size_t m_MinAlignment;
-			std::size_t m_PageSize;
-			ARList m_Regions;
+				std::lock_guard guard(m_SlabsLock);
+				m_Slabs[reinterpret_cast<std::uintptr_t>(mapping.exec)] = slab;
+				if (sizeClass == LARGE_CLASS)
+				{
+					m_LargeSlabs[reinterpret_cast<std::uintptr_t>(mapping.exec)] = slab;
+				}
+				return slab;
+			}
 
-			bool AddRegion(std::size_t minSize, bool isolated)
+			// Must own the size class lock
+			void DeleteSlab(Slab* slab)
 			{
-				AllocatedRegion newRegion;
-				newRegion.startPtr = 0;
-				newRegion.isolated = isolated;
-				newRegion.minAlignment = m_MinAlignment;
-
-				// Compute real size -> align up to m_PageSize boundary
-
-				newRegion.size = minSize - (minSize % m_PageSize);
-				if (newRegion.size < minSize)
-					newRegion.size += m_PageSize;
+				{
+					std::lock_guard guard(m_SlabsLock);
+					m_Slabs.erase(reinterpret_cast<std::uintptr_t>(slab->startPtr));
+					m_LargeSlabs.erase(reinterpret_cast<std::uintptr_t>(slab->startPtr));
+				}
+				Unmap(slab);
+				delete slab;
+			}
 
-#ifdef _WIN32
-				newRegion.startPtr = VirtualAlloc(nullptr, newRegion.size, MEM_COMMIT, PAGE_READWRITE);
-#else
-				newRegion.startPtr = mmap(0, newRegion.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-#endif
+			static void LinkPartial(SizeClass& sc, Slab* slab)
+			{
+				slab->prev = nullptr;
+				slab->next = sc.partial;
+				if (sc.partial)
+				{
+					sc.partial->prev = slab;
+				}
+				sc.partial = slab;
+				slab->inPartial = true;
+			}
 
-				if (newRegion.startPtr)
+			static void UnlinkPartial(SizeClass& sc, Slab* slab)
+			{
+				if (slab->prev)
 				{
-					newRegion.SetRW();
-					m_Regions.push_back(newRegion);
-					return true;
+					slab->prev->next = slab->next;
 				}
 				else
 				{
-					return false;
+					sc.partial = slab->next;
+				}
+				if (slab->next)
+				{
+					slab->next->prev = slab->prev;
 				}
+				slab->prev = slab->next = nullptr;
+				slab->inPartial = false;
+			}
 
+			Slab* FindSlab(void* ptr)
+			{
+				std::uintptr_t key = reinterpret_cast<std::uintptr_t>(ptr) & ~(SLAB_SIZE - 1);
+				std::shared_lock guard(m_SlabsLock);
+				auto it = m_Slabs.find(key);
+				if (it != m_Slabs.end())
+				{
+					return it->second;
+				}
+				// Past the first SLAB_SIZE of a large block
+				auto large = m_LargeSlabs.upper_bound(reinterpret_cast<std::uintptr_t>(ptr));
+				if (large == m_LargeSlabs.begin())
+				{
+					return nullptr;
+				}
+				Slab* slab = (--large)->second;
+				return (reinterpret_cast<unsigned char*>(ptr) < slab->startPtr + slab->size) ? slab : nullptr;
 			}
 
-			void *AllocPriv(std::size_t size, bool isolated)
+			void SetAccess(void* ptr, std::uint8_t access)
 			{
-				void *addr;
+				Slab* slab = FindSlab(ptr);
+				if (slab == nullptr || slab->writePtr != slab->startPtr)
+				{
+					// Dual mapped, nothing to do
+					return;
+				}
+				// The block has the pages to itself
+				Memory::SetAccess(slab->startPtr, slab->size, access);
+			}
 
-				if (!isolated)
+			static void DebugCleanMemory(Slab* slab, unsigned char* start, std::size_t size)
+			{
+				std::memset(slab->writePtr + (start - slab->startPtr), 0xCC, size);
+			}
+
+			void *AllocPriv(std::size_t size, bool isolated, bool reachable)
+			{
+				// Without dual mapping every block gets pages of its own, toggling their protection never affects another block.
+				// Slabs found not to be dual mapped are dropped, the block is then allocated on its own
+				bool single = !m_DualMapping;
+				void* ptr = AllocBlock(size, isolated || single, reachable);
+				if (ptr == nullptr && !isolated && !single && !m_DualMapping)
 				{
-					for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
+					ptr = AllocBlock(size, true, reachable);
+				}
+				return ptr;
+			}
+
+			void *AllocBlock(std::size_t size, bool isolated, bool reachable)
+			{
+				if (reachable && m_NearFull)
+				{
+					return nullptr;
+				}
+				std::size_t sizeClass = isolated ? LARGE_CLASS : ClassOf(size);
+				SizeClass& sc = m_Classes[sizeClass];
+				std::lock_guard guard(sc.lock);
+
+				if (sizeClass == LARGE_CLASS)
+				{
+					Slab* slab = NewSlab(LARGE_CLASS, RoundToPage(size));
+					if (slab == nullptr)
+					{
+						return nullptr;
+					}
+					if (reachable && !InWindow(slab))
+					{
+						DeleteSlab(slab);
+						return nullptr;
+					}
+					slab->freeBlocks.clear();
+					slab->usedBlocks = 1;
+					if (slab->inArena)
 					{
-						if (iter->TryAlloc(size, addr))
-							return addr;
+						m_ArenaUsed += slab->blockSize;
 					}
+					m_UsedBytes += slab->blockSize;
+					return slab->startPtr;
 				}
 
-				if (!AddRegion(size, isolated))
-					return NULL;
+				Slab* slab = sc.partial;
+				while (reachable && slab && !InWindow(slab))
+				{
+					slab = slab->next;
+				}
+				if (slab == nullptr)
+				{
+					if (sc.spare && (!reachable || InWindow(sc.spare)))
+					{
+						slab = sc.spare;
+						sc.spare = nullptr;
+					}
+					else
+					{
+						slab = NewSlab(sizeClass, SLAB_SIZE);
+					}
+					if (slab == nullptr)
+					{
+						return nullptr;
+					}
+					LinkPartial(sc, slab);
+					if (reachable && !InWindow(slab))
+					{
+						// Out of reach, but still good for regular allocations
+						return nullptr;
+					}
+				}
 
-				bool tmp = m_Regions.back().TryAlloc(size, addr);
-				assertm(tmp, "TryAlloc fails after AddRegion");
-				return tmp ? addr : NULL;
+				std::uint16_t block = slab->freeBlocks.back();
+				slab->freeBlocks.pop_back();
+				slab->usedMap[block] = true;
+				slab->usedBlocks++;
+				if (slab->freeBlocks.empty())
+				{
+					UnlinkPartial(sc, slab);
+				}
+				if (slab->inArena)
+				{
+					m_ArenaUsed += slab->blockSize;
+				}
+				m_UsedBytes += slab->blockSize;
+				return slab->startPtr + block * slab->blockSize;
 			}
 
 		public:
-			CPageAlloc(size_t minAlignment = 4 /* power of 2 */ ) : m_MinAlignment(minAlignment)
+			CPageAlloc() : m_DualMapping(true), m_Home(reinterpret_cast<std::uintptr_t>(&CPageAlloc::ClassOf)), m_NearFull(false), m_NearCursor(0), m_ArenaUsed(0), m_MappedBytes(0), m_UsedBytes(0)
 			{
 #ifdef _WIN32
 				SYSTEM_INFO sysInfo;
@@ -549,61 +1054,269 @@ namespace KHook
 
 			~CPageAlloc()
 			{
-				// Free all regions
-				for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
+				// Free all slabs
+				for (auto& it : m_Slabs)
+				{
+					if (!it.second->inArena)
+					{
+						UnmapRegion(it.second->startPtr, it.second->writePtr, it.second->size);
+					}
+					delete it.second;
+				}
+				if (m_Arena.size != 0)
+				{
+					UnmapRegion(m_Arena.exec, m_Arena.write, m_Arena.size);
+				}
+			}
+
+			// Reserves a contiguous arena, every new slab is carved from it until it's full.
+			// It's aligned on HUGE_PAGE_SIZE, advised for transparent huge pages, pre-faulted and optionally locked in memory.
+			// Returns false if an arena already exists or couldn't be mapped
+			bool SetupArena(std::size_t size, bool lock)
+			{
+				std::lock_guard guard(m_ArenaLock);
+				if (m_Arena.size != 0 || size == 0)
+				{
+					return false;
+				}
+
+				size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+				Mapping mapping = MapAligned(size, HUGE_PAGE_SIZE);
+				if (mapping.exec == nullptr)
+				{
+					return false;
+				}
+				if (mapping.exec == mapping.write)
+				{
+					// Slabs carved from a single view would share its pages
+					UnmapRegion(mapping.exec, mapping.write, size);
+					return false;
+				}
+				unsigned char* exec = reinterpret_cast<unsigned char*>(mapping.exec);
+				unsigned char* write = reinterpret_cast<unsigned char*>(mapping.write);
+
+#ifdef MADV_HUGEPAGE
+				// Must be done before the pages are faulted in
+				m_Arena.hugePagesAdvised = (madvise(exec, size, MADV_HUGEPAGE) == 0);
+				if (write != exec)
+				{
+					madvise(write, size, MADV_HUGEPAGE);
+				}
+#endif
+				// Pre-fault both views, so no hooked call ever takes a page fault
+				std::memset(write, 0xCC, size);
+				for (std::size_t offset = 0; offset < size; offset += m_PageSize)
+				{
+					static_cast<void>(*reinterpret_cast<volatile unsigned char*>(exec + offset));
+				}
+
+				if (lock)
 				{
-					iter->FreeRegion();
+#ifdef _WIN32
+					m_Arena.locked = (VirtualLock(exec, size) != 0);
+#else
+					m_Arena.locked = (mlock(exec, size) == 0);
+#endif
 				}
+
+				m_Arena.exec = exec;
+				m_Arena.write = write;
+				m_Arena.size = size;
+				m_Arena.chunks.assign(size / SLAB_SIZE, false);
+				m_Arena.carved = 0;
+				m_MappedBytes += size;
+				return true;
 			}
 
-			void *Alloc(size_t size)
+			Usage GetUsage()
 			{
-				return AllocPriv(size, false);
+				return { m_MappedBytes, m_UsedBytes };
 			}
 
-			void *AllocIsolated(size_t size)
+			ArenaStats GetArenaStats()
 			{
-				return AllocPriv(size, true);
+				std::lock_guard guard(m_ArenaLock);
+				return { m_Arena.exec, m_Arena.size, m_Arena.carved, m_ArenaUsed, m_Arena.hugePagesAdvised, m_Arena.locked };
 			}
 
-			void Free(void *ptr)
+			SlabStats GetSlabStats()
 			{
-				for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
+				SlabStats stats = { 0, 0, 0, 0 };
+				for (std::size_t sizeClass = 0; sizeClass <= LARGE_CLASS; sizeClass++)
 				{
-					if (iter->TryFree(ptr))
+					// Slabs only change while their class lock is owned
+					std::lock_guard guard(m_Classes[sizeClass].lock);
+					std::shared_lock slabs(m_SlabsLock);
+					for (auto& it : m_Slabs)
 					{
-						if (iter->allocUnits.empty())
+						Slab* slab = it.second;
+						if (slab->sizeClass != sizeClass)
 						{
-							iter->FreeRegion();
-							m_Regions.erase(iter);
+							continue;
 						}
-						break;
+						if (sizeClass == LARGE_CLASS)
+						{
+							stats.dedicated++;
+							continue;
+						}
+						stats.slabs++;
+						stats.spares += (slab->usedBlocks == 0);
+						stats.freeBytes += slab->freeBlocks.size() * slab->blockSize;
 					}
 				}
+				return stats;
 			}
 
-			void SetRE(void *ptr)
+			void *Alloc(std::size_t size)
+			{
+				return AllocPriv(size, false, false);
+			}
+
+			void *AllocIsolated(std::size_t size)
 			{
-				for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
+				return AllocPriv(size, true, false);
+			}
+
+			// Same as Alloc, but the memory is guaranteed to be within the near window. Returns nullptr if there's no room left
+			void *AllocNear(std::size_t size)
+			{
+				return AllocPriv(size, false, true);
+			}
+
+			// Whether AllocNear is known to fail, code is better emitted without rel32 right away
+			bool IsNearFull() const
+			{
+				return m_NearFull;
+			}
+
+			// Whether code allocated with AllocNear can reach the given address with a rel32 displacement
+			bool IsNear(std::uintptr_t target) const
+			{
+				if (sizeof(void*) == 4)
 				{
-					if (iter->Contains(ptr))
-					{
-						iter->SetRE();
-						break;
-					}
+					return true;
 				}
+				return ((target > m_Home) ? target - m_Home : m_Home - target) < NEAR_RANGE;
 			}
 
-			void SetRW(void *ptr)
+			void Free(void *ptr)
 			{
-				for (ARList::iterator iter = m_Regions.begin(); iter != m_Regions.end(); ++iter)
+				if (ptr == nullptr)
 				{
-					if (iter->Contains(ptr))
+					return;
+				}
+
+				std::size_t sizeClass;
+				Slab* slab;
+				{
+					std::uintptr_t key = reinterpret_cast<std::uintptr_t>(ptr) & ~(SLAB_SIZE - 1);
+					std::shared_lock guard(m_SlabsLock);
+					auto it = m_Slabs.find(key);
+					if (it == m_Slabs.end())
 					{
-						iter->SetRW();
-						break;
+						assertm(false, "Free of an unknown pointer");
+						return;
 					}
+					slab = it->second;
+					sizeClass = slab->sizeClass;
+				}
+
+				SizeClass& sc = m_Classes[sizeClass];
+				std::lock_guard guard(sc.lock);
+				// The slab can't go away while we own its class lock, make sure it didn't before
+				if (FindSlab(ptr) != slab)
+				{
+					assertm(false, "Double free");
+					return;
+				}
+				std::size_t offset = reinterpret_cast<unsigned char*>(ptr) - slab->startPtr;
+				std::size_t block = offset / slab->blockSize;
+				if (offset % slab->blockSize != 0)
+				{
+					assertm(false, "Free of an unknown pointer");
+					return;
+				}
+				if (sizeClass != LARGE_CLASS)
+				{
+					if (!slab->usedMap[block])
+					{
+						assertm(false, "Double free");
+						return;
+					}
+					slab->usedMap[block] = false;
+				}
+				if (slab->inArena)
+				{
+					m_ArenaUsed -= slab->blockSize;
+				}
+				m_UsedBytes -= slab->blockSize;
+
+				if (sizeClass == LARGE_CLASS)
+				{
+					DeleteSlab(slab);
+					return;
+				}
+
+				DebugCleanMemory(slab, reinterpret_cast<unsigned char*>(ptr), slab->blockSize);
+				slab->freeBlocks.push_back(static_cast<std::uint16_t>(block));
+				slab->usedBlocks--;
+				if (m_NearFull && InWindow(slab))
+				{
+					m_NearFull = false;
+				}
+
+				if (slab->usedBlocks == 0)
+				{
+					if (slab->inPartial)
+					{
+						UnlinkPartial(sc, slab);
+					}
+					if (sc.spare == nullptr)
+					{
+						sc.spare = slab;
+					}
+					else
+					{
+						DeleteSlab(slab);
+					}
+				}
+				else if (!slab->inPartial)
+				{
+					LinkPartial(sc, slab);
+				}
+			}
+
+			// Returns the address through which the given executable memory can be written
+			void *GetWritable(void *ptr)
+			{
+				Slab* slab = FindSlab(ptr);
+				if (slab == nullptr)
+				{
+					return ptr;
 				}
+				return slab->writePtr + (reinterpret_cast<unsigned char*>(ptr) - slab->startPtr);
+			}
+
+			bool IsDualMapped()
+			{
+				return m_DualMapping;
+			}
+
+			// Without dual mapping, the block of ptr is written in place : SetRW() before writing code no thread runs,
+			// SetRWX() before patching code threads may be running, SetRE() once done. No-ops if dual mapped
+			void SetRE(void *ptr)
+			{
+				SetAccess(ptr, Memory::Flags::READ | Memory::Flags::EXECUTE);
+			}
+
+			void SetRW(void *ptr)
+			{
+				SetAccess(ptr, Memory::Flags::READ | Memory::Flags::WRITE);
+			}
+
+			void SetRWX(void *ptr)
+			{
+				SetAccess(ptr, Memory::Flags::READ | Memory::Flags::WRITE | Memory::Flags::EXECUTE);
 			}
 
 			std::size_t GetPageSize()
@@ -611,19 +1324,92 @@ namespace KHook
 				return m_PageSize;
 			}
 		};
-		static CPageAlloc Allocator;
+		// Shared by every translation unit
+		inline CPageAlloc Allocator;
+
+		/*
+		Code is emitted into a heap staging buffer, finalize() then copies it once into executable memory
+		of the exact final size. Nothing but finalize() ever touches executable memory.
 
+		rel32 displacements to absolute targets are recorded and resolved by finalize(), which then places
+		the code within the allocator's near window. If that fails finalize() returns nullptr, the code must
+		be emitted again with SetNear(false).
+
+		A buffer can serve as a template : every pointer immediate and rel32 target lying within the range given
+		to SetPatchBase() is recorded relative to it. instantiate() copies the template and rebases those values
+		on a new base, which is much cheaper than emitting the code again.
+
+		unwind() records how to find the caller's frame from the current position on, the rows outlive finalize()
+		so the code can be described to unwinders once its address is known.
+
+		probe() emits an 8 bytes aligned NOP, which set_probes() atomically swaps with a call to the position marked
+		by probe_target() once the code is finalized, and back.
+		*/
 		class GenBuffer
 		{
-			unsigned char* m_pData;
+		public:
+			struct UnwindRow
+			{
+				// Offset from which the row applies
+				std::uint32_t offset;
+				// DWARF number of the register the canonical frame address is relative to
+				std::uint8_t cfaReg;
+				std::int32_t cfaOffset;
+				// Where the caller's frame pointer is saved relative to the canonical frame address, 0 if it's in place
+				std::int32_t fpOffset;
+			};
+
+			struct ProbeSite
+			{
+				std::uint32_t offset;
+				// Meaning left to the emitter
+				std::uint8_t kind;
+			};
+
+		private:
+			struct Relocation
+			{
+				// Offset of the displacement, it must end the instruction
+				std::uint32_t offset;
+				// Relative to the patch base if based
+				std::uintptr_t target;
+				bool based;
+			};
+
+			struct Patch
+			{
+				// Offset of a pointer immediate
+				std::uint32_t offset;
+				// Relative to the patch base
+				std::uintptr_t delta;
+			};
+
+			// Staging buffer
+			unsigned char* m_pStage;
 			std::uint32_t m_Size;
 			std::uint32_t m_AllocatedSize;
+			// Executable memory, only valid once finalized
+			unsigned char* m_pData;
+			std::vector<Relocation> m_Relocs;
+			std::vector<Patch> m_Patches;
+			bool m_Near;
+			std::uintptr_t m_PatchBase;
+			std::size_t m_PatchSize;
+			std::vector<UnwindRow> m_Unwind;
+			std::vector<ProbeSite> m_Probes;
+			std::uint32_t m_ProbeTarget;
+
+			static constexpr std::uint8_t NOP8[8] = { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
 		public:
-			GenBuffer() : m_pData(nullptr), m_Size(0), m_AllocatedSize(0) {}
+			GenBuffer() : m_pStage(nullptr), m_Size(0), m_AllocatedSize(0), m_pData(nullptr), m_Near(true), m_PatchBase(0), m_PatchSize(0), m_ProbeTarget(0) {}
 			~GenBuffer() { clear(); }
+			GenBuffer(const GenBuffer&) = delete;
+			GenBuffer& operator=(const GenBuffer&) = delete;
 			std::uint32_t GetSize() { return m_Size; }
+			// Returns the executable code, nullptr until finalized
 			unsigned char *GetData() { return m_pData; }
+			unsigned char *GetStage() { return m_pStage; }
 
 			template <class PT> void push(PT what) {
 				push((const unsigned char *)&what, sizeof(PT));
@@ -634,21 +1420,216 @@ namespace KHook
 			}
 
 			void rewrite(std::uint32_t offset, const unsigned char *data, std::uint32_t size) {
-				assertm(offset + size <= m_AllocatedSize, "rewrite too far");
-				std::memcpy((void*)(m_pData + offset), (const void*)data, size);
+				assertm(offset + size <= m_Size, "rewrite too far");
+				assertm(m_pData == nullptr, "rewrite after finalize");
+				std::memcpy((void*)(m_pStage + offset), (const void*)data, size);
+			}
+
+			// Pre-sizes the staging buffer, avoids regrowths if the final size can be estimated
+			void reserve(std::uint32_t size) {
+				if (size > m_AllocatedSize) {
+					grow(size);
+				}
+			}
+
+			// Allows (default) or forbids rel32 displacements to absolute targets
+			void SetNear(bool reachable) {
+				assertm(m_Size == 0, "SetNear after emission");
+				m_Near = reachable;
+			}
+
+			bool IsNear(std::uintptr_t target) {
+				return m_Near && Allocator.IsNear(target);
+			}
+
+			// Emits a rel32 displacement to target, resolved by finalize
+			void write_rel32(std::uintptr_t target) {
+				assertm(IsNear(target), "rel32 target out of reach");
+				if (IsPatchable(target)) {
+					m_Relocs.push_back({ m_Size, target - m_PatchBase, true });
+				} else {
+					m_Relocs.push_back({ m_Size, target, false });
+				}
+				write_int32(0);
+			}
+
+			// Emits a pointer sized immediate, recorded as a patch if it lies within the patch base range
+			void write_ptr(std::uintptr_t value) {
+				if (IsPatchable(value)) {
+					m_Patches.push_back({ m_Size, value - m_PatchBase });
+				}
+				push(value);
+			}
+
+			// Values emitted within [base, base + size) are recorded relative to base
+			void SetPatchBase(std::uintptr_t base, std::size_t size) {
+				m_PatchBase = base;
+				m_PatchSize = size;
+			}
+
+			bool IsPatchable(std::uintptr_t value) {
+				return m_PatchSize != 0 && value >= m_PatchBase && value - m_PatchBase < m_PatchSize;
+			}
+
+			// The caller's frame is described by these values from the current position on
+			void unwind(std::uint8_t cfaReg, std::int32_t cfaOffset, std::int32_t fpOffset) {
+				if (!m_Unwind.empty() && m_Unwind.back().offset == m_Size) {
+					m_Unwind.back() = { m_Size, cfaReg, cfaOffset, fpOffset };
+				} else {
+					m_Unwind.push_back({ m_Size, cfaReg, cfaOffset, fpOffset });
+				}
+			}
+
+			// Hands over the rows, by offset
+			std::vector<UnwindRow> TakeUnwindRows() {
+				return std::move(m_Unwind);
+			}
+
+			// Multi byte NOP of the given size, up to 8 bytes
+			void nop(std::uint32_t size) {
+				static constexpr std::uint8_t nops[8][8] = {
+					{ 0x90 },
+					{ 0x66, 0x90 },
+					{ 0x0F, 0x1F, 0x00 },
+					{ 0x0F, 0x1F, 0x40, 0x00 },
+					{ 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+					{ 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+					{ 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+					{ 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 }
+				};
+				assertm(size != 0 && size <= 8, "nop size out of range");
+				push(nops[size - 1], size);
+			}
+
+			// Probe site, the buffer start must be 8 bytes aligned for it to be patched atomically
+			void probe(std::uint8_t kind) {
+				if (m_Size % 8 != 0) {
+					nop(8 - m_Size % 8);
+				}
+				m_Probes.push_back({ m_Size, kind });
+				push(NOP8, sizeof(NOP8));
+			}
+
+			// Enabled probe sites call the code emitted from here, with the return address right after them
+			void probe_target() {
+				m_ProbeTarget = m_Size;
+			}
+
+			// Kind of the probe site that called the probe target from return_address, -1 if none did
+			int probe_kind(std::uintptr_t return_address) const {
+				for (auto& site : m_Probes) {
+					if (reinterpret_cast<std::uintptr_t>(m_pData) + site.offset + 5 == return_address) {
+						return site.kind;
+					}
+				}
+				return -1;
+			}
+
+			// Swaps every probe site of the finalized code for a call to the probe target, or back to a NOP.
+			// Threads running the code see either instruction, never a mix. Returns false if there are no sites
+			bool set_probes(bool enabled) {
+				if (m_pData == nullptr || m_Probes.empty()) {
+					return false;
+				}
+				// Through the writable view, or in place if not dual mapped. Either way the code stays executable for the threads running it
+				Allocator.SetRWX(m_pData);
+				for (auto& site : m_Probes) {
+					std::uint8_t bytes[8];
+					if (enabled) {
+						// call rel32, followed by a 3 bytes NOP
+						std::int32_t disp = static_cast<std::int32_t>(m_ProbeTarget) - static_cast<std::int32_t>(site.offset + 5);
+						bytes[0] = 0xE8;
+						std::memcpy(&bytes[1], &disp, sizeof(disp));
+						bytes[5] = 0x0F; bytes[6] = 0x1F; bytes[7] = 0x00;
+					} else {
+						std::memcpy(bytes, NOP8, sizeof(bytes));
+					}
+					std::uint64_t value;
+					std::memcpy(&value, bytes, sizeof(value));
+					reinterpret_cast<std::atomic<std::uint64_t>*>(Allocator.GetWritable(m_pData + site.offset))->store(value, std::memory_order_release);
+				}
+				Allocator.SetRE(m_pData);
+				return true;
+			}
+
+			// Copies the code of a template, patches are rebased on base. Returns false if the rebased
+			// rel32 targets are out of reach, the template emitted with SetNear(false) must be used instead
+			bool instantiate(const GenBuffer& tmpl, std::uintptr_t base) {
+				clear();
+				m_Near = tmpl.m_Near;
+				m_PatchBase = base;
+				m_PatchSize = tmpl.m_PatchSize;
+				reserve(tmpl.m_Size);
+				push(tmpl.m_pStage, tmpl.m_Size);
+				m_Relocs = tmpl.m_Relocs;
+				m_Patches = tmpl.m_Patches;
+				m_Unwind = tmpl.m_Unwind;
+				m_Probes = tmpl.m_Probes;
+				m_ProbeTarget = tmpl.m_ProbeTarget;
+				for (auto& patch : m_Patches) {
+					rewrite(patch.offset, base + patch.delta);
+				}
+				for (auto& reloc : m_Relocs) {
+					if (reloc.based && !IsNear(base + reloc.target)) {
+						return false;
+					}
+				}
+				return true;
+			}
+
+			// Commits the emitted code to executable memory, the staging buffer is released
+			void *finalize() {
+				if (m_pData || m_Size == 0) {
+					return m_pData;
+				}
+
+				unsigned char* code;
+				if (m_Relocs.empty()) {
+					code = reinterpret_cast<unsigned char*>(Allocator.Alloc(m_Size));
+					if (!code) {
+						assertm(false, "bad_alloc: couldn't allocate executable memory\n");
+						return nullptr;
+					}
+				} else {
+					code = reinterpret_cast<unsigned char*>(Allocator.AllocNear(m_Size));
+					if (!code) {
+						// No room close enough, the caller should emit again without rel32
+						return nullptr;
+					}
+					for (auto& reloc : m_Relocs) {
+						std::uintptr_t target = reloc.based ? m_PatchBase + reloc.target : reloc.target;
+						std::intptr_t disp = static_cast<std::intptr_t>(target - reinterpret_cast<std::uintptr_t>(code + reloc.offset + sizeof(std::int32_t)));
+						assertm(disp >= INT32_MIN && disp <= INT32_MAX, "rel32 displacement overflow");
+						rewrite(reloc.offset, static_cast<std::int32_t>(disp));
+					}
+				}
+				std::memcpy(Allocator.GetWritable(code), (const void*)m_pStage, m_Size);
+				// No-op if dual mapped, the block is only ever read+write before that otherwise
+				Allocator.SetRE(code);
+
+				m_pData = code;
+				std::free(m_pStage);
+				m_pStage = nullptr;
+				m_AllocatedSize = 0;
+				m_Relocs.clear();
+				m_Patches.clear();
+				return m_pData;
 			}
 
 			void clear() {
 				if (m_pData) {
 					Allocator.Free(reinterpret_cast<void*>(m_pData));
 				}
+				std::free(m_pStage);
+				m_pStage = nullptr;
 				m_pData = nullptr;
 				m_Size = 0;
 				m_AllocatedSize = 0;
-			}
-
-			void SetRE() {
-				Allocator.SetRE(reinterpret_cast<void*>(m_pData));
+				m_Relocs.clear();
+				m_Patches.clear();
+				m_Unwind.clear();
+				m_Probes.clear();
+				m_ProbeTarget = 0;
 			}
 
 			operator void *() {
@@ -678,30 +1659,29 @@ namespace KHook
 				offs = get_outputpos() - offs;
 			}
 private:
+			void grow(std::uint32_t size) {
+				unsigned char *newBuf = reinterpret_cast<unsigned char*>(std::realloc(m_pStage, size));
+				if (!newBuf) {
+					assertm(false, "bad_alloc: couldn't allocate new bytes of memory\n");
+					return;
+				}
+				m_pStage = newBuf;
+				m_AllocatedSize = size;
+			}
+
 			void push(const unsigned char *data, std::uint32_t size) {
+				assertm(m_pData == nullptr, "push after finalize");
 				std::uint32_t newSize = m_Size + size;
 				if (newSize > m_AllocatedSize) {
-					m_AllocatedSize = newSize > m_AllocatedSize*2 ? newSize : m_AllocatedSize*2;
-					if (m_AllocatedSize < 64)
-						m_AllocatedSize = 64;
-
-					unsigned char *newBuf;
-					newBuf = reinterpret_cast<unsigned char*>(Allocator.Alloc(m_AllocatedSize));
-					Allocator.SetRW(newBuf);
-					if (!newBuf) {
-						assertm(false, "bad_alloc: couldn't allocate new bytes of memory\n");
+					std::uint32_t allocSize = newSize > m_AllocatedSize*2 ? newSize : m_AllocatedSize*2;
+					if (allocSize < 64)
+						allocSize = 64;
+					grow(allocSize);
+					if (newSize > m_AllocatedSize) {
 						return;
 					}
-					std::memset((void*)newBuf, 0xCC, m_AllocatedSize);			// :TODO: remove this !
-					std::memcpy((void*)newBuf, (const void*)m_pData, m_Size);
-					if (m_pData) {
-						Allocator.SetRE(reinterpret_cast<void*>(m_pData));
-						Allocator.SetRW(newBuf);
-						Allocator.Free(reinterpret_cast<void*>(m_pData));
-					}
-					m_pData = newBuf;
 				}
-				std::memcpy((void*)(m_pData + m_Size), (const void*)data, size);
+				std::memcpy((void*)(m_pStage + m_Size), (const void*)data, size);
 				m_Size = newSize;
 			}
 		};
@@ -346,13 +346,13 @@ namespace KHook
 
 			void mov(x86_Reg dst, std::int32_t imm) {
 				this->write_ubyte(0xB8 + dst.low());
-				this->write_int32(imm);
+				this->write_ptr(static_cast<std::uint32_t>(imm));
 			}
 
 			void mov(x86_RegRm dst, std::int32_t imm) {
 				this->write_ubyte(0xC7);
 				dst.write_modrm(this);
-				this->write_int32(imm);
+				this->write_ptr(static_cast<std::uint32_t>(imm));
 			}
 
 			void add(x86_Reg dst, x86_Reg src) {
@@ -326,6 +326,30 @@ namespace KHook
 				this->write_ubyte(0xD0 + reg.low());
 			}
 
+			// rel32 if the target is within reach, otherwise clobbers rax
+			void call(std::uintptr_t target) {
+				if (this->IsNear(target)) {
+					this->write_ubyte(0xE8);
+					this->write_rel32(target);
+				} else {
+					this->mov(rax, static_cast<std::uint64_t>(target));
+					this->call(rax);
+				}
+			}
+
+			// mov dst, [address] - RIP relative if the address is within reach
+			void load(x86_64_Reg dst, std::uintptr_t address) {
+				if (this->IsNear(address)) {
+					this->write_ubyte(dst.extended() ? REX::WR : REX::W);
+					this->write_ubyte(0x8B);
+					this->write_ubyte((DISP0 << 6) | (dst.low() << 3) | 0b101);
+					this->write_rel32(address);
+				} else {
+					this->mov(dst, static_cast<std::uint64_t>(address));
+					this->mov(dst, dst());
+				}
+			}
+
 			// Absolute
 			void jump(x86_64_Reg reg) {
 				if (reg.extended()) {
@@ -335,6 +359,19 @@ namespace KHook
 				this->write_ubyte(0xE0 + reg.low());
 			}
 
+			// Absolute, rel32 if the target is within reach otherwise jmp [rip+0] followed by the address. Clobbers nothing
+			void jump_abs(std::uintptr_t target) {
+				if (this->IsNear(target)) {
+					this->write_ubyte(0xE9);
+					this->write_rel32(target);
+				} else {
+					this->write_ubyte(0xFF);
+					this->write_ubyte(0x25);
+					this->write_int32(0);
+					this->write_uint64(target);
+				}
+			}
+
 			// Near
 			void jump(std::int32_t off) {
 				if (off >= -127 && off <= 127) {
@@ -505,7 +542,8 @@ namespace KHook
 			}
 
 			void mov(x86_64_Reg dst, std::uint64_t imm) {
-				if (imm <= UINT32_MAX) {
+				// Patchable values keep the full size, they may not fit 32 bits once rebased
+				if (imm <= UINT32_MAX && !this->IsPatchable(imm)) {
 					this->mov(dst, std::int32_t(imm));
 					return;
 				}
@@ -516,7 +554,7 @@ namespace KHook
 					this->write_ubyte(REX::W);
 				}
 				this->write_ubyte(0xB8 + dst.low());
-				this->write_uint64(imm);
+				this->write_ptr(imm);
 			}
 
 			void movsd(x86_64_FloatReg reg, x86_64_RegRm rm) {
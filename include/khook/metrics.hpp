@@ -0,0 +1,94 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Layout of the shared memory block published by KHook::StartMetricsExport, /dev/shm/khook-<pid> on Linux.
+//
+// [Header][Capsule 0] ... [Capsule capacity - 1]
+//
+// The block is rewritten in place under a seqlock, the writer never waits for readers. A consistent copy is taken by:
+// 1. reading sequence, retrying later if it's odd (an update is in progress);
+// 2. copying the header and the capsule_count first capsules;
+// 3. reading sequence again, the copy is consistent if it didn't change.
+//
+// header_size and capsule_size give the size of each structure as written,
+// readers must use them to step through the block so fields can be appended in later versions.
+namespace KHook
+{
+	namespace Metrics
+	{
+		static constexpr char BLOCK_MAGIC[8] = { 'K', 'H', 'M', 'E', 'T', 'R', 'I', 'C' };
+		static constexpr std::uint32_t BLOCK_VERSION = 1;
+
+		static constexpr std::uint32_t HISTOGRAM_BUCKETS = 32;
+
+		struct Header {
+			// Set once when the block is created, never rewritten
+			char magic[8];
+			std::uint32_t version;
+			std::uint32_t header_size;
+			std::uint32_t capsule_size;
+			// Capsules the block has room for
+			std::uint32_t capacity;
+			// 4 or 8, the size of the publishing process' pointers
+			std::uint32_t pointer_size;
+			std::uint32_t histogram_buckets;
+
+			// Odd while an update is in progress, incremented twice per update
+			std::atomic<std::uint64_t> sequence;
+
+			// Everything below is rewritten on every update.
+			// Steady clock nanoseconds (CLOCK_MONOTONIC) of the update, and the interval between updates in milliseconds
+			std::uint64_t update_ns;
+			std::uint32_t interval_ms;
+			// Capsules following the header, and those left out because the block was full
+			std::uint32_t capsule_count;
+			std::uint64_t dropped_capsules;
+
+			// Asynchronous hook operations waiting for the worker threads
+			std::uint64_t pending_inserts;
+			std::uint64_t pending_deletes;
+
+			// See KHook::MemoryStats
+			std::uint64_t code_mapped;
+			std::uint64_t code_used;
+			std::uint64_t code_fragmented;
+			std::uint64_t detour_code;
+			std::uint64_t callbacks;
+			std::uint64_t table_bytes;
+			std::uint64_t dispatch_threads;
+			std::uint64_t dispatch_thread_bytes;
+			std::uint64_t hooked_instances;
+			std::uint64_t instance_cleanups;
+		};
+		static_assert(sizeof(Header) == 160);
+		static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+		struct Capsule {
+			// Hooked function address (the vtable entry address for virtual hooks)
+			std::uint64_t function;
+			// Hooks attached to it
+			std::uint32_t hooks;
+			// 0 if the detour isn't instrumented (see KHook::SetStatsEnabled), every counter below is then 0
+			std::uint32_t sample_rate;
+			// See KHook::HookStats
+			std::uint64_t calls;
+			std::uint64_t supersedes;
+			std::uint64_t overrides;
+			std::uint64_t cycles;
+			// Bucket i counts the calls that took [2^i, 2^(i+1)) timestamp counter cycles
+			std::uint64_t histogram[HISTOGRAM_BUCKETS];
+		};
+		static_assert(sizeof(Capsule) == 304);
+	}
+}
@@ -0,0 +1,99 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+
+#include <cstdint>
+
+// Layout of the files written by KHook::DumpTrace, every field is little endian.
+//
+// [FileHeader]
+// [RingHeader 0][Record 0] ... [Record count - 1]
+// [RingHeader 1][Record 0] ... [Record count - 1]
+// ...
+//
+// header_size, ring_header_size and record_size give the size of each structure as written,
+// readers must use them to step through the file so fields can be appended in later versions.
+namespace KHook
+{
+	namespace Trace
+	{
+		static constexpr char FILE_MAGIC[8] = { 'K', 'H', 'T', 'R', 'A', 'C', 'E', '\0' };
+		static constexpr std::uint32_t FILE_VERSION = 1;
+
+		static constexpr std::uint32_t INT_REGS = 8;
+		static constexpr std::uint32_t FLOAT_REGS = 8;
+		static constexpr std::uint32_t STACK_WORDS = 4;
+
+		enum class Event : std::uint32_t {
+			// A call went through the detour, recalls aren't recorded
+			Entry = 0,
+			// That call is over, or was handed over to the original function if the detour had no callbacks
+			Exit,
+			// The record was overwritten while it was being dumped
+			Lost
+		};
+
+		struct FileHeader {
+			char magic[8];
+			std::uint32_t version;
+			std::uint32_t header_size;
+			std::uint32_t ring_header_size;
+			std::uint32_t record_size;
+			std::uint32_t ring_count;
+			// 4 or 8, the size of the traced process' pointers
+			std::uint32_t pointer_size;
+			// Timestamp counter and steady clock (nanoseconds) read together when tracing started and when dumping,
+			// they give the timestamp counter frequency
+			std::uint64_t start_ticks;
+			std::uint64_t start_ns;
+			std::uint64_t dump_ticks;
+			std::uint64_t dump_ns;
+			// Threads that made hooked calls while every ring was taken, none of their calls were recorded
+			std::uint64_t untraced_threads;
+		};
+		static_assert(sizeof(FileHeader) == 72);
+
+		struct RingHeader {
+			// Operating system id of the thread owning the ring
+			std::uint64_t thread;
+			// Sequence number of the first record, the thread's calls are numbered from 0
+			std::uint64_t first;
+			// Records following this header
+			std::uint64_t count;
+			// Records overwritten before they could be dumped, the ring was too small for the call rate
+			std::uint64_t overwritten;
+		};
+		static_assert(sizeof(RingHeader) == 32);
+
+		struct Record {
+			// Timestamp counter
+			std::uint64_t timestamp;
+			// Hooked function address (the vtable entry address for virtual hooks)
+			std::uint64_t function;
+			// Entry only, where the hooked function returns to
+			std::uint64_t return_address;
+			Event event;
+			// Exit only, hook whose callback set the final action, INVALID_HOOK if none did
+			std::uint32_t hook;
+			// Exit only, the final KHook::Action of the call
+			std::uint32_t action;
+			std::uint32_t reserved;
+			// Entry only, the registers saved by the detour in the order it saves them.
+			// x86_64 : the integer argument registers (rdi, rsi, rdx, rcx, r8, r9 or rcx, rdx, r8, r9 on Windows)
+			// x86 : eax, eax, eax, ecx, edx, ebx, esi, edi
+			std::uint64_t int_regs[INT_REGS];
+			// Entry only, low 64 bits of xmm0-xmm7 (xmm0-xmm3 on Windows), always 0 on x86
+			std::uint64_t float_regs[FLOAT_REGS];
+			// Entry only, the first words above the return address, the stack arguments if there are any
+			std::uint64_t stack[STACK_WORDS];
+		};
+		static_assert(sizeof(Record) == 200);
+	}
+}
@@ -0,0 +1,68 @@
+#include "audit.hpp"
+
+#ifdef KHOOK_AUDIT
+#include <cstdlib>
+#include <new>
+
+// Audit builds replace the global allocation functions of the whole program, allocations made by the thread
+// are counted as long as it's within the dispatcher. Over-aligned allocations keep the default implementation
+namespace KHook {
+
+static void* Allocate(std::size_t size) {
+	Audit::Count(&AuditCounters::allocations);
+	return std::malloc((size != 0) ? size : 1);
+}
+
+static void Release(void* block) {
+	if (block != nullptr) {
+		Audit::Count(&AuditCounters::deallocations);
+		std::free(block);
+	}
+}
+
+}
+
+void* operator new(std::size_t size) {
+	void* block = KHook::Allocate(size);
+	if (block == nullptr) {
+		throw std::bad_alloc();
+	}
+	return block;
+}
+
+void* operator new[](std::size_t size) {
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+	return KHook::Allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+	return KHook::Allocate(size);
+}
+
+void operator delete(void* block) noexcept {
+	KHook::Release(block);
+}
+
+void operator delete[](void* block) noexcept {
+	KHook::Release(block);
+}
+
+void operator delete(void* block, std::size_t) noexcept {
+	KHook::Release(block);
+}
+
+void operator delete[](void* block, std::size_t) noexcept {
+	KHook::Release(block);
+}
+
+void operator delete(void* block, const std::nothrow_t&) noexcept {
+	KHook::Release(block);
+}
+
+void operator delete[](void* block, const std::nothrow_t&) noexcept {
+	KHook::Release(block);
+}
+#endif
@@ -0,0 +1,75 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: ZLIB
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace KHook {
+	// What the dispatcher did on behalf of a capsule, only counted when built with KHOOK_AUDIT
+	struct AuditCounters {
+		std::atomic<std::uint64_t> calls{0};
+		std::atomic<std::uint64_t> allocations{0};
+		std::atomic<std::uint64_t> deallocations{0};
+		std::atomic<std::uint64_t> locks{0};
+		std::atomic<std::uint64_t> syscalls{0};
+
+		void Reset() {
+			calls.store(0, std::memory_order_relaxed);
+			allocations.store(0, std::memory_order_relaxed);
+			deallocations.store(0, std::memory_order_relaxed);
+			locks.store(0, std::memory_order_relaxed);
+			syscalls.store(0, std::memory_order_relaxed);
+		}
+	};
+
+	namespace Audit {
+#ifdef KHOOK_AUDIT
+		// Counters of the capsule the calling thread is dispatching, nullptr outside of the dispatcher.
+		// Trivially initialized, so operator new can read it at any time
+		inline thread_local AuditCounters* g_current = nullptr;
+
+		inline void Count(std::atomic<std::uint64_t> AuditCounters::* counter) {
+			if (g_current) {
+				(g_current->*counter).fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		// Attributes everything the thread does to the counters until destruction
+		class Scope {
+		public:
+			explicit Scope(AuditCounters* counters) : _previous(g_current) {
+				g_current = counters;
+			}
+			~Scope() {
+				g_current = _previous;
+			}
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+
+		private:
+			AuditCounters* _previous;
+		};
+#endif
+
+		// A lock is about to be acquired
+		inline void Lock() {
+#ifdef KHOOK_AUDIT
+			Count(&AuditCounters::locks);
+#endif
+		}
+
+		// A system call is about to be made
+		inline void Syscall() {
+#ifdef KHOOK_AUDIT
+			Count(&AuditCounters::syscalls);
+#endif
+		}
+	}
+}
@@ -1,14 +1,26 @@
 #include "detour.hpp"
-
+#include "epoch.hpp"
+#include "lifecycle.hpp"
+#include "metrics.hpp"
+#include "perf.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <stack>
+#include <string>
 #include <iostream>
 #include <list>
+#include <atomic>
 
 namespace KHook {
 
 using namespace KHook::Asm;
 
 #define STACK_SAFETY_BUFFER 112
+// Rough upper bound of a detour's JIT size, avoids regrowing the staging buffer
+#define JIT_SIZE_ESTIMATE 2048
 
 #ifdef KHOOK_X64
 #define FUNCTION_ATTRIBUTE_PREFIX(ret) ret
@@ -51,6 +63,13 @@ static_assert((reg_count * 4) % 16 == 0);
 #define WIN_ONLY(x)
 #endif
 
+// What the calling helper does is accounted to the capsule in audit builds
+#ifdef KHOOK_AUDIT
+#define AUDIT_SCOPE(capsule) Audit::Scope audit_scope(&(capsule)->_audit)
+#else
+#define AUDIT_SCOPE(capsule)
+#endif
+
 template<typename T, typename Ret, typename... Args>
 union MFP {
 	MFP(Ret (T::*func)(Args...)) : mfp(func) {
@@ -73,34 +92,51 @@ union MFP {
 	}
 };
 
-static FUNCTION_ATTRIBUTE_PREFIX(void) RecursiveLockUnlockShared(std::shared_mutex* mutex, bool lock) FUNCTION_ATTRIBUTE_SUFFIX {
-	static thread_local std::unordered_map<std::shared_mutex*, std::uint32_t> lock_counts;
+// Heap held by the threads for dispatching, and how many threads hold some
+static std::atomic<std::size_t> g_thread_state_bytes = 0;
+static std::atomic<std::size_t> g_thread_state_threads = 0;
+// Instances of every KHook::Virtual, see CountInstances
+static std::atomic<std::size_t> g_hooked_instances = 0;
+static std::atomic<std::size_t> g_instance_cleanups = 0;
+
+static void AccountThreadState(std::ptrdiff_t bytes) {
+	// Constructed on the first allocation of the thread, destroyed when it exits
+	struct Owner {
+		Owner() { g_thread_state_threads++; }
+		~Owner() { g_thread_state_threads--; }
+	};
+	static thread_local Owner owner;
+	static_cast<void>(owner);
+	g_thread_state_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
 
-	auto it = lock_counts.find(mutex);
-	if (it == lock_counts.end()) {
-		it = lock_counts.insert_or_assign(mutex, 0).first;
-	}
+// Used by every thread local container of the dispatcher, they only allocate while growing
+template<typename T>
+struct ThreadStateAllocator : std::allocator<T> {
+	template<typename U>
+	struct rebind {
+		using other = ThreadStateAllocator<U>;
+	};
 
-	if (lock) {
-		it->second++;
-		// First time lock
-		if (it->second == 1) {
-			mutex->lock_shared();
-		}
-	} else {
-		if (it->second == 0) {
-			std::abort();
-		}
+	ThreadStateAllocator() = default;
+	template<typename U>
+	ThreadStateAllocator(const ThreadStateAllocator<U>&) {}
 
-		it->second--;
-		// No more locks, so unlock
-		if (it->second == 0) {
-			mutex->unlock_shared();
-		}
+	T* allocate(std::size_t n) {
+		AccountThreadState(n * sizeof(T));
+		return std::allocator<T>::allocate(n);
 	}
-}
 
-struct AsmLoopDetails {
+	void deallocate(T* ptr, std::size_t n) {
+		AccountThreadState(-static_cast<std::ptrdiff_t>(n * sizeof(T)));
+		std::allocator<T>::deallocate(ptr, n);
+	}
+};
+
+template<typename T>
+using ThreadStateStack = std::stack<T, std::vector<T, ThreadStateAllocator<T>>>;
+
+struct alignas(16) AsmLoopDetails {
 	// Current iterated hook
 	std::uintptr_t linked_list_it;
 	std::uintptr_t pre_loop_started;
@@ -128,30 +164,166 @@ struct AsmLoopDetails {
 	std::uintptr_t sp_saved_registers;
 	std::uintptr_t sp_saved_stack;
 
+	// Sizes of the blocks above, they're released to g_return_values
+	std::uintptr_t original_return_size;
+	std::uintptr_t override_return_size;
+
 	// For recall & hooks
 	std::uintptr_t fn_original_function_ptr;
 	std::uintptr_t fn_recall_function_ptr;
 	DetourCapsule* capsule;
-#ifndef KHOOK_X64
-	std::uint8_t pad[1];
-#else
-	std::uint8_t pad[8];
-#endif
+	// Timestamp counter at the detour entry, only set by instrumented detours
+	std::uint64_t entry_timestamp;
+	// Hook whose callback set the current action
+	std::uintptr_t action_hook;
+	// Callbacks published when the call began, hooks inserted or removed since don't change them
+	std::uintptr_t start_callbacks;
+	std::uintptr_t end_callbacks;
 	static_assert(sizeof(std::uintptr_t) == sizeof(void*));
 	static_assert(sizeof(std::uint32_t) >= sizeof(KHook::Action));
 };
 static constexpr auto local_params_size = sizeof(AsmLoopDetails);
 static_assert(local_params_size % 16 == 0);
 
-static thread_local std::stack<AsmLoopDetails*> g_saved_params;
+static std::atomic<DispatchMode> g_dispatch_mode = DispatchMode::Dedicated;
+static std::atomic<bool> g_stats_enabled = false;
+static std::atomic<bool> g_unwind_enabled = false;
+static std::atomic<std::uint32_t> g_default_sample_rate = 1;
+static TraceBuffers g_trace;
+// Calls are in an epoch from BeginDetour to the end of the detour, what they read is freed after a grace period
+static Epochs g_epochs;
+static PerfMap g_perf;
+static std::mutex g_tracing_mutex;
+static std::atomic<fnTracepointCallback> g_tracepoint_callback = nullptr;
+static std::atomic<void*> g_tracepoint_user = nullptr;
+
+#ifdef KHOOK_X64
+// Dispatch code shared by every capsule of the same code key, one with instrumentation and one without
+struct SharedDispatcher {
+	DetourCapsule::AsmJit jit;
+	// Start of the code, the code reads it to compute its own return addresses
+	std::uintptr_t code = 0;
+	// Registered by the first capsule created with unwind info enabled
+	UnwindInfo unwind;
+	// Capsules traced through it, guarded by g_tracing_mutex
+	std::uint32_t traced = 0;
+};
+static std::mutex g_shared_dispatchers_mutex;
+// Never freed, threads may still be running through them when the library is unloaded
+static std::unordered_map<std::uint64_t, SharedDispatcher*> g_shared_dispatchers;
+#endif
+
+// Detour code assembled once per code key, copied and rebased on every new capsule
+struct DetourTemplate {
+	// rel32 displacements wherever the first capsule allowed them
+	DetourCapsule::AsmJit reachable;
+	// Absolute addressing only, valid anywhere
+	DetourCapsule::AsmJit absolute;
+};
+static std::shared_mutex g_templates_mutex;
+// Never freed, capsules can be constructed until the library is unloaded
+static std::unordered_map<std::uint64_t, DetourTemplate*> g_templates;
+
+// Emits code with rel32 displacements first, then again with absolute addressing if no memory close enough was found
+template<typename EMIT>
+static std::uintptr_t Emit(DetourCapsule::AsmJit& jit, EMIT emit) {
+	if (!Asm::Allocator.IsNearFull()) {
+		emit();
+		if (jit.finalize() != nullptr) {
+			return reinterpret_cast<std::uintptr_t>(jit.GetData());
+		}
+		jit.clear();
+	}
+	jit.SetNear(false);
+	emit();
+	jit.finalize();
+	return reinterpret_cast<std::uintptr_t>(jit.GetData());
+}
+
+// Vectors never give their storage back, warm threads push and pop without allocating
+static thread_local ThreadStateStack<AsmLoopDetails*> g_saved_params;
 static thread_local bool g_is_in_recall = false;
 static thread_local AsmLoopDetails g_last_loop;
 
+// Records the arguments of a call from where the detour saved them, rsp_stack points to the return address
+static void TraceEntry(DetourCapsule* capsule, std::uintptr_t rsp_stack, std::uintptr_t rsp_regs) {
+	auto record = g_trace.Begin();
+	if (record == nullptr) {
+		return;
+	}
+	std::memset(record, 0, sizeof(*record));
+	record->timestamp = CapsuleStats::EntryTimestamp();
+	record->function = capsule->_function;
+	record->return_address = *reinterpret_cast<std::uintptr_t*>(rsp_stack);
+	record->event = Trace::Event::Entry;
+	record->hook = INVALID_HOOK;
+#ifdef KHOOK_X64
+	static_assert(reg_count <= Trace::INT_REGS && float_reg_count <= Trace::FLOAT_REGS);
+	for (std::size_t i = 0; i < float_reg_count; i++) {
+		record->float_regs[i] = *reinterpret_cast<std::uint64_t*>(rsp_regs + 16 * i);
+	}
+	for (std::size_t i = 0; i < reg_count; i++) {
+		record->int_regs[i] = *reinterpret_cast<std::uint64_t*>(rsp_regs + 16 * float_reg_count + 8 * i);
+	}
+#else
+	static_assert(reg_count <= Trace::INT_REGS);
+	for (std::size_t i = 0; i < reg_count; i++) {
+		record->int_regs[i] = *reinterpret_cast<std::uint32_t*>(rsp_regs + 4 * i);
+	}
+#endif
+	auto stack = reinterpret_cast<std::uintptr_t*>(rsp_stack + sizeof(void*));
+	for (std::size_t i = 0; i < Trace::STACK_WORDS; i++) {
+		record->stack[i] = stack[i];
+	}
+	g_trace.Commit();
+}
+
+static void TraceExit(AsmLoopDetails* loop) {
+	auto record = g_trace.Begin();
+	if (record == nullptr) {
+		return;
+	}
+	std::memset(record, 0, sizeof(*record));
+	record->timestamp = CapsuleStats::ExitTimestamp();
+	record->function = loop->capsule->_function;
+	record->event = Trace::Event::Exit;
+	record->hook = static_cast<std::uint32_t>(loop->action_hook);
+	record->action = static_cast<std::uint32_t>(loop->action);
+	g_trace.Commit();
+}
+
+// Called by the enabled probe sites, return_address is right after the site
+static FUNCTION_ATTRIBUTE_PREFIX(void) ProbeHit(AsmLoopDetails* loop, std::uintptr_t return_address) FUNCTION_ATTRIBUTE_SUFFIX {
+	auto capsule = loop->capsule;
+	// Shared code calls us for every capsule running it
+	if (!capsule->_tracing.load(std::memory_order_relaxed)) {
+		return;
+	}
+	auto callback = g_tracepoint_callback.load(std::memory_order_acquire);
+	if (callback == nullptr) {
+		return;
+	}
+#ifdef KHOOK_X64
+	auto& code = (capsule->_dispatcher) ? capsule->_dispatcher->jit : capsule->_jit;
+#else
+	auto& code = capsule->_jit;
+#endif
+	int kind = code.probe_kind(return_address);
+	if (kind != -1) {
+		callback(static_cast<TracePoint>(kind), reinterpret_cast<void*>(capsule->_function), g_tracepoint_user.load(std::memory_order_relaxed));
+	}
+}
+
 static FUNCTION_ATTRIBUTE_PREFIX(void) EndDetour(AsmLoopDetails* loop, bool no_callback) FUNCTION_ATTRIBUTE_SUFFIX {
+	AUDIT_SCOPE(loop->capsule);
 	if (g_saved_params.top() != loop || g_is_in_recall) {
 		// Something went horribly wrong with the stack
 		std::abort();
 	}
+
+	if (loop->recall_count == 0 && g_trace.Enabled()) {
+		TraceExit(loop);
+	}
 	
 	if (no_callback) {
 		if (loop->recall_count != 0) {
@@ -159,14 +331,14 @@ static FUNCTION_ATTRIBUTE_PREFIX(void) EndDetour(AsmLoopDetails* loop, bool no_c
 			// Terminate the program right now
 			std::abort();
 		}
-		RecursiveLockUnlockShared(&loop->capsule->_detour_mutex, false);
-		// Detour was early ended, unlock the mutex and pop the asm details
+		g_epochs.Leave();
+		// Detour was early ended, leave the epoch and pop the asm details
 		g_saved_params.pop();
 	} else {
 		// Natural end of a detour, setup everything because AsmLoopDetails is about to go invalid (due to stack being freed)
 		g_last_loop = *loop;
 		if (loop->recall_count != 0) {
-			RecursiveLockUnlockShared(&loop->capsule->_detour_mutex, false);
+			g_epochs.Leave();
 		}
 	}
 }
@@ -183,7 +355,8 @@ static FUNCTION_ATTRIBUTE_PREFIX(AsmLoopDetails*) BeginDetour(
 #else
 	static constexpr auto regs_size = reg_count * 4;
 #endif
-	RecursiveLockUnlockShared(&capsule->_detour_mutex, true);
+	AUDIT_SCOPE(capsule);
+	g_epochs.Enter(capsule);
 
 	if (g_is_in_recall) {
 		// If we're in recall, update where we currently are
@@ -239,16 +412,26 @@ static FUNCTION_ATTRIBUTE_PREFIX(AsmLoopDetails*) BeginDetour(
 		new_loop->recall_count = 0;
 
 		new_loop->action = (std::uint32_t)KHook::Action::Ignore;
+		new_loop->action_hook = INVALID_HOOK;
+#ifdef KHOOK_AUDIT
+		capsule->_audit.calls.fetch_add(1, std::memory_order_relaxed);
+#endif
 
-		auto start = capsule->_start_callbacks;
+		// Ordered after entering the epoch
+		auto callbacks = capsule->_published.load(std::memory_order_seq_cst);
+		auto start = (callbacks) ? callbacks->start : nullptr;
+		new_loop->start_callbacks = reinterpret_cast<std::uintptr_t>(start);
+		new_loop->end_callbacks = reinterpret_cast<std::uintptr_t>((callbacks) ? callbacks->end : nullptr);
 		if (start) {
 			// First Hook can just handle all the returns and call original
 			new_loop->fn_make_return = start->fn_make_return;
 			new_loop->fn_make_call_original = start->fn_make_call_original;
 			new_loop->original_return_ptr = 0;
 			new_loop->original_delete_operator = 0;
+			new_loop->original_return_size = 0;
 			new_loop->override_return_ptr = 0;
 			new_loop->override_delete_operator = 0;
+			new_loop->override_return_size = 0;
 			new_loop->fn_original_function_ptr = capsule->_original_function;
 		} else {
 			// This is unnecessary, but as safeguard for the future it's better to set these to true
@@ -262,13 +445,43 @@ static FUNCTION_ATTRIBUTE_PREFIX(AsmLoopDetails*) BeginDetour(
 		new_loop->sp_saved_stack = (rsp_stack + sizeof(void*));
 		new_loop->capsule = capsule;
 
+		if (g_trace.Enabled()) {
+			TraceEntry(capsule, rsp_stack, rsp_regs);
+		}
+
 		g_saved_params.push(new_loop);
 		return new_loop;
 	}
 }
 
-static thread_local std::stack<void*> g_current_hook;
+// Instrumented detours call these instead, only the outermost call of a recall chain is timed.
+// Calls that aren't sampled leave entry_timestamp to 0, the other helpers then don't time them either
+static FUNCTION_ATTRIBUTE_PREFIX(AsmLoopDetails*) BeginDetourStats(
+	AsmLoopDetails* new_loop,
+	std::uintptr_t rsp_stack,
+	std::uintptr_t rsp_regs,
+	std::uintptr_t rsp_fake_stack,
+	std::uint32_t stack_size,
+	DetourCapsule* capsule) FUNCTION_ATTRIBUTE_SUFFIX {
+	AUDIT_SCOPE(capsule);
+	auto loop = BeginDetour(new_loop, rsp_stack, rsp_regs, rsp_fake_stack, stack_size, capsule);
+	if (loop->recall_count == 0) {
+		loop->entry_timestamp = capsule->_stats->Sample() ? CapsuleStats::EntryTimestamp() : 0;
+	}
+	return loop;
+}
+
+static FUNCTION_ATTRIBUTE_PREFIX(void) EndDetourStats(AsmLoopDetails* loop, bool no_callback) FUNCTION_ATTRIBUTE_SUFFIX {
+	AUDIT_SCOPE(loop->capsule);
+	if (loop->recall_count == 0 && loop->entry_timestamp != 0) {
+		loop->capsule->_stats->Record(CapsuleStats::ExitTimestamp() - loop->entry_timestamp, static_cast<KHook::Action>(loop->action));
+	}
+	EndDetour(loop, no_callback);
+}
+
+static thread_local ThreadStateStack<void*> g_current_hook;
 static FUNCTION_ATTRIBUTE_PREFIX(void) PushPopCurrentHook(void* current_hook, bool push) FUNCTION_ATTRIBUTE_SUFFIX {
+	AUDIT_SCOPE(g_saved_params.top()->capsule);
 	if (push) {
 		g_current_hook.push(current_hook);
 	} else {
@@ -276,9 +489,52 @@ static FUNCTION_ATTRIBUTE_PREFIX(void) PushPopCurrentHook(void* current_hook, bo
 	}
 }
 
-static thread_local std::stack<std::uintptr_t> rsp_values;
+// Callbacks and original calls being timed, innermost last
+struct PhaseTiming {
+	PhaseStats* stats;
+	std::uint64_t start;
+	std::uint32_t weight;
+};
+static thread_local std::vector<PhaseTiming, ThreadStateAllocator<PhaseTiming>> g_phase_timings;
+
+// Instrumented detours call this instead, the loop's current hook is the one being called
+static FUNCTION_ATTRIBUTE_PREFIX(void) PushPopCurrentHookStats(void* current_hook, bool push) FUNCTION_ATTRIBUTE_SUFFIX {
+	auto loop = g_saved_params.top();
+	AUDIT_SCOPE(loop->capsule);
+	if (loop->entry_timestamp == 0) {
+		PushPopCurrentHook(current_hook, push);
+	} else if (push) {
+		auto hook = reinterpret_cast<DetourCapsule::LinkedList*>(loop->linked_list_it);
+		auto stats = (loop->pre_loop_over) ? hook->post_stats.get() : hook->pre_stats.get();
+		PushPopCurrentHook(current_hook, true);
+		g_phase_timings.push_back({ stats, CapsuleStats::EntryTimestamp(), loop->capsule->_stats->SampleRate() });
+	} else {
+		auto timing = g_phase_timings.back();
+		g_phase_timings.pop_back();
+		timing.stats->Record(CapsuleStats::ExitTimestamp() - timing.start, timing.weight);
+		PushPopCurrentHook(current_hook, false);
+	}
+}
+
+static FUNCTION_ATTRIBUTE_PREFIX(void) TimeOriginalCall(bool begin) FUNCTION_ATTRIBUTE_SUFFIX {
+	auto loop = g_saved_params.top();
+	AUDIT_SCOPE(loop->capsule);
+	if (loop->entry_timestamp == 0) {
+		return;
+	}
+	if (begin) {
+		g_phase_timings.push_back({ &loop->capsule->_stats->original, CapsuleStats::EntryTimestamp(), loop->capsule->_stats->SampleRate() });
+	} else {
+		auto timing = g_phase_timings.back();
+		g_phase_timings.pop_back();
+		timing.stats->Record(CapsuleStats::ExitTimestamp() - timing.start, timing.weight);
+	}
+}
+
+static thread_local ThreadStateStack<std::uintptr_t> rsp_values;
 static FUNCTION_ATTRIBUTE_PREFIX(void) PushRsp(std::uintptr_t rsp) FUNCTION_ATTRIBUTE_SUFFIX {
 	//std::cout << "Saving RSP: 0x" << std::hex << rsp << std::endl;
+	AUDIT_SCOPE(g_saved_params.top()->capsule);
 	rsp_values.push(rsp);
 }
 
@@ -289,6 +545,7 @@ static FUNCTION_ATTRIBUTE_PREFIX(std::uintptr_t) PeekRsp(std::uintptr_t rsp) FUN
 }
 
 static FUNCTION_ATTRIBUTE_PREFIX(void) PopRsp() FUNCTION_ATTRIBUTE_SUFFIX {
+	AUDIT_SCOPE(g_saved_params.top()->capsule);
 	rsp_values.pop();
 }
 
@@ -333,8 +590,49 @@ KHOOK_API void* GetContext() {
 using init_copy_return = void (*)(void* assignee, void* value);
 using delete_return = void (*)(void* assignee);
 
+// Return values are copied into blocks recycled by each thread, warm detours never reach the allocator for them
+class ReturnValuePool {
+public:
+	static constexpr std::size_t BLOCK_SIZE = 64;
+
+	~ReturnValuePool() {
+		for (auto block : _free) {
+			_blocks.deallocate(block, 1);
+		}
+	}
+
+	void* Allocate(std::size_t size) {
+		if (size > BLOCK_SIZE) {
+			return ::operator new(size);
+		}
+		if (_free.empty()) {
+			return _blocks.allocate(1);
+		}
+		auto block = _free.back();
+		_free.pop_back();
+		return block;
+	}
+
+	void Release(void* block, std::size_t size) {
+		if (size > BLOCK_SIZE) {
+			::operator delete(block);
+		} else {
+			_free.push_back(static_cast<Block*>(block));
+		}
+	}
+
+private:
+	struct Block {
+		alignas(std::max_align_t) std::uint8_t data[BLOCK_SIZE];
+	};
+	ThreadStateAllocator<Block> _blocks;
+	std::vector<Block*, ThreadStateAllocator<Block*>> _free;
+};
+static thread_local ReturnValuePool g_return_values;
+
 KHOOK_API void SaveReturnValue(KHook::Action action, void* ptr_to_return, std::size_t return_size, void* init_op, void* delete_op, bool original) {
 	auto loop = g_saved_params.top();
+	AUDIT_SCOPE(loop->capsule);
 	if (original) {
 		// Save original value
 		if (loop->original_return_ptr != 0) {
@@ -342,9 +640,10 @@ KHOOK_API void SaveReturnValue(KHook::Action action, void* ptr_to_return, std::s
 			std::abort();
 		}
 		if (return_size != 0) {
-			auto new_return = new std::uint8_t[return_size];
+			auto new_return = g_return_values.Allocate(return_size);
 			loop->original_return_ptr = reinterpret_cast<std::uintptr_t>(new_return);
 			loop->original_delete_operator = reinterpret_cast<std::uintptr_t>(delete_op);
+			loop->original_return_size = return_size;
 
 			init_copy_return fn = reinterpret_cast<init_copy_return>(init_op);
 			(*fn)(new_return, ptr_to_return);
@@ -352,13 +651,15 @@ KHOOK_API void SaveReturnValue(KHook::Action action, void* ptr_to_return, std::s
 	}
 	if (action > (KHook::Action)loop->action) {
 		loop->action = (std::uintptr_t)action;
+		auto hook = reinterpret_cast<DetourCapsule::LinkedList*>(loop->linked_list_it);
+		loop->action_hook = (hook) ? hook->id : INVALID_HOOK;
 		// Looks like we already saved a return value before this
 		if (loop->override_return_ptr != 0) {
 			// De-init the memory
 			delete_return fn = reinterpret_cast<delete_return>(loop->override_delete_operator);
 			(*fn)(reinterpret_cast<void*>(loop->override_return_ptr));
 			// Free it
-			delete[] reinterpret_cast<std::uint8_t*>(loop->override_return_ptr);
+			g_return_values.Release(reinterpret_cast<void*>(loop->override_return_ptr), loop->override_return_size);
 
 			if (return_size != 0) {
 				// What are you doing ?????
@@ -366,9 +667,10 @@ KHOOK_API void SaveReturnValue(KHook::Action action, void* ptr_to_return, std::s
 			}
 		}
 		if (return_size != 0) {
-			auto new_return = new std::uint8_t[return_size];
+			auto new_return = g_return_values.Allocate(return_size);
 			loop->override_return_ptr = reinterpret_cast<std::uintptr_t>(new_return);
 			loop->override_delete_operator = reinterpret_cast<std::uintptr_t>(delete_op);
+			loop->override_return_size = return_size;
 
 			init_copy_return fn = reinterpret_cast<init_copy_return>(init_op);
 			(*fn)(new_return, ptr_to_return);
@@ -377,6 +679,7 @@ KHOOK_API void SaveReturnValue(KHook::Action action, void* ptr_to_return, std::s
 }
 
 KHOOK_API void DestroyReturnValue() {
+	AUDIT_SCOPE(g_last_loop.capsule);
 	if (g_last_loop.recall_count != 0) {
 		g_saved_params.top()->recall_count--;
 	} else {
@@ -389,7 +692,7 @@ KHOOK_API void DestroyReturnValue() {
 			delete_return fn = reinterpret_cast<delete_return>(g_last_loop.override_delete_operator);
 			(*fn)(reinterpret_cast<void*>(g_last_loop.override_return_ptr));
 			// Free it
-			delete[] reinterpret_cast<std::uint8_t*>(g_last_loop.override_return_ptr);
+			g_return_values.Release(reinterpret_cast<void*>(g_last_loop.override_return_ptr), g_last_loop.override_return_size);
 		}
 
 		if (g_last_loop.original_return_ptr != 0) {
@@ -397,13 +700,14 @@ KHOOK_API void DestroyReturnValue() {
 			delete_return fn = reinterpret_cast<delete_return>(g_last_loop.original_delete_operator);
 			(*fn)(reinterpret_cast<void*>(g_last_loop.original_return_ptr));
 			// Free it
-			delete[] reinterpret_cast<std::uint8_t*>(g_last_loop.original_return_ptr);
+			g_return_values.Release(reinterpret_cast<void*>(g_last_loop.original_return_ptr), g_last_loop.original_return_size);
 		}
 	}
-	RecursiveLockUnlockShared(&g_last_loop.capsule->_detour_mutex, false);
+	g_epochs.Leave();
 }
 
 KHOOK_API void* DoRecall(KHook::Action action, void* ptr_to_return, std::size_t return_size, void* init_op, void* delete_op) {
+	AUDIT_SCOPE(g_saved_params.top()->capsule);
 	g_is_in_recall = true;
 	SaveReturnValue(action, ptr_to_return, return_size, init_op, delete_op, false);
 	return reinterpret_cast<void*>(g_saved_params.top()->capsule->_jit_func_ptr);
@@ -470,8 +774,7 @@ void copy_stack(DetourCapsule::AsmJit& jit, std::int32_t offset, std::int32_t st
 	WIN_ONLY(jit.mov(r8, stack_size));
 
 	WIN_ONLY(jit.sub(rsp, 32));
-	jit.mov(rax, reinterpret_cast<std::uintptr_t>(memcpy));
-	jit.call(rax);
+	jit.call(reinterpret_cast<std::uintptr_t>(memcpy));
 	WIN_ONLY(jit.add(rsp, 32));
 
 	LINUX_ONLY(jit.pop(rdx)); WIN_ONLY(jit.pop(r8));
@@ -496,11 +799,102 @@ void copy_stack(DetourCapsule::AsmJit& jit, std::int32_t offset, std::int32_t st
 
 DetourCapsule::DetourCapsule() :
 	_in_deletion(false),
+	_published(nullptr),
 	_start_callbacks(nullptr),
 	_end_callbacks(nullptr),
 	_jit_func_ptr(0),
 	_original_function(0),
-	_stack_size(STACK_SAFETY_BUFFER) {
+	_function(0),
+	_stack_size(STACK_SAFETY_BUFFER),
+	_stats(g_stats_enabled ? std::make_unique<CapsuleStats>() : nullptr),
+	_tracing(false)
+#ifdef KHOOK_X64
+	, _dispatcher(nullptr)
+#endif
+	{
+	if (_stats) {
+		_stats->SetSampleRate(g_default_sample_rate);
+	}
+#ifdef KHOOK_X64
+	if (g_dispatch_mode == DispatchMode::Shared) {
+		_dispatcher = GetSharedDispatcher();
+		if (_dispatcher != nullptr) {
+			// Entry thunk, hands over our pointer in r11 which no calling convention uses for parameters
+			std::uintptr_t dispatcher = _dispatcher->code;
+			_jit_func_ptr = Emit(_jit, [this, dispatcher]() {
+				_jit.mov(r11, static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(this)));
+				_jit.jump_abs(dispatcher);
+			});
+			// The thunk leaves the stack as it found it
+			if (g_unwind_enabled && _jit_func_ptr != 0) {
+				_unwind.Register(_jit.GetData(), _jit.GetSize(), {});
+			}
+			return;
+		}
+	}
+#endif
+	auto base = reinterpret_cast<std::uintptr_t>(this);
+	if (Asm::Allocator.IsNearFull() || !_jit.instantiate(GetTemplate(true), base) || _jit.finalize() == nullptr) {
+		_jit.instantiate(GetTemplate(false), base);
+		_jit.finalize();
+	}
+	_jit_func_ptr = reinterpret_cast<std::uintptr_t>(_jit.GetData());
+	if (g_unwind_enabled && _jit_func_ptr != 0) {
+		_unwind.Register(_jit.GetData(), _jit.GetSize(), _jit.TakeUnwindRows());
+	}
+}
+
+const DetourCapsule::AsmJit& DetourCapsule::GetTemplate(bool reachable) {
+	{
+		std::shared_lock lock(g_templates_mutex);
+		auto it = g_templates.find(CodeKey());
+		if (it != g_templates.end()) {
+			return reachable ? it->second->reachable : it->second->absolute;
+		}
+	}
+	std::lock_guard guard(g_templates_mutex);
+	auto& tmpl = g_templates[CodeKey()];
+	if (tmpl == nullptr) {
+		// Assembled against us, every value pointing within the capsule is recorded as relative to it
+		auto created = new DetourTemplate;
+		auto base = reinterpret_cast<std::uintptr_t>(this);
+		created->reachable.SetPatchBase(base, sizeof(DetourCapsule));
+		Assemble(created->reachable, false, reinterpret_cast<std::uintptr_t>(&_jit_func_ptr));
+		created->absolute.SetPatchBase(base, sizeof(DetourCapsule));
+		created->absolute.SetNear(false);
+		Assemble(created->absolute, false, reinterpret_cast<std::uintptr_t>(&_jit_func_ptr));
+		tmpl = created;
+	}
+	return reachable ? tmpl->reachable : tmpl->absolute;
+}
+
+#ifdef KHOOK_X64
+SharedDispatcher* DetourCapsule::GetSharedDispatcher() {
+	std::lock_guard guard(g_shared_dispatchers_mutex);
+	auto& dispatcher = g_shared_dispatchers[CodeKey()];
+	if (dispatcher == nullptr) {
+		// Only our field offsets are used, the code is valid for every capsule of the same code key
+		auto created = new SharedDispatcher;
+		created->code = Emit(created->jit, [this, created]() {
+			Assemble(created->jit, true, reinterpret_cast<std::uintptr_t>(&created->code));
+		});
+		if (created->code == 0) {
+			delete created;
+			g_shared_dispatchers.erase(CodeKey());
+			return nullptr;
+		}
+		g_perf.Register(created->jit.GetData(), created->jit.GetSize(),
+			(_stats) ? "khook_dispatcher_stats" : "khook_dispatcher");
+		dispatcher = created;
+	}
+	if (g_unwind_enabled && !dispatcher->unwind.Registered()) {
+		dispatcher->unwind.Register(dispatcher->jit.GetData(), dispatcher->jit.GetSize(), dispatcher->jit.TakeUnwindRows());
+	}
+	return dispatcher;
+}
+#endif
+
+void DetourCapsule::Assemble(AsmJit& jit, bool shared, std::uintptr_t code_slot) {
 	// Because we want to be call agnostic we must get clever
 	// No register can be used to call a function, so here's the plan
 	// mov rax, 0xStart Address of JIT function
@@ -511,6 +905,16 @@ DetourCapsule::DetourCapsule() :
 	// retn
 	// next instructions
 	// !! Rewrite <offset calculated later>
+	jit.reserve(JIT_SIZE_ESTIMATE);
+	// Instrumented code calls timing variants of the helpers, and times the original call
+	const bool instrumented = _stats != nullptr;
+	static auto probe = [](DetourCapsule::AsmJit& jit, TracePoint point) {
+		jit.probe(static_cast<std::uint8_t>(point));
+	};
+	// Unwind rows, the caller's frame pointer is always saved right below the return address
+	static constexpr auto unwind_sp = UnwindInfo::STACK_POINTER;
+	static constexpr auto unwind_fp = UnwindInfo::FRAME_POINTER;
+	static constexpr std::int32_t saved_fp = -2 * static_cast<std::int32_t>(sizeof(void*));
 #ifdef KHOOK_X64
 	using namespace Asm;
 
@@ -524,8 +928,7 @@ DetourCapsule::DetourCapsule() :
 		LINUX_ONLY(jit.mov(rsi, reinterpret_cast<std::uintptr_t>(name)));
 		WIN_ONLY(jit.mov(rdx, reinterpret_cast<std::uintptr_t>(name)));
 
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(PrintRegister));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(PrintRegister));
 
 		WIN_ONLY(jit.add(rsp, 32));
 #endif
@@ -545,8 +948,7 @@ DetourCapsule::DetourCapsule() :
 		LINUX_ONLY(jit.lea(rdi, rsp(6 * 8 + offset)));
 		WIN_ONLY(jit.lea(rcx, rsp(32 + 6 * 8 + offset)));
 
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(PrintRSP));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(PrintRSP));
 
 		jit.pop(r9);
 		jit.pop(r8);
@@ -559,7 +961,7 @@ DetourCapsule::DetourCapsule() :
 #endif
 	};
 
-	static auto begin_detour = [](DetourCapsule::AsmJit& jit, std::uint32_t offset_to_loop_params, std::uint32_t offset_to_regs, std::uint32_t offset_to_stack, std::int32_t stack_size, DetourCapsule* capsule) {
+	static auto begin_detour = [](DetourCapsule::AsmJit& jit, std::uint32_t offset_to_loop_params, std::uint32_t offset_to_regs, std::uint32_t offset_to_stack, std::int32_t stack_size, DetourCapsule* capsule, bool instrumented) {
 		WIN_ONLY(static constexpr size_t shadowspace = 48);
 		WIN_ONLY(jit.sub(rsp, 48));
 		// 1st param - Loop variable
@@ -577,17 +979,21 @@ DetourCapsule::DetourCapsule() :
 		// 5th param - Stack size
 		LINUX_ONLY(jit.mov(r8, stack_size));
 		WIN_ONLY(jit.mov(rsp(0x20), stack_size));
-		// 6th param - Detour Capsule
-		LINUX_ONLY(jit.mov(r9, reinterpret_cast<std::uintptr_t>(capsule)));
-		WIN_ONLY(jit.mov(rax, reinterpret_cast<std::uintptr_t>(capsule)));
-		WIN_ONLY(jit.mov(rsp(0x28), rax));
+		// 6th param - Detour Capsule, left in r11 by the entry thunk if the code is shared
+		if (capsule) {
+			LINUX_ONLY(jit.mov(r9, reinterpret_cast<std::uintptr_t>(capsule)));
+			WIN_ONLY(jit.mov(rax, reinterpret_cast<std::uintptr_t>(capsule)));
+			WIN_ONLY(jit.mov(rsp(0x28), rax));
+		} else {
+			LINUX_ONLY(jit.mov(r9, r11));
+			WIN_ONLY(jit.mov(rsp(0x28), r11));
+		}
 
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(BeginDetour));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(instrumented ? BeginDetourStats : BeginDetour));
 		WIN_ONLY(jit.add(rsp, shadowspace));
 	};
 
-	static auto end_detour = [](DetourCapsule::AsmJit& jit, x86_64_Reg loop, bool no_callbacks) {
+	static auto end_detour = [](DetourCapsule::AsmJit& jit, x86_64_Reg loop, bool no_callbacks, bool instrumented) {
 		// 1st param - Loop variable
 		LINUX_ONLY(jit.mov(rdi, loop));
 		WIN_ONLY(jit.mov(rcx, loop));
@@ -596,12 +1002,11 @@ DetourCapsule::DetourCapsule() :
 		WIN_ONLY(jit.mov(rdx, no_callbacks));
 
 		WIN_ONLY(jit.sub(rsp, 32));
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(EndDetour));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(instrumented ? EndDetourStats : EndDetour));
 		WIN_ONLY(jit.add(rsp, 32));
 	};
 
-	static auto push_current_hook = [](DetourCapsule::AsmJit& jit, x86_64_RegRm reg) {
+	static auto push_current_hook = [](DetourCapsule::AsmJit& jit, x86_64_RegRm reg, bool instrumented) {
 		// 1st param - Original return ptr
 		LINUX_ONLY(jit.mov(rdi, reg));
 		WIN_ONLY(jit.mov(rcx, reg));
@@ -610,19 +1015,27 @@ DetourCapsule::DetourCapsule() :
 		WIN_ONLY(jit.mov(rdx, true));
 
 		WIN_ONLY(jit.sub(rsp, 32));
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(PushPopCurrentHook));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(instrumented ? PushPopCurrentHookStats : PushPopCurrentHook));
 		WIN_ONLY(jit.add(rsp, 32));
 	};
 
-	static auto pop_current_hook = [](DetourCapsule::AsmJit& jit) {
+	static auto pop_current_hook = [](DetourCapsule::AsmJit& jit, bool instrumented) {
 		// 2nd param - Store
 		LINUX_ONLY(jit.mov(rsi, false));
 		WIN_ONLY(jit.mov(rdx, false));
 
 		WIN_ONLY(jit.sub(rsp, 32));
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(PushPopCurrentHook));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(instrumented ? PushPopCurrentHookStats : PushPopCurrentHook));
+		WIN_ONLY(jit.add(rsp, 32));
+	};
+
+	static auto time_original_call = [](DetourCapsule::AsmJit& jit, bool begin) {
+		// 1st param - Begin
+		LINUX_ONLY(jit.mov(rdi, begin));
+		WIN_ONLY(jit.mov(rcx, begin));
+
+		WIN_ONLY(jit.sub(rsp, 32));
+		jit.call(reinterpret_cast<std::uintptr_t>(TimeOriginalCall));
 		WIN_ONLY(jit.add(rsp, 32));
 	};
 
@@ -632,8 +1045,7 @@ DetourCapsule::DetourCapsule() :
 		WIN_ONLY(jit.mov(rcx, rsp));
 
 		WIN_ONLY(jit.sub(rsp, 32));
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(PushRsp));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(PushRsp));
 		WIN_ONLY(jit.add(rsp, 32));
 	};
 
@@ -649,16 +1061,14 @@ DetourCapsule::DetourCapsule() :
 		// 1st param - Rsp
 		LINUX_ONLY(jit.lea(rdi, rsp(stackSpace)));
 		WIN_ONLY(jit.lea(rcx, rsp(stackSpace)));
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(PeekRsp));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(PeekRsp));
 
 		jit.mov(rsp, rax);
 	};
 
 	static auto peek_rbp = [](DetourCapsule::AsmJit& jit) {
 		WIN_ONLY(jit.sub(rsp, 32));
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(PeekRbp));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(PeekRbp));
 		WIN_ONLY(jit.add(rsp, 32));
 
 		jit.mov(rbp, rax);
@@ -666,31 +1076,49 @@ DetourCapsule::DetourCapsule() :
 
 	static auto pop_rsp = [](DetourCapsule::AsmJit& jit) {
 		WIN_ONLY(jit.sub(rsp, 32));
-		jit.mov(rax, reinterpret_cast<std::uintptr_t>(PopRsp));
-		jit.call(rax);
+		jit.call(reinterpret_cast<std::uintptr_t>(PopRsp));
 		WIN_ONLY(jit.add(rsp, 32));
 	};
 
+	// Loads one of our fields into rax, shared code goes through the capsule BeginDetour stored (rbp must be the loop details)
+	auto load_field = [this, shared](DetourCapsule::AsmJit& jit, const void* field) {
+		if (shared) {
+			jit.mov(rax, rbp(offsetof(AsmLoopDetails, capsule)));
+			jit.mov(rax, rax(static_cast<std::int32_t>(reinterpret_cast<std::uintptr_t>(field) - reinterpret_cast<std::uintptr_t>(this))));
+		} else {
+			jit.load(rax, reinterpret_cast<std::uintptr_t>(field));
+		}
+	};
+
 	// Push rbp we're going to be using it and align the stack at the same time
-	_jit.push(rbp);
-	//print_rsp(_jit);
+	jit.push(rbp);
+	// Until the loop details are known, the caller's frame is found from rsp
+	std::int32_t entry_cfa = sizeof(void*) * 2;
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
+	//print_rsp(jit);
 
 	// Variable to store various data, should be 16 bytes aligned
-	_jit.sub(rsp, local_params_size);
+	jit.sub(rsp, local_params_size);
+	entry_cfa += local_params_size;
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
 
 	// Save general purpose registers
-	_jit.sub(rsp, sizeof(void*) * reg_count);
+	jit.sub(rsp, sizeof(void*) * reg_count);
+	entry_cfa += sizeof(void*) * reg_count;
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
 	for (int i = 0; i < reg_count; i++) {
-		_jit.mov(rsp(sizeof(void*) * i), reg[i]);
+		jit.mov(rsp(sizeof(void*) * i), reg[i]);
 	}
 	static_assert((sizeof(void*) * reg_count) % 16 == 0);
 	// Save floating point registers
-	_jit.sub(rsp, 16 * float_reg_count);
+	jit.sub(rsp, 16 * float_reg_count);
+	entry_cfa += 16 * float_reg_count;
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
 	for (int i = 0; i < float_reg_count; i++) {
-		_jit.movsd(rsp(16 * i), float_reg[i]);
+		jit.movsd(rsp(16 * i), float_reg[i]);
 	}
 
-	//print_rsp(_jit, 16 * float_reg_count + local_params_size + (sizeof(void*) * reg_count) + 8);
+	//print_rsp(jit, 16 * float_reg_count + local_params_size + (sizeof(void*) * reg_count) + 8);
 	
 	// Bytes offset to get back at where we saved our data
 	static constexpr auto reg_start = 0;
@@ -708,8 +1136,11 @@ DetourCapsule::DetourCapsule() :
 
 	static constexpr auto stack_local_data_start = 16 * float_reg_count + 8 * reg_count + reg_start;
 	static constexpr auto func_param_stack_start = stack_local_data_start + local_params_size + 8 /* push rbp */;
+	// Where the caller's frame is when rbp holds the loop details, or the saved registers
+	static constexpr std::int32_t cfa_from_loop = func_param_stack_start - stack_local_data_start + sizeof(void*);
+	static constexpr std::int32_t cfa_from_regs = func_param_stack_start + sizeof(void*);
 
-	static auto perform_loop = [](DetourCapsule::AsmJit& jit, std::uintptr_t jit_func_ptr, std::int32_t func_param_stack_size, std::int32_t offset_fn_callback, std::int32_t offset_next_it, std::int32_t offset_loop_condition) {
+	static auto perform_loop = [](DetourCapsule::AsmJit& jit, std::uintptr_t jit_func_ptr, std::int32_t func_param_stack_size, std::int32_t offset_fn_callback, std::int32_t offset_next_it, std::int32_t offset_loop_condition, bool instrumented) {
 		auto entry_loop = (std::int32_t)jit.get_outputpos();
 		jit.mov(r8, rax(offset_fn_callback)); // offsetof(LinkedList, fn_callback)
 		jit.test(r8, r8);
@@ -718,23 +1149,24 @@ DetourCapsule::DetourCapsule() :
 			// MAKE PRE/POST CALL
 			jit.push(r8);
 			jit.push(r8);
-			push_current_hook(jit, rax(offsetof(LinkedList, hook_ptr)));
+			push_current_hook(jit, rax(offsetof(LinkedList, hook_ptr)), instrumented);
 			jit.pop(r8);
 			jit.pop(r8);
-			jit.mov(rax, jit_func_ptr);
-			jit.mov(rax, rax());
+			jit.load(rax, jit_func_ptr);
 			jit.add(rax, INT32_MAX);
 			auto make_pre_call_return = jit.get_outputpos();
 			jit.push(rax); // Setup return address, basically later in this function
 			jit.push(r8); // PRE/POST Callback address
 			copy_stack(jit, sizeof(void*) * 2, func_param_stack_size);
 			jit.mov(rbp, rbp(offsetof(AsmLoopDetails, sp_saved_registers)));
+			jit.unwind(unwind_fp, cfa_from_regs, saved_fp);
 			restore_regs(jit);
 			jit.retn();
 			jit.rewrite(make_pre_call_return - sizeof(std::uint32_t), jit.get_outputpos());
 			peek_rsp(jit);
-			pop_current_hook(jit);
+			pop_current_hook(jit, instrumented);
 			peek_rbp(jit);
+			jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
 			//print_register(jit, rbp, "PEEK-RBP");
 			// Test loop condition
 			jit.mov(rax, rbp(offset_loop_condition));
@@ -758,200 +1190,242 @@ DetourCapsule::DetourCapsule() :
 
 	// Allocate our fake stack	
 	std::int32_t func_param_stack_size = (_stack_size != 0) ? _stack_size : STACK_SAFETY_BUFFER;
-	_jit.sub(rsp, func_param_stack_size);
+	jit.sub(rsp, func_param_stack_size);
+	entry_cfa += func_param_stack_size;
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
 	// Registers have been saved, let's get the loop details
-	begin_detour(_jit, 
+	begin_detour(jit, 
 		func_param_stack_size + stack_local_data_start,
 		func_param_stack_size + reg_start,
 		func_param_stack_size + func_param_stack_start,
 		func_param_stack_size,
-		this
+		shared ? nullptr : this,
+		instrumented
 	);
-	_jit.mov(rbp, rax);
-	//_jit.mov(rax, rsp(func_param_stack_size + stack_local_data_start + local_params_size + sizeof(void*)));
-	//print_register(_jit, rax, "RETURN ADDR");
-	//print_register(_jit, rbp, "RBP");
+	jit.mov(rbp, rax);
+	jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
+	probe(jit, TracePoint::Entry);
+	//jit.mov(rax, rsp(func_param_stack_size + stack_local_data_start + local_params_size + sizeof(void*)));
+	//print_register(jit, rax, "RETURN ADDR");
+	//print_register(jit, rbp, "RBP");
 
 	// Early retrieve callbacks
-	_jit.mov(rax, reinterpret_cast<std::uintptr_t>(&_start_callbacks));
-	_jit.mov(rax, rax());
+	jit.mov(rax, rbp(offsetof(AsmLoopDetails, start_callbacks)));
 	
 	// If no callbacks, early return
-	_jit.test(rax, rax);
-	_jit.jnz(INT32_MAX);{auto jnz_pos = _jit.get_outputpos(); {
+	jit.test(rax, rax);
+	jit.jnz(INT32_MAX);{auto jnz_pos = jit.get_outputpos(); {
 		// End the detour
-		end_detour(_jit, rbp, true);
-		_jit.add(rsp, func_param_stack_size);
+		probe(jit, TracePoint::Exit);
+		end_detour(jit, rbp, true, instrumented);
+		jit.add(rsp, func_param_stack_size);
 
-		// Restore registers
-		_jit.mov(rbp, rbp(offsetof(AsmLoopDetails, sp_saved_registers)));
-		restore_regs(_jit);
+		// Retrieve the call address, restoring registers leaves rax untouched
+		load_field(jit, &_original_function);
 
-		// Retrieve the call address
-		_jit.mov(rax, reinterpret_cast<std::uintptr_t>(&_original_function));
-		_jit.mov(rax, rax());
+		// Restore registers
+		jit.mov(rbp, rbp(offsetof(AsmLoopDetails, sp_saved_registers)));
+		jit.unwind(unwind_fp, cfa_from_regs, saved_fp);
+		restore_regs(jit);
 
 		// Restore rbp now, and setup call address
-		_jit.push(rax);
-		_jit.mov(rbp, rsp(func_param_stack_start - sizeof(void*) + sizeof(void*) /* push rax */));
-		_jit.mov(rsp(func_param_stack_start - sizeof(void*) + sizeof(void*) /* push rax */), rax);
-		_jit.pop(rax);
+		jit.push(rax);
+		jit.mov(rbp, rsp(func_param_stack_start - sizeof(void*) + sizeof(void*) /* push rax */));
+		jit.unwind(unwind_sp, cfa_from_regs + sizeof(void*), 0);
+		jit.mov(rsp(func_param_stack_start - sizeof(void*) + sizeof(void*) /* push rax */), rax);
+		jit.pop(rax);
+		jit.unwind(unwind_sp, cfa_from_regs, 0);
 
-		_jit.add(rsp, func_param_stack_start - sizeof(void*));
-		_jit.retn();
+		jit.add(rsp, func_param_stack_start - sizeof(void*));
+		jit.unwind(unwind_sp, sizeof(void*) * 2, 0);
+		jit.retn();
 	}
 	// Write our jump offset
-	_jit.rewrite<std::int32_t>(jnz_pos - sizeof(std::int32_t), _jit.get_outputpos() - jnz_pos);}
+	jit.rewrite<std::int32_t>(jnz_pos - sizeof(std::int32_t), jit.get_outputpos() - jnz_pos);}
+	jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
 
 	// Check if this is a recall
-	//print_register(_jit, rbp, "INIT-RBP");
-	_jit.mov(rax, rbp(offsetof(AsmLoopDetails, recall_count)));
-	_jit.test(rax, rax);
+	//print_register(jit, rbp, "INIT-RBP");
+	jit.mov(rax, rbp(offsetof(AsmLoopDetails, recall_count)));
+	jit.test(rax, rax);
 	std::int32_t recall_jump = 0;
-	_jit.jz(INT32_MAX);{auto jz_pos = _jit.get_outputpos(); {
+	jit.jz(INT32_MAX);{auto jz_pos = jit.get_outputpos(); {
 		// This is a recall, so free our local variables and reg saves we don't need them
-		_jit.add(rsp, stack_local_data_start + local_params_size);
-		_jit.jump(INT32_MAX); recall_jump = _jit.get_outputpos();
+		jit.add(rsp, stack_local_data_start + local_params_size);
+		jit.jump(INT32_MAX); recall_jump = jit.get_outputpos();
 	}
 	// Write our jump offset
-	_jit.rewrite<std::int32_t>(jz_pos - sizeof(std::int32_t), _jit.get_outputpos() - jz_pos);}
-	_jit.rewrite<std::int32_t>(recall_jump - sizeof(std::int32_t), _jit.get_outputpos() - recall_jump);
+	jit.rewrite<std::int32_t>(jz_pos - sizeof(std::int32_t), jit.get_outputpos() - jz_pos);}
+	jit.rewrite<std::int32_t>(recall_jump - sizeof(std::int32_t), jit.get_outputpos() - recall_jump);
 
 	// Remember our whole stack
 	// We will restore it after each function call
-	push_rsp(_jit);
+	push_rsp(jit);
 
-	//print_register(_jit, rbp, "PRE-RBP");
+	//print_register(jit, rbp, "PRE-RBP");
 	// Prelude to PRE LOOP
 	// Hooks with a pre callback are enqueued at the start of linked list
 	// If this a recall, don't init anything just pickup where we left off
-	_jit.mov(rax, rbp(offsetof(AsmLoopDetails, pre_loop_started)));
-	_jit.test(rax, rax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(rax, reinterpret_cast<std::uintptr_t>(&_start_callbacks));
-		_jit.mov(rax, rax());
-		_jit.mov(rbp(offsetof(AsmLoopDetails, linked_list_it)), rax);
+	jit.mov(rax, rbp(offsetof(AsmLoopDetails, pre_loop_started)));
+	jit.test(rax, rax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(rax, rbp(offsetof(AsmLoopDetails, start_callbacks)));
+		jit.mov(rbp(offsetof(AsmLoopDetails, linked_list_it)), rax);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	_jit.mov(rbp(offsetof(AsmLoopDetails, pre_loop_started)), true);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	jit.mov(rbp(offsetof(AsmLoopDetails, pre_loop_started)), true);
 
 	// PRE LOOP
-	_jit.mov(rax, rbp(offsetof(AsmLoopDetails, pre_loop_over)));
-	_jit.test(rax, rax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(rax, rbp(offsetof(AsmLoopDetails, linked_list_it)));
-		perform_loop(_jit, reinterpret_cast<std::uintptr_t>(&_jit_func_ptr), func_param_stack_size, offsetof(LinkedList, fn_make_pre), offsetof(LinkedList, next), offsetof(AsmLoopDetails, pre_loop_over));
+	jit.mov(rax, rbp(offsetof(AsmLoopDetails, pre_loop_over)));
+	jit.test(rax, rax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(rax, rbp(offsetof(AsmLoopDetails, linked_list_it)));
+		perform_loop(jit, code_slot, func_param_stack_size, offsetof(LinkedList, fn_make_pre), offsetof(LinkedList, next), offsetof(AsmLoopDetails, pre_loop_over), instrumented);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	_jit.mov(rbp(offsetof(AsmLoopDetails, pre_loop_over)), true);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	jit.mov(rbp(offsetof(AsmLoopDetails, pre_loop_over)), true);
 
-	//print_register(_jit, rbp, "ORIGINAL-RBP");
+	//print_register(jit, rbp, "ORIGINAL-RBP");
 	// Call original (maybe)
 	// RBP which we have set much earlier still contains our local variables
 	// it should have been saved across all calls as per linux & win callconvs
-	_jit.mov(rax, rbp(offsetof(AsmLoopDetails, original_call_over)));
-	_jit.test(rax, rax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(rax, rbp(offsetof(AsmLoopDetails, action)));
-		_jit.cmp(rax, (std::int32_t)Action::Supersede);
-		_jit.je(INT32_MAX);
-		auto if_not_supersede = _jit.get_outputpos(); {
+	jit.mov(rax, rbp(offsetof(AsmLoopDetails, original_call_over)));
+	jit.test(rax, rax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(rax, rbp(offsetof(AsmLoopDetails, action)));
+		jit.cmp(rax, (std::int32_t)Action::Supersede);
+		jit.je(INT32_MAX);
+		auto if_not_supersede = jit.get_outputpos(); {
 			// MAKE ORIGINAL CALL
-			_jit.mov(rax, reinterpret_cast<std::uintptr_t>(&_jit_func_ptr));
-			_jit.mov(rax, rax());
-			_jit.add(rax, INT32_MAX);
-			auto make_pre_call_return = _jit.get_outputpos();
-			_jit.push(rax); // Setup return address, basically later in this function
-			_jit.mov(rax, rbp(offsetof(AsmLoopDetails, fn_make_call_original)));
-			_jit.push(rax); // Call original
-			//print_register(_jit, rax, "RAX");
+			probe(jit, TracePoint::BeforeOriginal);
+			if (instrumented) {
+				time_original_call(jit, true);
+			}
+			jit.load(rax, code_slot);
+			jit.add(rax, INT32_MAX);
+			auto make_pre_call_return = jit.get_outputpos();
+			jit.push(rax); // Setup return address, basically later in this function
+			jit.mov(rax, rbp(offsetof(AsmLoopDetails, fn_make_call_original)));
+			jit.push(rax); // Call original
+			//print_register(jit, rax, "RAX");
 			// RBP must be valid when copy stack is called
-			copy_stack(_jit, sizeof(void*) * 2, func_param_stack_size);
-			_jit.mov(rbp, rbp(offsetof(AsmLoopDetails, sp_saved_registers)));
-			restore_regs(_jit);
-			_jit.retn();
-			_jit.rewrite(make_pre_call_return - sizeof(std::uint32_t), _jit.get_outputpos());
-			peek_rsp(_jit);
-			peek_rbp(_jit);
+			copy_stack(jit, sizeof(void*) * 2, func_param_stack_size);
+			jit.mov(rbp, rbp(offsetof(AsmLoopDetails, sp_saved_registers)));
+			jit.unwind(unwind_fp, cfa_from_regs, saved_fp);
+			restore_regs(jit);
+			jit.retn();
+			jit.rewrite(make_pre_call_return - sizeof(std::uint32_t), jit.get_outputpos());
+			peek_rsp(jit);
+			peek_rbp(jit);
+			jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
+			if (instrumented) {
+				time_original_call(jit, false);
+			}
+			probe(jit, TracePoint::AfterOriginal);
 		}
-		_jit.rewrite<std::int32_t>(if_not_supersede - sizeof(std::int32_t), _jit.get_outputpos() - if_not_supersede);
+		jit.rewrite<std::int32_t>(if_not_supersede - sizeof(std::int32_t), jit.get_outputpos() - if_not_supersede);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
 	// Call original is over
-	_jit.mov(rbp(offsetof(AsmLoopDetails, original_call_over)), true);
+	jit.mov(rbp(offsetof(AsmLoopDetails, original_call_over)), true);
 
-	//print_register(_jit, rbp, "POST-RBP");
+	//print_register(jit, rbp, "POST-RBP");
 	// Prelude to POST LOOP
 	// Hooks with a post callback are enqueued at the end of linked list
-	_jit.mov(rax, rbp(offsetof(AsmLoopDetails, post_loop_started)));
-	_jit.test(rax, rax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(rax, reinterpret_cast<std::uintptr_t>(&_end_callbacks));
-		_jit.mov(rax, rax());
-		_jit.mov(rbp(offsetof(AsmLoopDetails, linked_list_it)), rax);
+	jit.mov(rax, rbp(offsetof(AsmLoopDetails, post_loop_started)));
+	jit.test(rax, rax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(rax, rbp(offsetof(AsmLoopDetails, end_callbacks)));
+		jit.mov(rbp(offsetof(AsmLoopDetails, linked_list_it)), rax);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	_jit.mov(rbp(offsetof(AsmLoopDetails, post_loop_started)), true);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	jit.mov(rbp(offsetof(AsmLoopDetails, post_loop_started)), true);
 
 	// POST LOOP
-	_jit.mov(rax, rbp(offsetof(AsmLoopDetails, post_loop_over)));
-	_jit.test(rax, rax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(rax, rbp(offsetof(AsmLoopDetails, linked_list_it)));
-		perform_loop(_jit, reinterpret_cast<std::uintptr_t>(&_jit_func_ptr), func_param_stack_size, offsetof(LinkedList, fn_make_post), offsetof(LinkedList, prev), offsetof(AsmLoopDetails, post_loop_over));
+	jit.mov(rax, rbp(offsetof(AsmLoopDetails, post_loop_over)));
+	jit.test(rax, rax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(rax, rbp(offsetof(AsmLoopDetails, linked_list_it)));
+		perform_loop(jit, code_slot, func_param_stack_size, offsetof(LinkedList, fn_make_post), offsetof(LinkedList, prev), offsetof(AsmLoopDetails, post_loop_over), instrumented);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	//print_register(_jit, rbp, "END-POST-RBP");
-	_jit.mov(rbp(offsetof(AsmLoopDetails, post_loop_over)), true);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	//print_register(jit, rbp, "END-POST-RBP");
+	jit.mov(rbp(offsetof(AsmLoopDetails, post_loop_over)), true);
 
 	// EXIT HOOK
-	pop_rsp(_jit);
-	end_detour(_jit, rbp, false);
+	pop_rsp(jit);
+	probe(jit, TracePoint::Exit);
+	end_detour(jit, rbp, false, instrumented);
 
 	// Restore every other registers
-	_jit.push(rbp);
-	_jit.mov(rbp, rbp(offsetof(AsmLoopDetails, sp_saved_registers)));
-	restore_regs(_jit);
-	_jit.pop(rbp);
-	_jit.push(rax);
-
-	_jit.mov(rax, rbp(offsetof(AsmLoopDetails, recall_count)));
-	_jit.test(rax, rax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
+	jit.push(rbp);
+	jit.mov(rbp, rbp(offsetof(AsmLoopDetails, sp_saved_registers)));
+	jit.unwind(unwind_fp, cfa_from_regs, saved_fp);
+	restore_regs(jit);
+	jit.pop(rbp);
+	jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
+	jit.push(rax);
+
+	jit.mov(rax, rbp(offsetof(AsmLoopDetails, recall_count)));
+	jit.test(rax, rax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
 		// We've climbed back all the recall, free the copy stack and asm loop
 		// Move our saved rax value up
-		_jit.pop(rax);
-		_jit.add(rsp, func_param_stack_size + func_param_stack_start - sizeof(void*));
-		_jit.push(rax);
+		jit.pop(rax);
+		jit.add(rsp, func_param_stack_size + func_param_stack_start - sizeof(void*));
+		jit.push(rax);
 
 		// Retrieve the call address
-		_jit.mov(rax, rbp(offsetof(AsmLoopDetails, fn_make_return)));
+		jit.mov(rax, rbp(offsetof(AsmLoopDetails, fn_make_return)));
 
 		// Restore rbp now, setup call address and
-		_jit.mov(rbp, rsp(sizeof(void*)));
-		_jit.mov(rsp(sizeof(void*)), rax);
+		jit.mov(rbp, rsp(sizeof(void*)));
+		jit.unwind(unwind_sp, sizeof(void*) * 3, 0);
+		jit.mov(rsp(sizeof(void*)), rax);
 		// Restore rax
-		_jit.pop(rax);
+		jit.pop(rax);
+		jit.unwind(unwind_sp, sizeof(void*) * 2, 0);
 
-		//print_rsp(_jit);
+		//print_rsp(jit);
 		// fn_make_return will pop our override & original ptr
-		_jit.retn();
+		jit.retn();
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	_jit.sub(rax, 0x1);
-	_jit.mov(rbp(offsetof(AsmLoopDetails, recall_count)), rax);
-	_jit.pop(rax);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
+	jit.sub(rax, 0x1);
+	jit.mov(rbp(offsetof(AsmLoopDetails, recall_count)), rax);
+	jit.pop(rax);
 	
 	// Free the fake stack
-	_jit.add(rsp, func_param_stack_size);
+	jit.add(rsp, func_param_stack_size);
 
 	// Restore rbp, go back up the recall chain
-	//print_rsp(_jit);
-	_jit.pop(rbp);
-	//_jit.mov(rax, rsp());
-	//print_register(_jit, rax, "RETURN ADDR");
-	//_jit.breakpoint();
-	_jit.retn();
+	//print_rsp(jit);
+	jit.pop(rbp);
+	jit.unwind(unwind_sp, sizeof(void*), 0);
+	//jit.mov(rax, rsp());
+	//print_register(jit, rax, "RETURN ADDR");
+	//jit.breakpoint();
+	jit.retn();
+
+	// Target of the enabled probe sites, nothing but rbp (the loop details) and rsp is live there
+	jit.probe_target();
+	LINUX_ONLY(jit.mov(rdi, rbp));
+	WIN_ONLY(jit.mov(rcx, rbp));
+	LINUX_ONLY(jit.mov(rsi, rsp(0)));
+	WIN_ONLY(jit.mov(rdx, rsp(0)));
+	jit.push(rbp);
+	jit.unwind(unwind_sp, sizeof(void*) * 2, saved_fp);
+	jit.mov(rbp, rsp);
+	jit.unwind(unwind_fp, sizeof(void*) * 2, saved_fp);
+	jit.mov(rax, 0xFFFFFFFFFFFFFFF0);
+	jit.l_and(rsp, rax);
+	WIN_ONLY(jit.sub(rsp, 32));
+	jit.call(reinterpret_cast<std::uintptr_t>(ProbeHit));
+	jit.mov(rsp, rbp);
+	jit.pop(rbp);
+	jit.unwind(unwind_sp, sizeof(void*), 0);
+	jit.retn();
 #else
 	static auto print_register = [](DetourCapsule::AsmJit& jit, x86_Reg reg, const char* name) {
 #ifdef KHOOK_DEBUG_PRINT
@@ -998,9 +1472,10 @@ DetourCapsule::DetourCapsule() :
 #endif
 	};
 
-	static auto begin_detour = [](DetourCapsule::AsmJit& jit, std::uint32_t offset_to_loop_params, std::uint32_t offset_to_regs, std::uint32_t offset_to_stack, std::int32_t stack_size, DetourCapsule* capsule) {
+	static auto begin_detour = [](DetourCapsule::AsmJit& jit, std::uint32_t offset_to_loop_params, std::uint32_t offset_to_regs, std::uint32_t offset_to_stack, std::int32_t stack_size, DetourCapsule* capsule, bool instrumented) {
 		auto param_size = sizeof(void*) * 7;
 		jit.sub(esp, param_size);
+		jit.unwind(unwind_sp, offset_to_stack + param_size + sizeof(void*), saved_fp);
 		// 1st param - Loop variable
 		jit.lea(eax, esp(offset_to_loop_params + param_size));
 		jit.mov(esp(0x0), eax);
@@ -1018,39 +1493,40 @@ DetourCapsule::DetourCapsule() :
 		// 6th param - Detour Capsule
 		jit.mov(esp(0x14), reinterpret_cast<std::uintptr_t>(capsule));
 
-		jit.mov(eax, reinterpret_cast<std::uintptr_t>(BeginDetour));
+		jit.mov(eax, reinterpret_cast<std::uintptr_t>(instrumented ? BeginDetourStats : BeginDetour));
 		jit.call(eax);
 
 		jit.add(esp, param_size);
+		jit.unwind(unwind_sp, offset_to_stack + sizeof(void*), saved_fp);
 	};
 
-	static auto end_detour = [](DetourCapsule::AsmJit& jit, x86_Reg loop, bool no_callbacks) {
+	static auto end_detour = [](DetourCapsule::AsmJit& jit, x86_Reg loop, bool no_callbacks, bool instrumented) {
 		jit.push(no_callbacks);
 		jit.push(loop);
 
-		jit.mov(eax, reinterpret_cast<std::uintptr_t>(EndDetour));
+		jit.mov(eax, reinterpret_cast<std::uintptr_t>(instrumented ? EndDetourStats : EndDetour));
 		jit.call(eax);
 
 		jit.add(esp, sizeof(void*) * 2);
 	};
 
-	static auto push_current_hook = [](DetourCapsule::AsmJit& jit, x86_RegRm reg) {
+	static auto push_current_hook = [](DetourCapsule::AsmJit& jit, x86_RegRm reg, bool instrumented) {
 		jit.push(eax);
 
 		jit.push(true);
 		jit.push(reg);
-		jit.mov(eax, reinterpret_cast<std::uintptr_t>(PushPopCurrentHook));
+		jit.mov(eax, reinterpret_cast<std::uintptr_t>(instrumented ? PushPopCurrentHookStats : PushPopCurrentHook));
 		jit.call(eax);
 		jit.add(esp, sizeof(void*) * 3);
 	};
 
-	static auto pop_current_hook = [](DetourCapsule::AsmJit& jit) {
+	static auto pop_current_hook = [](DetourCapsule::AsmJit& jit, bool instrumented) {
 		jit.push(eax);
 		jit.push(eax);
 
 		jit.push(false);
 		jit.push(0x0);
-		jit.mov(eax, reinterpret_cast<std::uintptr_t>(PushPopCurrentHook));
+		jit.mov(eax, reinterpret_cast<std::uintptr_t>(instrumented ? PushPopCurrentHookStats : PushPopCurrentHook));
 		jit.call(eax);
 		jit.add(esp, sizeof(void*) * 2);
 
@@ -1058,6 +1534,13 @@ DetourCapsule::DetourCapsule() :
 		jit.pop(eax);
 	};
 
+	static auto time_original_call = [](DetourCapsule::AsmJit& jit, bool begin) {
+		jit.push(begin);
+		jit.mov(eax, reinterpret_cast<std::uintptr_t>(TimeOriginalCall));
+		jit.call(eax);
+		jit.add(esp, sizeof(void*));
+	};
+
 	static auto push_rsp = [](DetourCapsule::AsmJit& jit) {
 		jit.push(eax);
 
@@ -1097,18 +1580,26 @@ DetourCapsule::DetourCapsule() :
 		jit.call(eax);
 	};
 
-	//print_rsp(_jit);
+	//print_rsp(jit);
 
-	_jit.sub(esp, 16);
-	_jit.mov(esp(12), ebp);
+	jit.sub(esp, 16);
+	// Until the loop details are known, the caller's frame is found from esp
+	std::int32_t entry_cfa = 16 + sizeof(void*);
+	jit.unwind(unwind_sp, entry_cfa, 0);
+	jit.mov(esp(12), ebp);
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
 
 	// Variable to store various data, should be 16 bytes aligned
-	_jit.sub(esp, local_params_size);
+	jit.sub(esp, local_params_size);
+	entry_cfa += local_params_size;
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
 
 	// Save general purpose registers
-	_jit.sub(esp, sizeof(void*) * reg_count);
+	jit.sub(esp, sizeof(void*) * reg_count);
+	entry_cfa += sizeof(void*) * reg_count;
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
 	for (int i = 0; i < reg_count; i++) {
-		_jit.mov(esp(sizeof(void*) * i), reg[i]);
+		jit.mov(esp(sizeof(void*) * i), reg[i]);
 	}
 	static_assert((reg_count * sizeof(void*)) % 16 == 0);
 
@@ -1124,9 +1615,12 @@ DetourCapsule::DetourCapsule() :
 
 	static constexpr auto stack_local_data_start = sizeof(void*) * reg_count + reg_start;
 	static constexpr auto func_param_stack_start = stack_local_data_start + local_params_size + 16 /* Where we saved EBP */;
-	//print_rsp(_jit, func_param_stack_start);
+	// Where the caller's frame is when ebp holds the loop details, or the saved registers
+	static constexpr std::int32_t cfa_from_loop = func_param_stack_start - stack_local_data_start + sizeof(void*);
+	static constexpr std::int32_t cfa_from_regs = func_param_stack_start + sizeof(void*);
+	//print_rsp(jit, func_param_stack_start);
 
-	static auto perform_loop = [](DetourCapsule::AsmJit& jit, std::uintptr_t jit_func_ptr, std::int32_t func_param_stack_size, std::int32_t offset_fn_callback, std::int32_t offset_next_it, std::int32_t offset_loop_condition) {
+	static auto perform_loop = [](DetourCapsule::AsmJit& jit, std::uintptr_t jit_func_ptr, std::int32_t func_param_stack_size, std::int32_t offset_fn_callback, std::int32_t offset_next_it, std::int32_t offset_loop_condition, bool instrumented) {
 		auto entry_loop = (std::int32_t)jit.get_outputpos();
 		jit.mov(ecx, eax(offset_fn_callback)); // offsetof(LinkedList, fn_callback)
 		jit.test(ecx, ecx);
@@ -1135,7 +1629,7 @@ DetourCapsule::DetourCapsule() :
 			// MAKE PRE/POST CALL
 			jit.sub(esp, sizeof(void*) * 3);
 			jit.push(ecx);
-			push_current_hook(jit, eax(offsetof(LinkedList, hook_ptr)));
+			push_current_hook(jit, eax(offsetof(LinkedList, hook_ptr)), instrumented);
 			jit.pop(ecx);
 			jit.add(esp, sizeof(void*) * 3);
 			jit.mov(eax, jit_func_ptr);
@@ -1149,12 +1643,14 @@ DetourCapsule::DetourCapsule() :
 			//print_register(jit, ebp, "LOOP-COPY-EBP");
 			copy_stack(jit, sizeof(void*) * 2, func_param_stack_size, sizeof(void*) * 3);
 			jit.mov(ebp, ebp(offsetof(AsmLoopDetails, sp_saved_registers)));
+			jit.unwind(unwind_fp, cfa_from_regs, saved_fp);
 			restore_regs(jit);
 			jit.retn();
 			jit.rewrite(make_pre_call_return - sizeof(std::uint32_t), jit.get_outputpos());
 			peek_rsp(jit);
-			pop_current_hook(jit);
+			pop_current_hook(jit, instrumented);
 			peek_rbp(jit);
+			jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
 			print_register(jit, ebp, "PEEK-EBP");
 			// Test loop condition
 			jit.mov(eax, ebp(offset_loop_condition));
@@ -1179,218 +1675,261 @@ DetourCapsule::DetourCapsule() :
 	// Allocate our fake stack	
 	std::int32_t func_param_stack_size = (_stack_size != 0) ? _stack_size : STACK_SAFETY_BUFFER;
 	//printf("JIT STACK SIZE: %d\n", func_param_stack_size);
-	_jit.sub(esp, func_param_stack_size);
+	jit.sub(esp, func_param_stack_size);
+	entry_cfa += func_param_stack_size;
+	jit.unwind(unwind_sp, entry_cfa, saved_fp);
 
-	//print_rsp(_jit);
+	//print_rsp(jit);
 	// Registers have been saved, let's get the loop details
-	begin_detour(_jit, 
+	begin_detour(jit, 
 		func_param_stack_size + stack_local_data_start,
 		func_param_stack_size + reg_start,
 		func_param_stack_size + func_param_stack_start,
 		func_param_stack_size,
-		this
+		this,
+		instrumented
 	);
-	_jit.mov(ebp, eax);
-	//_jit.mov(eax, esp(func_param_stack_size + stack_local_data_start + local_params_size + sizeof(void*)));
-	//print_register(_jit, rax, "RETURN ADDR");
-	print_register(_jit, ebp, "START-EBP");
+	jit.mov(ebp, eax);
+	jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
+	probe(jit, TracePoint::Entry);
+	//jit.mov(eax, esp(func_param_stack_size + stack_local_data_start + local_params_size + sizeof(void*)));
+	//print_register(jit, rax, "RETURN ADDR");
+	print_register(jit, ebp, "START-EBP");
 
 	// Early retrieve callbacks
-	_jit.mov(eax, reinterpret_cast<std::uintptr_t>(&_start_callbacks));
-	_jit.mov(eax, eax());
+	jit.mov(eax, ebp(offsetof(AsmLoopDetails, start_callbacks)));
 	
 	// If no callbacks, early return
-	_jit.test(eax, eax);
-	_jit.jnz(INT32_MAX);{auto jnz_pos = _jit.get_outputpos(); {
+	jit.test(eax, eax);
+	jit.jnz(INT32_MAX);{auto jnz_pos = jit.get_outputpos(); {
 		// End the detour
-		end_detour(_jit, ebp, true);
-		_jit.add(esp, func_param_stack_size);
+		probe(jit, TracePoint::Exit);
+		end_detour(jit, ebp, true, instrumented);
+		jit.add(esp, func_param_stack_size);
 
 		// Restore registers
-		_jit.mov(ebp, ebp(offsetof(AsmLoopDetails, sp_saved_registers)));
-		restore_regs(_jit);
+		jit.mov(ebp, ebp(offsetof(AsmLoopDetails, sp_saved_registers)));
+		jit.unwind(unwind_fp, cfa_from_regs, saved_fp);
+		restore_regs(jit);
 
 		// Retrieve the call address
-		_jit.mov(eax, reinterpret_cast<std::uintptr_t>(&_original_function));
-		_jit.mov(eax, eax());
+		jit.mov(eax, reinterpret_cast<std::uintptr_t>(&_original_function));
+		jit.mov(eax, eax());
 
 		// Restore rbp now, and setup call address
-		_jit.push(eax);
-		_jit.mov(ebp, esp(func_param_stack_start - sizeof(void*) + sizeof(void*) /* push eax */));
-		_jit.mov(esp(func_param_stack_start - sizeof(void*) + sizeof(void*) /* push eax */), eax);
-		_jit.pop(eax);
+		jit.push(eax);
+		jit.mov(ebp, esp(func_param_stack_start - sizeof(void*) + sizeof(void*) /* push eax */));
+		jit.unwind(unwind_sp, cfa_from_regs + sizeof(void*), 0);
+		jit.mov(esp(func_param_stack_start - sizeof(void*) + sizeof(void*) /* push eax */), eax);
+		jit.pop(eax);
+		jit.unwind(unwind_sp, cfa_from_regs, 0);
 
-		_jit.add(esp, func_param_stack_start - sizeof(void*));
-		_jit.retn();
+		jit.add(esp, func_param_stack_start - sizeof(void*));
+		jit.unwind(unwind_sp, sizeof(void*) * 2, 0);
+		jit.retn();
 	}
 	// Write our jump offset
-	_jit.rewrite<std::int32_t>(jnz_pos - sizeof(std::int32_t), _jit.get_outputpos() - jnz_pos);}
+	jit.rewrite<std::int32_t>(jnz_pos - sizeof(std::int32_t), jit.get_outputpos() - jnz_pos);}
+	jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
 
 	// Check if this is a recall
-	print_register(_jit, ebp, "INIT-EBP");
-	_jit.mov(eax, ebp(offsetof(AsmLoopDetails, recall_count)));
-	print_rsp(_jit);
-	_jit.test(eax, eax);
+	print_register(jit, ebp, "INIT-EBP");
+	jit.mov(eax, ebp(offsetof(AsmLoopDetails, recall_count)));
+	print_rsp(jit);
+	jit.test(eax, eax);
 	std::int32_t recall_jump = 0;
-	_jit.jz(INT32_MAX);{auto jz_pos = _jit.get_outputpos(); {
+	jit.jz(INT32_MAX);{auto jz_pos = jit.get_outputpos(); {
 		// This is a recall, so free our local variables and reg saves we don't need them
-		_jit.add(esp, stack_local_data_start + local_params_size);
-		print_register(_jit, ebp, "INIT-EBP-RECALL");
-		_jit.jump(INT32_MAX); recall_jump = _jit.get_outputpos();
+		jit.add(esp, stack_local_data_start + local_params_size);
+		print_register(jit, ebp, "INIT-EBP-RECALL");
+		jit.jump(INT32_MAX); recall_jump = jit.get_outputpos();
 	}
 	// Write our jump offset
-	_jit.rewrite<std::int32_t>(jz_pos - sizeof(std::int32_t), _jit.get_outputpos() - jz_pos);}
-	_jit.rewrite<std::int32_t>(recall_jump - sizeof(std::int32_t), _jit.get_outputpos() - recall_jump);
+	jit.rewrite<std::int32_t>(jz_pos - sizeof(std::int32_t), jit.get_outputpos() - jz_pos);}
+	jit.rewrite<std::int32_t>(recall_jump - sizeof(std::int32_t), jit.get_outputpos() - recall_jump);
 
 	// Remember our whole stack
 	// We will restore it after each function call
-	push_rsp(_jit);
-	print_register(_jit, ebp, "PRE-EBP");	
-	print_rsp(_jit);
+	push_rsp(jit);
+	print_register(jit, ebp, "PRE-EBP");	
+	print_rsp(jit);
 
 	// Prelude to PRE LOOP
 	// Hooks with a pre callback are enqueued at the start of linked list
 	// If this a recall, don't init anything just pickup where we left off
-	_jit.mov(eax, ebp(offsetof(AsmLoopDetails, pre_loop_started)));
-	_jit.test(eax, eax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(eax, reinterpret_cast<std::uintptr_t>(&_start_callbacks));
-		_jit.mov(eax, eax());
-		_jit.mov(ebp(offsetof(AsmLoopDetails, linked_list_it)), eax);
+	jit.mov(eax, ebp(offsetof(AsmLoopDetails, pre_loop_started)));
+	jit.test(eax, eax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(eax, ebp(offsetof(AsmLoopDetails, start_callbacks)));
+		jit.mov(ebp(offsetof(AsmLoopDetails, linked_list_it)), eax);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	_jit.mov(ebp(offsetof(AsmLoopDetails, pre_loop_started)), true);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	jit.mov(ebp(offsetof(AsmLoopDetails, pre_loop_started)), true);
 
 	// PRE LOOP
-	_jit.mov(eax, ebp(offsetof(AsmLoopDetails, pre_loop_over)));
-	_jit.test(eax, eax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(eax, ebp(offsetof(AsmLoopDetails, linked_list_it)));
-		perform_loop(_jit, reinterpret_cast<std::uintptr_t>(&_jit_func_ptr), func_param_stack_size, offsetof(LinkedList, fn_make_pre), offsetof(LinkedList, next), offsetof(AsmLoopDetails, pre_loop_over));
+	jit.mov(eax, ebp(offsetof(AsmLoopDetails, pre_loop_over)));
+	jit.test(eax, eax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(eax, ebp(offsetof(AsmLoopDetails, linked_list_it)));
+		perform_loop(jit, code_slot, func_param_stack_size, offsetof(LinkedList, fn_make_pre), offsetof(LinkedList, next), offsetof(AsmLoopDetails, pre_loop_over), instrumented);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	_jit.mov(ebp(offsetof(AsmLoopDetails, pre_loop_over)), true);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	jit.mov(ebp(offsetof(AsmLoopDetails, pre_loop_over)), true);
 
-	print_register(_jit, ebp, "ORIG-EBP");	
-	print_rsp(_jit);
+	print_register(jit, ebp, "ORIG-EBP");	
+	print_rsp(jit);
 	// Call original (maybe)
 	// RBP which we have set much earlier still contains our local variables
 	// it should have been saved across all calls as per linux & win callconvs
-	_jit.mov(eax, ebp(offsetof(AsmLoopDetails, original_call_over)));
-	_jit.test(eax, eax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(eax, ebp(offsetof(AsmLoopDetails, action)));
-		_jit.cmp(eax, (std::int32_t)Action::Supersede);
-		_jit.je(INT32_MAX);
-		auto if_not_supersede = _jit.get_outputpos(); {
+	jit.mov(eax, ebp(offsetof(AsmLoopDetails, original_call_over)));
+	jit.test(eax, eax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(eax, ebp(offsetof(AsmLoopDetails, action)));
+		jit.cmp(eax, (std::int32_t)Action::Supersede);
+		jit.je(INT32_MAX);
+		auto if_not_supersede = jit.get_outputpos(); {
 			// MAKE ORIGINAL CALL
-			_jit.mov(eax, reinterpret_cast<std::uintptr_t>(&_jit_func_ptr));
-			_jit.mov(eax, eax());
-			_jit.add(eax, INT32_MAX);
-			auto make_pre_call_return = _jit.get_outputpos();
-			_jit.sub(esp, sizeof(void*) * 3);
-			_jit.push(eax); // Setup return address, basically later in this function
-			_jit.mov(eax, ebp(offsetof(AsmLoopDetails, fn_make_call_original)));
-			_jit.push(eax); // Call original
-			print_register(_jit, ebp, "ORG-COPY-EBP");
+			probe(jit, TracePoint::BeforeOriginal);
+			if (instrumented) {
+				time_original_call(jit, true);
+			}
+			jit.mov(eax, code_slot);
+			jit.mov(eax, eax());
+			jit.add(eax, INT32_MAX);
+			auto make_pre_call_return = jit.get_outputpos();
+			jit.sub(esp, sizeof(void*) * 3);
+			jit.push(eax); // Setup return address, basically later in this function
+			jit.mov(eax, ebp(offsetof(AsmLoopDetails, fn_make_call_original)));
+			jit.push(eax); // Call original
+			print_register(jit, ebp, "ORG-COPY-EBP");
 			// RBP must be valid when copy stack is called
-			copy_stack(_jit, sizeof(void*) * 2, func_param_stack_size);
-			_jit.mov(ebp, ebp(offsetof(AsmLoopDetails, sp_saved_registers)));
-			restore_regs(_jit);
-			_jit.retn();
-			_jit.rewrite(make_pre_call_return - sizeof(std::uint32_t), _jit.get_outputpos());
-			peek_rsp(_jit);
-			peek_rbp(_jit);
+			copy_stack(jit, sizeof(void*) * 2, func_param_stack_size);
+			jit.mov(ebp, ebp(offsetof(AsmLoopDetails, sp_saved_registers)));
+			jit.unwind(unwind_fp, cfa_from_regs, saved_fp);
+			restore_regs(jit);
+			jit.retn();
+			jit.rewrite(make_pre_call_return - sizeof(std::uint32_t), jit.get_outputpos());
+			peek_rsp(jit);
+			peek_rbp(jit);
+			jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
+			if (instrumented) {
+				time_original_call(jit, false);
+			}
+			probe(jit, TracePoint::AfterOriginal);
 		}
-		_jit.rewrite<std::int32_t>(if_not_supersede - sizeof(std::int32_t), _jit.get_outputpos() - if_not_supersede);
+		jit.rewrite<std::int32_t>(if_not_supersede - sizeof(std::int32_t), jit.get_outputpos() - if_not_supersede);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
 	// Call original is over
-	_jit.mov(ebp(offsetof(AsmLoopDetails, original_call_over)), true);
+	jit.mov(ebp(offsetof(AsmLoopDetails, original_call_over)), true);
 
 	// Prelude to POST LOOP
 	// Hooks with a post callback are enqueued at the end of linked list
-	_jit.mov(eax, ebp(offsetof(AsmLoopDetails, post_loop_started)));
-	_jit.test(eax, eax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(eax, reinterpret_cast<std::uintptr_t>(&_end_callbacks));
-		_jit.mov(eax, eax());
-		_jit.mov(ebp(offsetof(AsmLoopDetails, linked_list_it)), eax);
+	jit.mov(eax, ebp(offsetof(AsmLoopDetails, post_loop_started)));
+	jit.test(eax, eax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(eax, ebp(offsetof(AsmLoopDetails, end_callbacks)));
+		jit.mov(ebp(offsetof(AsmLoopDetails, linked_list_it)), eax);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	_jit.mov(ebp(offsetof(AsmLoopDetails, post_loop_started)), true);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	jit.mov(ebp(offsetof(AsmLoopDetails, post_loop_started)), true);
 
 	// POST LOOP
-	_jit.mov(eax, ebp(offsetof(AsmLoopDetails, post_loop_over)));
-	_jit.test(eax, eax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
-		_jit.mov(eax, ebp(offsetof(AsmLoopDetails, linked_list_it)));
-		perform_loop(_jit, reinterpret_cast<std::uintptr_t>(&_jit_func_ptr), func_param_stack_size, offsetof(LinkedList, fn_make_post), offsetof(LinkedList, prev), offsetof(AsmLoopDetails, post_loop_over));
+	jit.mov(eax, ebp(offsetof(AsmLoopDetails, post_loop_over)));
+	jit.test(eax, eax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
+		jit.mov(eax, ebp(offsetof(AsmLoopDetails, linked_list_it)));
+		perform_loop(jit, code_slot, func_param_stack_size, offsetof(LinkedList, fn_make_post), offsetof(LinkedList, prev), offsetof(AsmLoopDetails, post_loop_over), instrumented);
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	//print_register(_jit, ebp, "END-POST-EBP");
-	_jit.mov(ebp(offsetof(AsmLoopDetails, post_loop_over)), true);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	//print_register(jit, ebp, "END-POST-EBP");
+	jit.mov(ebp(offsetof(AsmLoopDetails, post_loop_over)), true);
 
 	// EXIT HOOK
-	pop_rsp(_jit);
-	end_detour(_jit, ebp, false);
+	pop_rsp(jit);
+	probe(jit, TracePoint::Exit);
+	end_detour(jit, ebp, false, instrumented);
 
 	// Restore every other registers
-	_jit.push(ebp);
-	_jit.mov(ebp, ebp(offsetof(AsmLoopDetails, sp_saved_registers)));
-	restore_regs(_jit);
-	_jit.pop(ebp);
-	_jit.push(eax);
-
-	_jit.mov(eax, ebp(offsetof(AsmLoopDetails, recall_count)));
-	_jit.test(eax, eax);
-	_jit.jnz(INT32_MAX);{auto jnz = _jit.get_outputpos(); {
+	jit.push(ebp);
+	jit.mov(ebp, ebp(offsetof(AsmLoopDetails, sp_saved_registers)));
+	jit.unwind(unwind_fp, cfa_from_regs, saved_fp);
+	restore_regs(jit);
+	jit.pop(ebp);
+	jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
+	jit.push(eax);
+
+	jit.mov(eax, ebp(offsetof(AsmLoopDetails, recall_count)));
+	jit.test(eax, eax);
+	jit.jnz(INT32_MAX);{auto jnz = jit.get_outputpos(); {
 		// We've climbed back all the recall, free the copy stack and asm loop
 		// Move our saved eax value up
-		_jit.pop(eax);
-		_jit.add(esp, func_param_stack_size + func_param_stack_start - sizeof(void*));
-		_jit.push(eax);
+		jit.pop(eax);
+		jit.add(esp, func_param_stack_size + func_param_stack_start - sizeof(void*));
+		jit.push(eax);
 
 		// Retrieve the call address
-		_jit.mov(eax, ebp(offsetof(AsmLoopDetails, fn_make_return)));
+		jit.mov(eax, ebp(offsetof(AsmLoopDetails, fn_make_return)));
 
 		// Restore rbp now, setup call address and
-		_jit.mov(ebp, esp(sizeof(void*)));
-		_jit.mov(esp(sizeof(void*)), eax);
+		jit.mov(ebp, esp(sizeof(void*)));
+		jit.unwind(unwind_sp, sizeof(void*) * 3, 0);
+		jit.mov(esp(sizeof(void*)), eax);
 		// Restore eax
-		_jit.pop(eax);
+		jit.pop(eax);
+		jit.unwind(unwind_sp, sizeof(void*) * 2, 0);
 
-		//print_rsp(_jit);
+		//print_rsp(jit);
 		// fn_make_return will pop our override & original ptr
-		_jit.retn();
+		jit.retn();
 	}
-	_jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), _jit.get_outputpos() - jnz);}
-	_jit.sub(eax, 0x1);
-	_jit.mov(ebp(offsetof(AsmLoopDetails, recall_count)), eax);
-	_jit.pop(eax);
+	jit.rewrite<std::int32_t>(jnz - sizeof(std::int32_t), jit.get_outputpos() - jnz);}
+	jit.unwind(unwind_fp, cfa_from_loop, saved_fp);
+	jit.sub(eax, 0x1);
+	jit.mov(ebp(offsetof(AsmLoopDetails, recall_count)), eax);
+	jit.pop(eax);
 	
 	// Free the fake stack + part of where we saved ebp
-	_jit.add(esp, func_param_stack_size + 12);
+	jit.add(esp, func_param_stack_size + 12);
 
 	// Restore rbp, go back up the recall chain
-	//print_rsp(_jit);
-	_jit.pop(ebp);
-	//_jit.mov(eax, esp());
-	//print_register(_jit, rax, "RETURN ADDR");
-	//_jit.breakpoint();
-	_jit.retn();
+	//print_rsp(jit);
+	jit.pop(ebp);
+	jit.unwind(unwind_sp, sizeof(void*), 0);
+	//jit.mov(eax, esp());
+	//print_register(jit, rax, "RETURN ADDR");
+	//jit.breakpoint();
+	jit.retn();
+
+	// Target of the enabled probe sites, nothing but ebp (the loop details) and esp is live there
+	jit.probe_target();
+	jit.push(ebp);
+	jit.unwind(unwind_sp, sizeof(void*) * 2, saved_fp);
+	jit.mov(ebp, esp);
+	jit.unwind(unwind_fp, sizeof(void*) * 2, saved_fp);
+	jit.l_and(esp, -16);
+	jit.sub(esp, 8);
+	// 2nd param - Return address
+	jit.push(ebp(sizeof(void*)));
+	// 1st param - Loop details
+	jit.push(ebp(0));
+	jit.mov(eax, reinterpret_cast<std::uintptr_t>(ProbeHit));
+	jit.call(eax);
+	jit.mov(esp, ebp);
+	jit.pop(ebp);
+	jit.unwind(unwind_sp, sizeof(void*), 0);
+	jit.retn();
 #endif
-	_jit.SetRE();
-	void* bridge = _jit;
-	_jit_func_ptr = reinterpret_cast<std::uintptr_t>(bridge);
 }
 
 class EmptyClass {};
 DetourCapsule::~DetourCapsule() {
 	_in_deletion = true;
-	// Lock and unlock mutex, ensuring any other thread is done with this object
 	// Setting _in_deletion to true previously, will prevent more logic from being ran
-	_detour_mutex.lock();
+	_callbacks_mutex.lock();
+	// Calls beginning from now on don't call anything, wait for the others to be done with this object
+	_published = nullptr;
+	g_epochs.Wait(this, g_epochs.Advance());
 
 	// Iterate through all existing hooks and kill them
 	for (auto& callback : _callbacks) {
@@ -1401,22 +1940,95 @@ DetourCapsule::~DetourCapsule() {
 	_callbacks.clear();
 	_start_callbacks = nullptr;
 	_end_callbacks = nullptr;
+	_current.reset();
+	_retired.clear();
+
+	_callbacks_mutex.unlock();
 
-	_detour_mutex.unlock();
+	// Shared code mustn't stay patched for us
+	SetTracing(false);
+	g_perf.Unregister(_jit.GetData());
 }
 
-bool DetourCapsule::InsertHook(HookID_t id, const DetourCapsule::InsertHookDetails& details) {
-	if (_in_deletion) {
-		// We're being deleted it doesn't matter, abort
+bool DetourCapsule::SetTracing(bool enabled) {
+	std::lock_guard guard(g_tracing_mutex);
+	if (_tracing == enabled) {
 		return true;
 	}
-
-	//printf("_detour_mutex -- %d - try lock\n", gettid());
-	if (!_detour_mutex.try_lock()) {
-		// Don't deadlock the other threads because we can't insert
+#ifdef KHOOK_X64
+	if (_dispatcher) {
+		// Patched on the first traced capsule, and back on the last one
+		auto& traced = _dispatcher->traced;
+		if ((enabled ? traced++ : --traced) == 0 && !_dispatcher->jit.set_probes(enabled)) {
+			enabled ? traced-- : traced++;
+			return false;
+		}
+		_tracing = enabled;
+		return true;
+	}
+#endif
+	if (!_jit.set_probes(enabled)) {
 		return false;
 	}
-	//printf("_detour_mutex -- %d - lock\n", gettid());
+	_tracing = enabled;
+	return true;
+}
+
+void DetourCapsule::RegisterCode(const char* name) {
+	if (name == nullptr) {
+		char buffer[64];
+		std::snprintf(buffer, sizeof(buffer), "khook_capsule<%p>", reinterpret_cast<void*>(_function));
+		g_perf.Register(_jit.GetData(), _jit.GetSize(), buffer);
+	} else {
+		g_perf.Register(_jit.GetData(), _jit.GetSize(), name);
+	}
+}
+
+DetourCapsule::CallbackList::CallbackList(const LinkedList* start) {
+	std::size_t count = 0;
+	for (auto hook = start; hook; hook = hook->next) {
+		count++;
+	}
+	// Reserved up front, the nodes point at each other
+	nodes.reserve(count);
+	for (auto hook = start; hook; hook = hook->next) {
+		auto& node = nodes.emplace_back((nodes.empty()) ? nullptr : &nodes.back(), nullptr);
+		node.CopyDetails(*hook);
+	}
+	this->start = &nodes.front();
+	this->end = &nodes.back();
+}
+
+std::uint64_t DetourCapsule::PublishCallbacks() {
+	auto callbacks = (_start_callbacks) ? std::make_unique<CallbackList>(_start_callbacks) : nullptr;
+	_published.store(callbacks.get(), std::memory_order_seq_cst);
+	auto grace_period = g_epochs.Advance();
+	if (_current) {
+		_retired.emplace_back(grace_period, std::move(_current));
+	}
+	_current = std::move(callbacks);
+	FreeRetiredCallbacks();
+	return grace_period;
+}
+
+void DetourCapsule::FreeRetiredCallbacks() {
+	// Oldest first
+	auto over = std::find_if(_retired.begin(), _retired.end(), [this](auto& retired) { return !g_epochs.Passed(this, retired.first); });
+	_retired.erase(_retired.begin(), over);
+}
+
+void DetourCapsule::ReclaimCallbacks() {
+	std::lock_guard guard(_callbacks_mutex);
+	FreeRetiredCallbacks();
+}
+
+void DetourCapsule::InsertHook(HookID_t id, const DetourCapsule::InsertHookDetails& details) {
+	if (_in_deletion) {
+		// We're being deleted it doesn't matter, abort
+		return;
+	}
+
+	std::lock_guard guard(_callbacks_mutex);
 	if (details.fn_make_post == 0) {
 		// Insert at start, it doesn't matter
 		_callbacks[id] = std::make_unique<LinkedList>(nullptr, _start_callbacks);
@@ -1455,17 +2067,21 @@ bool DetourCapsule::InsertHook(HookID_t id, const DetourCapsule::InsertHookDetai
 	}
 	auto inserted = _callbacks[id].get();
 	inserted->CopyDetails(details);
-	_detour_mutex.unlock();
-	return true;
+	inserted->id = id;
+	if (_stats) {
+		inserted->pre_stats = std::make_shared<PhaseStats>();
+		inserted->post_stats = std::make_shared<PhaseStats>();
+	}
+	PublishCallbacks();
 }
 
-void DetourCapsule::RemoveHook(HookID_t id) {
+bool DetourCapsule::RemoveHook(HookID_t id, RemovedHook& removed) {
 	if (_in_deletion) {
 		// We're being deleted it doesn't matter, abort
-		return;
+		return false;
 	}
 
-	std::lock_guard guard(_detour_mutex);
+	std::lock_guard guard(_callbacks_mutex);
 
 	auto it = _callbacks.find(id);
 	if (it != _callbacks.end()) {
@@ -1490,11 +2106,15 @@ void DetourCapsule::RemoveHook(HookID_t id) {
 			_end_callbacks = _end_callbacks->prev;
 		}
 		
+		removed.id = id;
+		removed.hook_ptr = hook->hook_ptr;
+		removed.hook_fn_remove = hook->hook_fn_remove;
+		removed.capsule = this;
 		_callbacks.erase(it);
-
-		auto mfp = BuildMFP<EmptyClass, void, HookID_t>(reinterpret_cast<void*>(hook->hook_fn_remove));
-		(((EmptyClass*)(hook->hook_ptr))->*mfp)(id);
+		removed.grace_period = PublishCallbacks();
+		return true;
 	}
+	return false;
 }
 
 std::mutex g_hook_id_mutex;
@@ -1502,47 +2122,155 @@ HookID_t g_lastest_hook_id = 0;
 
 std::shared_mutex g_hooks_detour_mutex;
 std::unordered_map<void*, std::unique_ptr<DetourCapsule>> g_hooks_detour;
+// Detours being built by SetupHooks, guarded by g_hooks_detour_mutex
+std::unordered_set<void*> g_pending_detours;
+std::condition_variable_any g_pending_detours_cv;
 std::shared_mutex g_associated_hooks_mutex;
 std::unordered_map<HookID_t, DetourCapsule*> g_associated_hooks;
+// Hooks taken out of their detour, told they're gone once their grace period is over. Guarded by g_associated_hooks_mutex,
+// they stay associated until then so removing them again waits for them as well
+std::unordered_map<HookID_t, DetourCapsule::RemovedHook> g_removed_hooks;
 std::mutex g_insert_hooks_mutex;
 std::list<std::pair<HookID_t, DetourCapsule::InsertHookDetails>> g_insert_hooks;
 std::mutex g_delete_hooks_mutex;
 std::unordered_set<HookID_t> g_delete_hooks;
+// Before the worker threads, they use it
+HookLifecycles g_lifecycles;
+// After every table it reads, so it stops before they're destroyed
+MetricsExport g_metrics;
 
-bool __InsertHook_Sync(HookID_t id, const DetourCapsule::InsertHookDetails& details) {
+void __FinishRemoval(std::unordered_map<HookID_t, DetourCapsule::RemovedHook>::iterator it);
+
+void __InsertHook_Sync(HookID_t id, const DetourCapsule::InsertHookDetails& details) {
 	//printf("__InsertHook_Sync -- %d\n", gettid());
 	g_associated_hooks_mutex.lock_shared();
 	auto it = g_associated_hooks.find(id);
 	if (it == g_associated_hooks.end()) {
 		g_associated_hooks_mutex.unlock_shared();
-		return true;
+		return;
+	}
+	if (g_removed_hooks.find(id) == g_removed_hooks.end()) {
+		//printf("__InsertHook_Sync -- %d -- InsertHook\n", gettid());
+		it->second->InsertHook(id, details);
+		//printf("__InsertHook_Sync -- %d -- InsertHook -- over\n", gettid());
+		g_lifecycles.Activated(id);
+		g_associated_hooks_mutex.unlock_shared();
+		return;
 	}
-	//printf("__InsertHook_Sync -- %d -- InsertHook\n", gettid());
-	bool ret = it->second->InsertHook(id, details);
-	//printf("__InsertHook_Sync -- %d -- InsertHook -- over\n", gettid());
 	g_associated_hooks_mutex.unlock_shared();
-	return ret;
-}
 
-void __RemoveHook_Sync(HookID_t id) {
+	// Removed after it left the insertion queue, no call ever saw it so it's told it's gone right away
 	std::lock_guard associated_guard(g_associated_hooks_mutex);
+	auto removed = g_removed_hooks.find(id);
+	if (removed != g_removed_hooks.end() && removed->second.inserting) {
+		removed->second.hook_ptr = details.hook_ptr;
+		removed->second.hook_fn_remove = details.hook_fn_remove;
+		__FinishRemoval(removed);
+	}
+}
+
+// Takes a hook out of its detour if it's still in, g_associated_hooks_mutex must be owned.
+// Returns nullptr if the hook isn't associated anymore
+DetourCapsule::RemovedHook* __UnlinkHook(HookID_t id) {
 	auto it = g_associated_hooks.find(id);
 	if (it == g_associated_hooks.end()) {
-		return;
+		return nullptr;
+	}
+
+	auto removed = g_removed_hooks.find(id);
+	if (removed == g_removed_hooks.end()) {
+		DetourCapsule::RemovedHook hook = {};
+		hook.id = id;
+		// Not in the detour yet, the insertion thread took it from its queue. Marked removed it won't be inserted,
+		// and __InsertHook_Sync finishes the removal since it's the one holding the hook's details
+		hook.inserting = !it->second->RemoveHook(id, hook);
+		removed = g_removed_hooks.emplace(id, hook).first;
 	}
+	return &removed->second;
+}
 
-	it->second->RemoveHook(id);
+// Tells the hook it's gone and forgets it, g_associated_hooks_mutex must be owned
+void __FinishRemoval(std::unordered_map<HookID_t, DetourCapsule::RemovedHook>::iterator it) {
+	auto removed = it->second;
+	g_removed_hooks.erase(it);
+	g_associated_hooks.erase(removed.id);
 
-	g_associated_hooks.erase(id);
+	if (removed.hook_fn_remove) {
+		auto mfp = BuildMFP<EmptyClass, void, HookID_t>(reinterpret_cast<void*>(removed.hook_fn_remove));
+		(((EmptyClass*)(removed.hook_ptr))->*mfp)(removed.id);
+	}
+	g_lifecycles.Removed(removed.id);
 }
 
-// Worker thread that insert/deletes hook
-bool g_TerminateWorker = false;
+// Finishes the removals whose grace period is over, never waits
+void __FinishRemovals() {
+	std::unordered_set<DetourCapsule*> capsules;
+	std::lock_guard associated_guard(g_associated_hooks_mutex);
+	for (auto it = g_removed_hooks.begin(); it != g_removed_hooks.end();) {
+		auto next = std::next(it);
+		if (!it->second.inserting && g_epochs.Passed(it->second.capsule, it->second.grace_period)) {
+			if (it->second.capsule) {
+				capsules.insert(it->second.capsule);
+			}
+			__FinishRemoval(it);
+		}
+		it = next;
+	}
+	// Shutdown can't destroy the detours while we own the lock
+	for (auto capsule : capsules) {
+		capsule->ReclaimCallbacks();
+	}
+}
 
-std::thread g_InsertThread([]{
-	while (!g_TerminateWorker) {
-		g_insert_hooks_mutex.lock();
-		if (g_insert_hooks.begin() != g_insert_hooks.end()) {
+void __RemoveHooks_Sync(const HookID_t* ids, std::size_t count) {
+	// Only the latest grace period of each detour needs waiting for
+	std::unordered_map<DetourCapsule*, std::uint64_t> grace_periods;
+	{
+		std::lock_guard associated_guard(g_associated_hooks_mutex);
+		for (std::size_t i = 0; i < count; i++) {
+			auto removed = __UnlinkHook(ids[i]);
+			if (removed && removed->capsule) {
+				auto& grace_period = grace_periods[removed->capsule];
+				grace_period = std::max(grace_period, removed->grace_period);
+			}
+		}
+	}
+
+	// Only the calls in flight through the detours when the hooks were taken out can still be calling them.
+	// Those of the calling thread can't be waited for, they're up the stack
+	for (auto& it : grace_periods) {
+		g_epochs.Wait(it.first, it.second, true);
+	}
+
+	for (std::size_t i = 0; i < count;) {
+		std::unique_lock associated_guard(g_associated_hooks_mutex);
+		auto it = g_removed_hooks.find(ids[i]);
+		if (it != g_removed_hooks.end() && it->second.inserting) {
+			// The insertion thread is about to tell the hook
+			associated_guard.unlock();
+			std::this_thread::yield();
+			continue;
+		}
+		// Otherwise the deletion or insertion thread got to it first
+		if (it != g_removed_hooks.end()) {
+			auto capsule = it->second.capsule;
+			__FinishRemoval(it);
+			// Shutdown can't destroy the detour while we own the lock
+			if (capsule) {
+				capsule->ReclaimCallbacks();
+			}
+		}
+		i++;
+	}
+}
+
+// Worker thread that insert/deletes hook
+bool g_TerminateWorker = false;
+
+std::thread g_InsertThread([]{
+	while (!g_TerminateWorker) {
+		g_insert_hooks_mutex.lock();
+		while (g_insert_hooks.begin() != g_insert_hooks.end()) {
 			auto it = g_insert_hooks.begin();
 			auto id = it->first;
 			auto details = it->second;
@@ -1551,15 +2279,10 @@ std::thread g_InsertThread([]{
 			// Let other threads add more hooks to insert
 			g_insert_hooks_mutex.unlock();
 	
-			bool ret = __InsertHook_Sync(id, details);
+			__InsertHook_Sync(id, details);
 	
 			// Relock thread for loop condition
 			g_insert_hooks_mutex.lock();
-
-			// Insert failed, try again a little later
-			if (!ret) {
-				g_insert_hooks.push_back(std::make_pair(id, details));
-			}
 		}
 		g_insert_hooks_mutex.unlock();
 		std::this_thread::sleep_for(std::chrono::milliseconds(5));
@@ -1577,28 +2300,29 @@ std::thread g_DeleteThread([]{
 			// Let other threads add more hooks to delete
 			g_delete_hooks_mutex.unlock();
 
-			__RemoveHook_Sync(id);
+			{
+				std::lock_guard associated_guard(g_associated_hooks_mutex);
+				__UnlinkHook(id);
+			}
 
 			// Relock thread for loop condition
 			g_delete_hooks_mutex.lock();
 		}
 		g_delete_hooks_mutex.unlock();
+
+		// The hooks are told they're gone later, once no call is still calling them
+		__FinishRemovals();
 		std::this_thread::sleep_for(std::chrono::milliseconds(5));
 	}
 });
 
-template<typename... Args>
-HookID_t __Setup__Hook(
-	void* unique_identifier,
+DetourCapsule::InsertHookDetails __Make__Details(
 	void* context,
 	void* remove_fn,
 	void* pre,
 	void* post,
 	void* make_return,
-	void* make_call_original,
-	bool async,
-	bool (DetourCapsule::*setup_hook)(Args...),
-	Args... args
+	void* make_call_original
 ) {
 	DetourCapsule::InsertHookDetails details;
 	details.hook_ptr = reinterpret_cast<std::uintptr_t>(context);
@@ -1609,36 +2333,13 @@ HookID_t __Setup__Hook(
 
 	details.fn_make_return = reinterpret_cast<std::uintptr_t>(make_return);
 	details.fn_make_call_original = reinterpret_cast<std::uintptr_t>(make_call_original);
+	return details;
+}
 
+// Associates a new hook with an existing detour
+HookID_t __Associate__Hook(void* unique_identifier, const DetourCapsule::InsertHookDetails& details, bool async) {
 	g_hooks_detour_mutex.lock_shared();
 	auto it = g_hooks_detour.find(unique_identifier);
-	if (it == g_hooks_detour.end()) {
-		g_hooks_detour_mutex.unlock_shared();
-		g_hooks_detour_mutex.lock();
-
-		auto insert = g_hooks_detour.insert_or_assign(unique_identifier, std::make_unique<DetourCapsule>());
-		if (insert.second) {
-			auto detour = insert.first->second.get();
-			// Hook setup failed, so early abort...
-			if ((detour->*setup_hook)(std::forward<Args>(args)...) == false) {
-				g_hooks_detour.erase(unique_identifier);
-				insert.second = false;
-			}
-		}
-		g_hooks_detour_mutex.unlock();
-
-		if (!insert.second) {
-			return INVALID_HOOK;
-		}
-		// If we've just inserted that new detour
-		// Sync insert the hook as well
-		async = false;
-	} else {
-		g_hooks_detour_mutex.unlock_shared();
-	}
-
-	g_hooks_detour_mutex.lock_shared();
-	it = g_hooks_detour.find(unique_identifier);
 	if (it != g_hooks_detour.end()) {
 
 		HookID_t id = 0;
@@ -1652,15 +2353,11 @@ HookID_t __Setup__Hook(
 			std::lock_guard associated_guard(g_associated_hooks_mutex);
 			g_associated_hooks[id] = it->second.get();
 		}
+		g_lifecycles.Enqueued(id, async);
 
 		if (!async) {
-			if (__InsertHook_Sync(id, details) == false) {
-				// Should be impossible to fail... but if it does, async add
-				async = true;
-			}
-		}
-
-		if (async) {
+			__InsertHook_Sync(id, details);
+		} else {
 			std::lock_guard insert_guard(g_insert_hooks_mutex);
 			g_insert_hooks.push_back(std::make_pair(id, details));
 		}
@@ -1673,6 +2370,57 @@ HookID_t __Setup__Hook(
 	return INVALID_HOOK;
 }
 
+template<typename... Args>
+HookID_t __Setup__Hook(
+	void* unique_identifier,
+	void* context,
+	void* remove_fn,
+	void* pre,
+	void* post,
+	void* make_return,
+	void* make_call_original,
+	bool async,
+	const char* name,
+	bool (DetourCapsule::*setup_hook)(Args...),
+	Args... args
+) {
+	auto details = __Make__Details(context, remove_fn, pre, post, make_return, make_call_original);
+
+	g_hooks_detour_mutex.lock_shared();
+	auto it = g_hooks_detour.find(unique_identifier);
+	if (it == g_hooks_detour.end()) {
+		g_hooks_detour_mutex.unlock_shared();
+		g_hooks_detour_mutex.lock();
+
+		// SetupHooks may be building that detour, wait for it to be published
+		g_pending_detours_cv.wait(g_hooks_detour_mutex, [unique_identifier]() {
+			return g_pending_detours.find(unique_identifier) == g_pending_detours.end();
+		});
+
+		// Never replace a detour another thread created in the meantime
+		auto insert = g_hooks_detour.try_emplace(unique_identifier, nullptr);
+		if (insert.second) {
+			insert.first->second = std::make_unique<DetourCapsule>();
+			auto detour = insert.first->second.get();
+			// Hook setup failed, so early abort...
+			if ((detour->*setup_hook)(std::forward<Args>(args)...) == false) {
+				g_hooks_detour.erase(unique_identifier);
+				g_hooks_detour_mutex.unlock();
+				return INVALID_HOOK;
+			}
+			detour->RegisterCode(name);
+			// If we've just inserted that new detour
+			// Sync insert the hook as well
+			async = false;
+		}
+		g_hooks_detour_mutex.unlock();
+	} else {
+		g_hooks_detour_mutex.unlock_shared();
+	}
+
+	return __Associate__Hook(unique_identifier, details, async);
+}
+
 KHOOK_API HookID_t SetupHook(
 	void* function,
 	void* context,
@@ -1681,7 +2429,8 @@ KHOOK_API HookID_t SetupHook(
 	void* post,
 	void* make_return,
 	void* make_call_original,
-	bool async
+	bool async,
+	const char* name
 ) {
 	return __Setup__Hook(
 		function, // The function ptr will be used as the identifier
@@ -1692,6 +2441,7 @@ KHOOK_API HookID_t SetupHook(
 		make_return,
 		make_call_original,
 		async,
+		name,
 		&DetourCapsule::SetupAddress,
 		function
 	);
@@ -1706,7 +2456,8 @@ KHOOK_API HookID_t SetupVirtualHook(
 	void* post,
 	void* make_return,
 	void* make_call_original,
-	bool async
+	bool async,
+	const char* name
 ) {
 	return __Setup__Hook(
 		vtable + index, // The vtable entry address will be used as identifier
@@ -1717,38 +2468,151 @@ KHOOK_API HookID_t SetupVirtualHook(
 		make_return,
 		make_call_original,
 		async,
+		name,
 		&DetourCapsule::SetupVirtual,
 		vtable,
 		index
 	);
 }
 
-KHOOK_API void RemoveHook(
-	HookID_t id,
-	bool async
+KHOOK_API std::size_t SetupHooks(
+	HookSetup* hooks,
+	std::size_t count,
+	std::size_t threads
 ) {
+	auto identifier = [](const HookSetup& hook) -> void* {
+		return (hook.function) ? hook.function : reinterpret_cast<void*>(hook.vtable + hook.index);
+	};
+
+	struct Build {
+		HookSetup* hook;
+		std::unique_ptr<DetourCapsule> detour;
+	};
+	std::vector<Build> builds;
+	// Detours a concurrent SetupHooks is building, their hooks go through SetupHook which waits for them
+	std::unordered_set<void*> claimed;
+	std::unordered_set<void*> others;
+
+	// Claim the missing detours, concurrent setups of the same functions will wait for us
 	{
-		std::lock_guard guard(g_insert_hooks_mutex);
-		for (auto it = g_insert_hooks.begin(); it != g_insert_hooks.end(); it++) {
-			if ((*it).first != id) {
+		std::lock_guard guard(g_hooks_detour_mutex);
+		for (std::size_t i = 0; i < count; i++) {
+			void* unique_identifier = identifier(hooks[i]);
+			if (g_hooks_detour.find(unique_identifier) != g_hooks_detour.end()) {
 				continue;
 			}
+			if (g_pending_detours.insert(unique_identifier).second) {
+				claimed.insert(unique_identifier);
+				builds.push_back({ &hooks[i], nullptr });
+			} else if (claimed.find(unique_identifier) == claimed.end()) {
+				others.insert(unique_identifier);
+			}
+		}
+	}
 
-			// Hook not yet been inserted, remove it right now
-			g_insert_hooks.erase(it);
+	// Generate the code of every detour in parallel, the calling thread takes part
+	if (threads == 0) {
+		threads = std::thread::hardware_concurrency();
+	}
+	threads = std::max<std::size_t>(1, std::min(threads, builds.size()));
+	std::atomic<std::size_t> next_build = 0;
+	auto worker = [&builds, &next_build]() {
+		for (std::size_t i = next_build++; i < builds.size(); i = next_build++) {
+			builds[i].detour = std::make_unique<DetourCapsule>();
+		}
+	};
+	std::vector<std::thread> pool;
+	for (std::size_t i = 1; i < threads; i++) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (auto& thread : pool) {
+		thread.join();
+	}
 
-			// Disassociate from the detour
-			{
-				std::lock_guard guard_associated(g_associated_hooks_mutex);
-				g_associated_hooks.erase(id);
+	// Patching stays serial, safetyhook freezes every other thread while it rewrites a prologue
+	for (auto& build : builds) {
+		bool setup = (build.hook->function)
+			? build.detour->SetupAddress(build.hook->function)
+			: build.detour->SetupVirtual(build.hook->vtable, build.hook->index);
+		if (!setup) {
+			build.detour.reset();
+		} else {
+			build.detour->RegisterCode(build.hook->name);
+		}
+	}
+
+	// Publish them all at once
+	std::unordered_set<void*> built;
+	{
+		std::lock_guard guard(g_hooks_detour_mutex);
+		for (auto& build : builds) {
+			void* unique_identifier = identifier(*build.hook);
+			if (build.detour) {
+				g_hooks_detour.emplace(unique_identifier, std::move(build.detour));
+				built.insert(unique_identifier);
 			}
+			g_pending_detours.erase(unique_identifier);
+		}
+	}
+	g_pending_detours_cv.notify_all();
+
+	std::size_t created = 0;
+	for (std::size_t i = 0; i < count; i++) {
+		auto& hook = hooks[i];
+		void* unique_identifier = identifier(hook);
+		if (others.find(unique_identifier) != others.end()) {
+			hook.id = (hook.function)
+				? SetupHook(hook.function, hook.context, hook.removed_function, hook.pre, hook.post, hook.make_return, hook.make_call_original, hook.async, hook.name)
+				: SetupVirtualHook(hook.vtable, hook.index, hook.context, hook.removed_function, hook.pre, hook.post, hook.make_return, hook.make_call_original, hook.async, hook.name);
+			if (hook.id != INVALID_HOOK) {
+				created++;
+			}
+			continue;
+		}
+		auto details = __Make__Details(hook.context, hook.removed_function, hook.pre, hook.post, hook.make_return, hook.make_call_original);
+		// Like SetupHook, hooks on detours we've just built are inserted synchronously
+		bool async = hook.async && built.find(unique_identifier) == built.end();
+		hook.id = __Associate__Hook(unique_identifier, details, async);
+		if (hook.id != INVALID_HOOK) {
+			created++;
+		}
+	}
+	return created;
+}
 
-			// Invoke remove callback
-			auto& hook = it->second;
-			auto mfp = BuildMFP<EmptyClass, void, HookID_t>(reinterpret_cast<void*>(hook.hook_fn_remove));
-			(((EmptyClass*)(hook.hook_ptr))->*mfp)(id);
-			return;
+// Removes the hook right away if it wasn't inserted yet
+bool __RemoveQueuedHook(HookID_t id) {
+	std::lock_guard guard(g_insert_hooks_mutex);
+	for (auto it = g_insert_hooks.begin(); it != g_insert_hooks.end(); it++) {
+		if ((*it).first != id) {
+			continue;
 		}
+
+		auto hook = it->second;
+		g_insert_hooks.erase(it);
+
+		// Disassociate from the detour
+		{
+			std::lock_guard guard_associated(g_associated_hooks_mutex);
+			g_associated_hooks.erase(id);
+		}
+		g_lifecycles.Removed(id);
+
+		// Invoke remove callback
+		auto mfp = BuildMFP<EmptyClass, void, HookID_t>(reinterpret_cast<void*>(hook.hook_fn_remove));
+		(((EmptyClass*)(hook.hook_ptr))->*mfp)(id);
+		return true;
+	}
+	return false;
+}
+
+KHOOK_API void RemoveHook(
+	HookID_t id,
+	bool async
+) {
+	if (__RemoveQueuedHook(id)) {
+		return;
 	}
 
 	if (async) {
@@ -1760,30 +2624,463 @@ KHOOK_API void RemoveHook(
 			return;
 		}
 
+		g_lifecycles.RemovalRequested(id);
 		g_delete_hooks_mutex.lock();
 		g_delete_hooks.insert(id);
 		g_delete_hooks_mutex.unlock();
 
 		g_associated_hooks_mutex.unlock_shared();
 	} else {
-		__RemoveHook_Sync(id);
+		__RemoveHooks_Sync(&id, 1);
 	}
 }
 
+KHOOK_API void RemoveHooks(
+	const HookID_t* ids,
+	std::size_t count,
+	bool async
+) {
+	if (async) {
+		for (std::size_t i = 0; i < count; i++) {
+			RemoveHook(ids[i], true);
+		}
+		return;
+	}
+
+	std::vector<HookID_t> inserted;
+	inserted.reserve(count);
+	for (std::size_t i = 0; i < count; i++) {
+		if (!__RemoveQueuedHook(ids[i])) {
+			inserted.push_back(ids[i]);
+		}
+	}
+	__RemoveHooks_Sync(inserted.data(), inserted.size());
+}
+
 KHOOK_API void Shutdown(
 ) {
-	g_hooks_detour_mutex.lock();
-	g_associated_hooks_mutex.lock();
+	g_metrics.Stop();
+	// The hooks taken out of their detour aren't known to it anymore, they're told they're gone here.
+	// Grace periods are waited for without any lock, the calls in flight may be setting up or removing hooks
+	for (;;) {
+		std::vector<std::pair<DetourCapsule*, std::uint64_t>> grace_periods;
+		{
+			std::lock_guard associated_guard(g_associated_hooks_mutex);
+			for (auto& it : g_removed_hooks) {
+				grace_periods.emplace_back(it.second.capsule, it.second.grace_period);
+			}
+		}
+		for (auto& it : grace_periods) {
+			g_epochs.Wait(it.first, it.second, true);
+		}
+
+		g_hooks_detour_mutex.lock();
+		g_associated_hooks_mutex.lock();
+		for (auto it = g_removed_hooks.begin(); it != g_removed_hooks.end();) {
+			auto next = std::next(it);
+			if (g_epochs.Passed(it->second.capsule, it->second.grace_period, true)) {
+				__FinishRemoval(it);
+			}
+			it = next;
+		}
+		if (g_removed_hooks.empty()) {
+			break;
+		}
+		// Removed while we were waiting
+		g_associated_hooks_mutex.unlock();
+		g_hooks_detour_mutex.unlock();
+	}
+	g_perf.Clear();
 	g_associated_hooks.clear();
+	// Destroyed once unlocked, they wait for their calls in flight as well
+	auto detours = std::move(g_hooks_detour);
 	g_hooks_detour.clear();
 	g_hooks_detour_mutex.unlock();
 	g_associated_hooks_mutex.unlock();
+	detours.clear();
+	g_lifecycles.Clear();
 
 	g_TerminateWorker = true;
 	g_InsertThread.join();
 	g_DeleteThread.join();
 }
 
+KHOOK_API void SetDispatchMode(DispatchMode mode) {
+	g_dispatch_mode = mode;
+}
+
+KHOOK_API bool SetupCodeArena(std::size_t size, bool lock) {
+	return Asm::Allocator.SetupArena(size, lock);
+}
+
+#ifndef _WIN32
+// Huge pages mapping the given range, whether shmem gets any depends on the system configuration and not only on madvise
+static std::size_t HugePageBytes(std::uintptr_t start, std::size_t size) {
+	std::FILE* smaps = std::fopen("/proc/self/smaps", "r");
+	if (smaps == nullptr) {
+		return 0;
+	}
+	std::size_t kilobytes = 0;
+	bool inside = false;
+	char line[512];
+	unsigned long long low, high, value;
+	while (std::fgets(line, sizeof(line), smaps)) {
+		if (std::sscanf(line, "%llx-%llx ", &low, &high) == 2) {
+			inside = (low < start + size && high > start);
+		} else if (inside && (std::sscanf(line, "AnonHugePages: %llu kB", &value) == 1
+			|| std::sscanf(line, "ShmemPmdMapped: %llu kB", &value) == 1
+			|| std::sscanf(line, "FilePmdMapped: %llu kB", &value) == 1)) {
+			kilobytes += value;
+		}
+	}
+	std::fclose(smaps);
+	return kilobytes * 1024;
+}
+#endif
+
+KHOOK_API CodeArenaStats GetCodeArenaStats() {
+	auto stats = Asm::Allocator.GetArenaStats();
+	std::size_t huge_page_bytes = 0;
+#ifndef _WIN32
+	if (stats.reserved != 0) {
+		huge_page_bytes = HugePageBytes(reinterpret_cast<std::uintptr_t>(stats.start), stats.reserved);
+	}
+#endif
+	return { stats.reserved, stats.carved, stats.used, stats.hugePagesAdvised, huge_page_bytes, stats.locked };
+}
+
+// Heap taken by a node based hash table, one allocation per element plus the bucket array
+template<typename TABLE>
+static std::size_t HashTableBytes(const TABLE& table) {
+	return table.size() * (sizeof(typename TABLE::value_type) + 2 * sizeof(void*)) + table.bucket_count() * sizeof(void*);
+}
+
+KHOOK_API MemoryStats GetMemoryStats() {
+	MemoryStats stats = {};
+	auto usage = Asm::Allocator.GetUsage();
+	auto slabs = Asm::Allocator.GetSlabStats();
+	stats.code_mapped = usage.mapped;
+	stats.code_used = usage.used;
+	stats.code_slabs = slabs.slabs;
+	stats.code_spare_slabs = slabs.spares;
+	stats.code_dedicated_mappings = slabs.dedicated;
+	stats.code_fragmented = slabs.freeBytes;
+
+	{
+		std::shared_lock guard(g_hooks_detour_mutex);
+		stats.detours = g_hooks_detour.size();
+		stats.table_bytes += HashTableBytes(g_hooks_detour) + HashTableBytes(g_pending_detours);
+		for (auto& it : g_hooks_detour) {
+			auto detour = it.second.get();
+			stats.detour_code += detour->_jit.GetSize();
+			stats.detour_bytes += sizeof(DetourCapsule) + ((detour->_stats) ? sizeof(CapsuleStats) : 0);
+
+			std::lock_guard detour_guard(detour->_callbacks_mutex);
+			stats.callbacks += detour->_callbacks.size();
+			stats.callback_bytes += HashTableBytes(detour->_callbacks);
+			for (auto& callback : detour->_callbacks) {
+				stats.callback_bytes += sizeof(DetourCapsule::LinkedList);
+				stats.callback_bytes += (callback.second->pre_stats) ? sizeof(PhaseStats) : 0;
+				stats.callback_bytes += (callback.second->post_stats) ? sizeof(PhaseStats) : 0;
+			}
+			// Along with the copies the calls iterate
+			auto copy_bytes = [&stats](const std::unique_ptr<DetourCapsule::CallbackList>& callbacks) {
+				stats.callback_bytes += sizeof(DetourCapsule::CallbackList) + callbacks->nodes.capacity() * sizeof(DetourCapsule::LinkedList);
+			};
+			if (detour->_current) {
+				copy_bytes(detour->_current);
+			}
+			for (auto& retired : detour->_retired) {
+				copy_bytes(retired.second);
+			}
+		}
+	}
+#ifdef KHOOK_X64
+	{
+		std::lock_guard guard(g_shared_dispatchers_mutex);
+		stats.shared_dispatchers = g_shared_dispatchers.size();
+		for (auto& it : g_shared_dispatchers) {
+			stats.shared_dispatcher_code += it.second->jit.GetSize();
+		}
+	}
+#endif
+	{
+		std::shared_lock guard(g_associated_hooks_mutex);
+		stats.associated_hooks = g_associated_hooks.size();
+		stats.table_bytes += HashTableBytes(g_associated_hooks) + HashTableBytes(g_removed_hooks);
+		// Those waiting for their grace period
+		stats.pending_deletes += g_removed_hooks.size();
+	}
+	{
+		std::lock_guard guard(g_insert_hooks_mutex);
+		stats.pending_inserts = g_insert_hooks.size();
+		stats.table_bytes += g_insert_hooks.size() * (sizeof(decltype(g_insert_hooks)::value_type) + 2 * sizeof(void*));
+	}
+	{
+		std::lock_guard guard(g_delete_hooks_mutex);
+		stats.pending_deletes += g_delete_hooks.size();
+		stats.table_bytes += HashTableBytes(g_delete_hooks);
+	}
+
+	stats.dispatch_threads = g_thread_state_threads.load(std::memory_order_relaxed);
+	stats.dispatch_thread_bytes = g_thread_state_bytes.load(std::memory_order_relaxed);
+	stats.hooked_instances = g_hooked_instances.load(std::memory_order_relaxed);
+	stats.instance_cleanups = g_instance_cleanups.load(std::memory_order_relaxed);
+	return stats;
+}
+
+KHOOK_API void CountInstances(std::ptrdiff_t added, bool cleanup) {
+	g_hooked_instances.fetch_add(static_cast<std::size_t>(added), std::memory_order_relaxed);
+	if (cleanup) {
+		g_instance_cleanups.fetch_add(static_cast<std::size_t>(-added), std::memory_order_relaxed);
+	}
+}
+
+KHOOK_API void SetStatsEnabled(bool enabled) {
+	g_stats_enabled = enabled;
+}
+
+KHOOK_API bool GetStats(HookID_t id, HookStats& stats) {
+	std::shared_lock guard(g_associated_hooks_mutex);
+	auto it = g_associated_hooks.find(id);
+	if (it == g_associated_hooks.end() || it->second->_stats == nullptr) {
+		return false;
+	}
+	it->second->_stats->Collect(stats);
+	return true;
+}
+
+KHOOK_API void SetDefaultSampleRate(std::uint32_t rate) {
+	g_default_sample_rate = (rate != 0) ? rate : 1;
+}
+
+KHOOK_API bool SetSampleRate(HookID_t id, std::uint32_t rate) {
+	std::shared_lock guard(g_associated_hooks_mutex);
+	auto it = g_associated_hooks.find(id);
+	if (it == g_associated_hooks.end() || it->second->_stats == nullptr) {
+		return false;
+	}
+	it->second->_stats->SetSampleRate(rate);
+	return true;
+}
+
+KHOOK_API void ForEachCapsuleStats(fnStatsCallback callback, void* user) {
+	// Collected first, so the callback is free to create or remove hooks
+	std::vector<std::pair<void*, HookStats>> collected;
+	{
+		std::shared_lock guard(g_hooks_detour_mutex);
+		collected.reserve(g_hooks_detour.size());
+		for (auto& it : g_hooks_detour) {
+			if (it.second->_stats) {
+				HookStats stats;
+				it.second->_stats->Collect(stats);
+				collected.emplace_back(it.first, stats);
+			}
+		}
+	}
+	for (auto& it : collected) {
+		callback(it.first, it.second, user);
+	}
+}
+
+KHOOK_API void ForEachCallbackStats(fnCallbackStatsCallback callback, void* user) {
+	// Collected first, so the callback is free to create or remove hooks
+	std::vector<std::pair<void*, CallbackStats>> collected;
+	{
+		std::shared_lock guard(g_hooks_detour_mutex);
+		for (auto& it : g_hooks_detour) {
+			auto detour = it.second.get();
+			if (detour->_stats == nullptr) {
+				continue;
+			}
+
+			std::lock_guard detour_guard(detour->_callbacks_mutex);
+			auto add = [&collected, &it](HookID_t id, void* context, CallbackPhase phase, const PhaseStats& phase_stats) {
+				CallbackStats stats;
+				stats.id = id;
+				stats.context = context;
+				stats.phase = phase;
+				phase_stats.Collect(stats);
+				collected.emplace_back(it.first, stats);
+			};
+			// In the order they're called
+			for (auto hook = detour->_start_callbacks; hook; hook = hook->next) {
+				if (hook->fn_make_pre) {
+					add(hook->id, reinterpret_cast<void*>(hook->hook_ptr), CallbackPhase::Pre, *hook->pre_stats);
+				}
+			}
+			add(INVALID_HOOK, nullptr, CallbackPhase::Original, detour->_stats->original);
+			for (auto hook = detour->_end_callbacks; hook; hook = hook->prev) {
+				if (hook->fn_make_post) {
+					add(hook->id, reinterpret_cast<void*>(hook->hook_ptr), CallbackPhase::Post, *hook->post_stats);
+				}
+			}
+		}
+	}
+	for (auto& it : collected) {
+		callback(it.first, it.second, user);
+	}
+}
+
+KHOOK_API bool ExportFoldedStacks(const char* path) {
+	FILE* file = std::fopen(path, "w");
+	if (file == nullptr) {
+		return false;
+	}
+	ForEachCallbackStats([](void* function, const CallbackStats& stats, void* user) {
+		if (stats.cycles == 0) {
+			return;
+		}
+		FILE* file = reinterpret_cast<FILE*>(user);
+		unsigned long long cycles = stats.cycles;
+		switch (stats.phase) {
+		case CallbackPhase::Pre:
+			std::fprintf(file, "%p;hook_%u@%p;pre %llu\n", function, stats.id, stats.context, cycles);
+			break;
+		case CallbackPhase::Original:
+			std::fprintf(file, "%p;original;call %llu\n", function, cycles);
+			break;
+		case CallbackPhase::Post:
+			std::fprintf(file, "%p;hook_%u@%p;post %llu\n", function, stats.id, stats.context, cycles);
+			break;
+		}
+	}, file);
+	return std::fclose(file) == 0;
+}
+
+KHOOK_API bool StartTracing(std::size_t records_per_thread, std::size_t threads) {
+	return g_trace.Start(records_per_thread, threads);
+}
+
+KHOOK_API void StopTracing() {
+	g_trace.Stop();
+}
+
+KHOOK_API bool DumpTrace(const char* path) {
+	return g_trace.Dump(path);
+}
+
+KHOOK_API bool SetPerfOutput(std::uint8_t outputs) {
+	return g_perf.SetOutputs(outputs);
+}
+
+KHOOK_API void SetUnwindInfoEnabled(bool enabled) {
+	g_unwind_enabled = enabled;
+}
+
+KHOOK_API void SetTracepointCallback(fnTracepointCallback callback, void* user) {
+	g_tracepoint_user.store(user, std::memory_order_relaxed);
+	g_tracepoint_callback.store(callback, std::memory_order_release);
+}
+
+KHOOK_API bool SetTracing(HookID_t id, bool enabled) {
+	std::shared_lock guard(g_associated_hooks_mutex);
+	auto it = g_associated_hooks.find(id);
+	if (it == g_associated_hooks.end()) {
+		return false;
+	}
+	return it->second->SetTracing(enabled);
+}
+
+KHOOK_API bool GetAuditStats(HookID_t id, AuditStats& stats) {
+#ifdef KHOOK_AUDIT
+	std::shared_lock guard(g_associated_hooks_mutex);
+	auto it = g_associated_hooks.find(id);
+	if (it == g_associated_hooks.end()) {
+		return false;
+	}
+	auto& audit = it->second->_audit;
+	stats.calls = audit.calls.load(std::memory_order_relaxed);
+	stats.allocations = audit.allocations.load(std::memory_order_relaxed);
+	stats.deallocations = audit.deallocations.load(std::memory_order_relaxed);
+	stats.locks = audit.locks.load(std::memory_order_relaxed);
+	stats.syscalls = audit.syscalls.load(std::memory_order_relaxed);
+	return true;
+#else
+	return false;
+#endif
+}
+
+KHOOK_API void ResetAuditStats() {
+#ifdef KHOOK_AUDIT
+	std::shared_lock guard(g_hooks_detour_mutex);
+	for (auto& it : g_hooks_detour) {
+		it.second->_audit.Reset();
+	}
+#endif
+}
+
+static void CollectMetrics(Metrics::Header& header, std::vector<Metrics::Capsule>& capsules) {
+	auto memory = GetMemoryStats();
+	header.pending_inserts = memory.pending_inserts;
+	header.pending_deletes = memory.pending_deletes;
+	header.code_mapped = memory.code_mapped;
+	header.code_used = memory.code_used;
+	header.code_fragmented = memory.code_fragmented;
+	header.detour_code = memory.detour_code;
+	header.callbacks = memory.callbacks;
+	header.table_bytes = memory.table_bytes;
+	header.dispatch_threads = memory.dispatch_threads;
+	header.dispatch_thread_bytes = memory.dispatch_thread_bytes;
+	header.hooked_instances = memory.hooked_instances;
+	header.instance_cleanups = memory.instance_cleanups;
+
+	// Counted from the hook table, the detours' own locks are left to the hooked calls
+	std::unordered_map<DetourCapsule*, std::uint32_t> hooks;
+	{
+		std::shared_lock guard(g_associated_hooks_mutex);
+		for (auto& it : g_associated_hooks) {
+			hooks[it.second]++;
+		}
+	}
+
+	std::shared_lock guard(g_hooks_detour_mutex);
+	capsules.reserve(g_hooks_detour.size());
+	for (auto& it : g_hooks_detour) {
+		auto detour = it.second.get();
+		Metrics::Capsule capsule = {};
+		capsule.function = reinterpret_cast<std::uintptr_t>(it.first);
+		auto found = hooks.find(detour);
+		capsule.hooks = (found != hooks.end()) ? found->second : 0;
+		if (detour->_stats) {
+			HookStats stats;
+			detour->_stats->Collect(stats);
+			capsule.sample_rate = stats.sample_rate;
+			capsule.calls = stats.calls;
+			capsule.supersedes = stats.supersedes;
+			capsule.overrides = stats.overrides;
+			capsule.cycles = stats.cycles;
+			std::memcpy(capsule.histogram, stats.histogram, sizeof(capsule.histogram));
+		}
+		capsules.push_back(capsule);
+	}
+}
+
+KHOOK_API bool StartMetricsExport(std::uint32_t interval_ms, std::size_t capacity) {
+	return g_metrics.Start(interval_ms, capacity, CollectMetrics);
+}
+
+KHOOK_API void StopMetricsExport() {
+	g_metrics.Stop();
+}
+
+KHOOK_API bool IsActive(HookID_t id) {
+	HookLifecycle lifecycle;
+	return g_lifecycles.Get(id, lifecycle) && lifecycle.active;
+}
+
+KHOOK_API bool WaitActive(HookID_t id, std::uint32_t timeout_ms) {
+	return g_lifecycles.WaitActive(id, timeout_ms);
+}
+
+KHOOK_API bool GetHookLifecycle(HookID_t id, HookLifecycle& lifecycle) {
+	return g_lifecycles.Get(id, lifecycle);
+}
+
+KHOOK_API void GetLifecycleStats(LifecycleStats& stats) {
+	g_lifecycles.Collect(stats);
+}
+
 KHOOK_API void* FindOriginal(void* function) {
 	std::shared_lock guard(g_hooks_detour_mutex);
 	auto it = g_hooks_detour.find(function);
@@ -8,6 +8,7 @@
 * ============================
 */
 #pragma once
+#include <atomic>
 #include <cstdint>
 #include <mutex>
 #include <shared_mutex>	
@@ -34,8 +35,13 @@
 #include "khook/asm/x86.hpp"
 #endif
 #include "khook.hpp"
+#include "stats.hpp"
+#include "audit.hpp"
+#include "trace.hpp"
+#include "unwind.hpp"
 
 namespace KHook {
+	struct SharedDispatcher;
 	// A general purpose, thread-safe, detour, it functions in a very straight foward manner :
 	//
 	// [   DETOUR START]
@@ -70,11 +76,26 @@ namespace KHook {
 			std::uintptr_t override_return_ptr;
 		};
 
-		bool InsertHook(HookID_t, const InsertHookDetails&);
-		void RemoveHook(HookID_t);
+		// A hook taken out of the callbacks, the calls in flight may still be calling it
+		struct RemovedHook {
+			HookID_t id;
+			std::uintptr_t hook_ptr;
+			std::uintptr_t hook_fn_remove;
+			// Once over, the hook can be told it's gone
+			std::uint64_t grace_period;
+			DetourCapsule* capsule;
+			// The detour didn't have it, its insertion is in flight and tells it instead
+			bool inserting;
+		};
+
+		// Neither waits for the calls in flight, they keep iterating the callbacks they started with
+		void InsertHook(HookID_t, const InsertHookDetails&);
+		// False if the hook isn't ours
+		bool RemoveHook(HookID_t, RemovedHook&);
+		// Frees the copies of the callbacks no call iterates anymore
+		void ReclaimCallbacks();
 
 		void* GetOriginal() {
-			std::shared_lock lock(_detour_mutex);
 			return reinterpret_cast<void*>(_original_function);
 		}
 
@@ -84,6 +105,7 @@ namespace KHook {
 				// Successfully detour'd the function
 				_safetyhook = std::move(result.value());
 				_original_function = reinterpret_cast<std::uintptr_t>(_safetyhook.original<void*>());
+				_function = reinterpret_cast<std::uintptr_t>(detour_address);
 				return true;
 			}
 			// Safetyhook setup failed
@@ -94,12 +116,20 @@ namespace KHook {
 			auto entry = vtable + index;
 			KHook::Memory::SetAccess(entry, sizeof(void*), KHook::Memory::Flags::EXECUTE | KHook::Memory::Flags::READ | KHook::Memory::Flags::WRITE);
 			_original_function = reinterpret_cast<std::uintptr_t>(*entry);
+			_function = reinterpret_cast<std::uintptr_t>(entry);
 			*entry = reinterpret_cast<void*>(_jit_func_ptr);
 			KHook::Memory::SetAccess(entry, sizeof(void*), KHook::Memory::Flags::EXECUTE | KHook::Memory::Flags::READ);
 			// There's no way to predict whether or not the above code will crash, just always return true
 			return true;
 		}
 
+		// Names our code for profilers, after the hooked function if name is nullptr
+		void RegisterCode(const char* name);
+
+		// Swaps the probe sites of our code for calls to the tracepoint callback, or back to NOPs.
+		// The code is patched in place, never rebuilt
+		bool SetTracing(bool enabled);
+
 	public:
 		struct LinkedList {
 			LinkedList(LinkedList* p, LinkedList* n) : prev(p), next(n) {
@@ -130,6 +160,22 @@ namespace KHook {
 				fn_make_return = details.fn_make_return;
 			}
 
+			// Everything but the links, copies share the stats
+			void CopyDetails(const LinkedList& hook) {
+				hook_ptr = hook.hook_ptr;
+				hook_fn_remove = hook.hook_fn_remove;
+
+				fn_make_pre = hook.fn_make_pre;
+				fn_make_post = hook.fn_make_post;
+
+				fn_make_call_original = hook.fn_make_call_original;
+				fn_make_return = hook.fn_make_return;
+
+				id = hook.id;
+				pre_stats = hook.pre_stats;
+				post_stats = hook.post_stats;
+			}
+
 			LinkedList* prev = nullptr;
 			LinkedList* next = nullptr;
 			std::uintptr_t hook_ptr;
@@ -140,25 +186,80 @@ namespace KHook {
 
 			std::uintptr_t fn_make_call_original;
 			std::uintptr_t fn_make_return;
+
+			HookID_t id = INVALID_HOOK;
+			// Time spent in the callbacks, only on instrumented detours
+			std::shared_ptr<PhaseStats> pre_stats;
+			std::shared_ptr<PhaseStats> post_stats;
+		};
+		// Copy of the callbacks calls iterate, never modified once published
+		struct CallbackList {
+			explicit CallbackList(const LinkedList* start);
+			~CallbackList() {
+				// The nodes go together, they mustn't unlink from each other
+				for (auto& node : nodes) {
+					node.prev = node.next = nullptr;
+				}
+			}
+
+			std::vector<LinkedList> nodes;
+			LinkedList* start = nullptr;
+			LinkedList* end = nullptr;
 		};
 		// Always safe to read
 		bool _in_deletion;
 
-		// Detour callbacks
-		std::shared_mutex _detour_mutex;
+		// Callbacks the calls start with, nullptr if there are none. Read inside an epoch, see Epochs
+		std::atomic<CallbackList*> _published;
 
-		// Everything below can only be modified if you own the mutex above
+		// Everything below can only be modified if you own the mutex below
+		std::mutex _callbacks_mutex;
 		std::unordered_map<HookID_t, std::unique_ptr<LinkedList>> _callbacks;
 		LinkedList* _start_callbacks;
 		LinkedList* _end_callbacks;
+		// What _published points to, and the copies it replaced that calls may still be iterating,
+		// along with the grace period after which they aren't
+		std::unique_ptr<CallbackList> _current;
+		std::vector<std::pair<std::uint64_t, std::unique_ptr<CallbackList>>> _retired;
+		// Copies the callbacks into a new CallbackList and publishes it, returns the grace period of the previous one
+		std::uint64_t PublishCallbacks();
+		// Frees the retired copies whose grace period is over
+		void FreeRetiredCallbacks();
 
 		// Detour business logic
+		// Shared code reads every capsule field through the capsule pointer, code_slot holds the address of the code
+		void Assemble(AsmJit& jit, bool shared, std::uintptr_t code_slot);
+#ifdef KHOOK_X64
+		SharedDispatcher* GetSharedDispatcher();
+#endif
+		// Dedicated code is assembled once per code key, new capsules copy it and patch their own addresses in
+		const AsmJit& GetTemplate(bool reachable);
+		// Identifies the capsules able to share the same code. Every capsule copies STACK_SAFETY_BUFFER bytes of stack
+		// whatever its signature, so only the instrumentation tells them apart
+		std::uint64_t CodeKey() const {
+			return (_stats != nullptr);
+		}
 		AsmJit _jit;
+		// Registered on construction if enabled, goes away before the code
+		UnwindInfo _unwind;
 		std::uintptr_t _jit_func_ptr;
 
 		// Detour details
 		std::uintptr_t _original_function;
+		// Address the detour was setup on, the vtable entry address for virtual hooks
+		std::uintptr_t _function;
 		std::uint32_t _stack_size;
+		// Only instrumented detours have them, decided on construction
+		std::unique_ptr<CapsuleStats> _stats;
+		// Read by the probe sites, the shared code's are enabled as soon as one of its capsules is traced
+		std::atomic<bool> _tracing;
+#ifdef KHOOK_X64
+		// Code we run if the entry thunk jumps to it, nullptr otherwise
+		SharedDispatcher* _dispatcher;
+#endif
+#ifdef KHOOK_AUDIT
+		AuditCounters _audit;
+#endif
 
 		// Detour library details
 		safetyhook::InlineHook _safetyhook;
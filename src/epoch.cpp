@@ -0,0 +1,96 @@
+#include "epoch.hpp"
+
+#include <chrono>
+#include <thread>
+
+namespace KHook {
+
+thread_local Epochs::ThreadState Epochs::_thread;
+
+Epochs::ThreadState::~ThreadState() {
+	if (record) {
+		record->used.store(false, std::memory_order_release);
+	}
+}
+
+Epochs::Record* Epochs::Acquire() {
+	for (auto record = _records.load(std::memory_order_acquire); record; record = record->next) {
+		bool used = false;
+		if (record->used.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+			return record;
+		}
+	}
+	auto record = new Record;
+	record->used.store(true, std::memory_order_relaxed);
+	record->next = _records.load(std::memory_order_relaxed);
+	while (!_records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) {
+	}
+	return record;
+}
+
+void Epochs::Enter(const void* scope) {
+	auto& thread = _thread;
+	if (thread.record == nullptr) {
+		thread.record = Acquire();
+	}
+	auto depth = thread.depth++;
+	// Sequentially consistent, the loads of the call can't be ordered before it.
+	// An epoch read too early only makes the call look older than it is
+	auto epoch = _epoch.load(std::memory_order_acquire);
+	if (depth < SLOTS) {
+		auto& slot = thread.record->slots[depth];
+		slot.scope.store(scope, std::memory_order_relaxed);
+		slot.epoch.store(epoch, std::memory_order_seq_cst);
+	} else if (depth == SLOTS) {
+		thread.record->overflow.store(epoch, std::memory_order_seq_cst);
+	}
+}
+
+void Epochs::Leave() {
+	auto& thread = _thread;
+	auto depth = --thread.depth;
+	if (depth < SLOTS) {
+		thread.record->slots[depth].epoch.store(0, std::memory_order_release);
+	} else if (depth == SLOTS) {
+		thread.record->overflow.store(0, std::memory_order_release);
+	}
+}
+
+std::uint64_t Epochs::Advance() {
+	// Calls announcing this epoch or a later one began after whatever was unpublished before this
+	return _epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+}
+
+bool Epochs::Passed(const void* scope, std::uint64_t grace_period, bool ignore_self) const {
+	auto self = (ignore_self) ? _thread.record : nullptr;
+	for (auto record = _records.load(std::memory_order_acquire); record; record = record->next) {
+		if (record == self) {
+			continue;
+		}
+		auto overflow = record->overflow.load(std::memory_order_seq_cst);
+		if (overflow != 0 && overflow < grace_period) {
+			return false;
+		}
+		for (auto& slot : record->slots) {
+			// The scope is stored before the epoch, a reused slot can only show a newer scope with an older epoch
+			auto epoch = slot.epoch.load(std::memory_order_seq_cst);
+			if (epoch != 0 && epoch < grace_period && slot.scope.load(std::memory_order_relaxed) == scope) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void Epochs::Wait(const void* scope, std::uint64_t grace_period, bool ignore_self) const {
+	// Most calls are short, the long ones aren't worth spinning for
+	for (int attempt = 0; !Passed(scope, grace_period, ignore_self); attempt++) {
+		if (attempt < 64) {
+			std::this_thread::yield();
+		} else {
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+	}
+}
+
+}
@@ -0,0 +1,64 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: ZLIB
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace KHook {
+	// Grace periods for what the hooked calls read without locks. Every thread announces, for each call it's in, the
+	// scope (detour) the call reads from and the epoch it began in. Whoever unpublishes something from a scope advances
+	// the epoch, and may free it once no thread announces an older call into that scope.
+	// Calls never wait on anything, only the threads waiting for a grace period do
+	class Epochs {
+	public:
+		// Bracket a call into a scope, before it reads anything published and once it's done with it.
+		// Calls must be left in the reverse order they were entered
+		void Enter(const void* scope);
+		void Leave();
+
+		// To call once something was unpublished, the returned grace period is over when every call in flight is
+		std::uint64_t Advance();
+		// Whether the grace period of the scope is over. The calling thread's own calls can be ignored, if it's
+		// removing from one of them it can't wait for itself
+		bool Passed(const void* scope, std::uint64_t grace_period, bool ignore_self = false) const;
+		// Blocks until the grace period of the scope is over
+		void Wait(const void* scope, std::uint64_t grace_period, bool ignore_self = false) const;
+
+	private:
+		// Nesting deeper than this is rare, the calls past it hold back every scope
+		static constexpr std::uint32_t SLOTS = 16;
+		struct Slot {
+			std::atomic<const void*> scope{nullptr};
+			// Epoch the call began in, 0 if the slot is free
+			std::atomic<std::uint64_t> epoch{0};
+		};
+		struct alignas(64) Record {
+			// One per nesting depth
+			Slot slots[SLOTS];
+			// Epoch the outermost call past the slots began in, 0 if there's none
+			std::atomic<std::uint64_t> overflow{0};
+			// Whether a thread owns the record, the records of exited threads are reused
+			std::atomic<bool> used{false};
+			Record* next = nullptr;
+		};
+		struct ThreadState {
+			~ThreadState();
+			Record* record = nullptr;
+			std::uint32_t depth = 0;
+		};
+		static thread_local ThreadState _thread;
+
+		Record* Acquire();
+
+		std::atomic<std::uint64_t> _epoch{1};
+		// Never freed, there's at most one per thread alive at once
+		std::atomic<Record*> _records{nullptr};
+	};
+}
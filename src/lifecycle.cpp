@@ -0,0 +1,109 @@
+#include "lifecycle.hpp"
+
+#include <chrono>
+
+namespace KHook {
+
+std::uint64_t HookLifecycles::Now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void HookLifecycles::Record(std::uint64_t* histogram, std::uint64_t from, std::uint64_t to) {
+	std::size_t bucket = 0;
+	for (std::uint64_t value = (to - from) >> 1; value != 0 && bucket < LIFECYCLE_HISTOGRAM_BUCKETS - 1; value >>= 1) {
+		bucket++;
+	}
+	histogram[bucket]++;
+}
+
+void HookLifecycles::Enqueued(HookID_t id, bool async) {
+	std::lock_guard guard(_mutex);
+	auto& entry = _entries[id];
+	entry.lifecycle = {};
+	entry.lifecycle.enqueued = Now();
+	entry.async = async;
+}
+
+void HookLifecycles::Activated(HookID_t id) {
+	{
+		std::lock_guard guard(_mutex);
+		auto it = _entries.find(id);
+		if (it == _entries.end()) {
+			return;
+		}
+		auto& lifecycle = it->second.lifecycle;
+		auto now = Now();
+		lifecycle.activated = now;
+		lifecycle.active = true;
+		if (it->second.async) {
+			_stats.inserts++;
+			Record(_stats.insert_histogram, lifecycle.enqueued, now);
+		}
+	}
+	_changed.notify_all();
+}
+
+void HookLifecycles::RemovalRequested(HookID_t id) {
+	std::lock_guard guard(_mutex);
+	auto it = _entries.find(id);
+	if (it != _entries.end() && it->second.lifecycle.removal_requested == 0) {
+		it->second.lifecycle.removal_requested = Now();
+	}
+}
+
+void HookLifecycles::Removed(HookID_t id) {
+	{
+		std::lock_guard guard(_mutex);
+		auto it = _entries.find(id);
+		if (it == _entries.end()) {
+			return;
+		}
+		auto requested = it->second.lifecycle.removal_requested;
+		if (requested != 0) {
+			_stats.removals++;
+			Record(_stats.remove_histogram, requested, Now());
+		}
+		_entries.erase(it);
+	}
+	_changed.notify_all();
+}
+
+void HookLifecycles::Clear() {
+	{
+		std::lock_guard guard(_mutex);
+		_entries.clear();
+	}
+	_changed.notify_all();
+}
+
+bool HookLifecycles::Get(HookID_t id, HookLifecycle& lifecycle) {
+	std::lock_guard guard(_mutex);
+	auto it = _entries.find(id);
+	if (it == _entries.end()) {
+		return false;
+	}
+	lifecycle = it->second.lifecycle;
+	return true;
+}
+
+void HookLifecycles::Collect(LifecycleStats& stats) {
+	std::lock_guard guard(_mutex);
+	stats = _stats;
+	stats.pending = 0;
+	for (auto& it : _entries) {
+		stats.pending += !it.second.lifecycle.active;
+	}
+}
+
+bool HookLifecycles::WaitActive(HookID_t id, std::uint32_t timeout_ms) {
+	std::unique_lock guard(_mutex);
+	bool active = false;
+	_changed.wait_for(guard, std::chrono::milliseconds(timeout_ms), [this, id, &active]() {
+		auto it = _entries.find(id);
+		active = (it != _entries.end() && it->second.lifecycle.active);
+		return active || it == _entries.end();
+	});
+	return active;
+}
+
+}
@@ -0,0 +1,53 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: ZLIB
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include "khook.hpp"
+
+namespace KHook {
+	// When every hook was asked for, activated and removed. Only touched while hooks are set up or removed,
+	// never by the hooked calls
+	class HookLifecycles {
+	public:
+		// A new hook, async if it goes through the insertion thread
+		void Enqueued(HookID_t id, bool async);
+		// The hook was inserted into its detour
+		void Activated(HookID_t id);
+		// An async removal was queued, the hook stays active until Removed
+		void RemovalRequested(HookID_t id);
+		// The hook is gone, whether it was ever active or not
+		void Removed(HookID_t id);
+		// Forgets every hook, waiters are woken up
+		void Clear();
+
+		bool Get(HookID_t id, HookLifecycle& lifecycle);
+		void Collect(LifecycleStats& stats);
+		// Returns false on timeout, or if the hook was removed or never existed
+		bool WaitActive(HookID_t id, std::uint32_t timeout_ms);
+
+	private:
+		struct Entry {
+			HookLifecycle lifecycle;
+			bool async;
+		};
+
+		static std::uint64_t Now();
+		static void Record(std::uint64_t* histogram, std::uint64_t from, std::uint64_t to);
+
+		std::mutex _mutex;
+		std::condition_variable _changed;
+		std::unordered_map<HookID_t, Entry> _entries;
+		LifecycleStats _stats = {};
+	};
+}
@@ -0,0 +1,118 @@
+#include "metrics.hpp"
+#include "khook.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace KHook {
+
+static_assert(Metrics::HISTOGRAM_BUCKETS == STATS_HISTOGRAM_BUCKETS);
+
+// Start of the fields rewritten by every update
+static constexpr std::size_t UPDATED_FIELDS = offsetof(Metrics::Header, update_ns);
+
+MetricsExport::~MetricsExport() {
+	Stop();
+}
+
+bool MetricsExport::Start(std::uint32_t interval_ms, std::size_t capacity, Collector collector) {
+#ifdef _WIN32
+	return false;
+#else
+	std::lock_guard guard(_mutex);
+	if (_block != nullptr || capacity == 0) {
+		return false;
+	}
+
+	// Same file shm_open("/khook-<pid>") would create, without pulling librt in
+	_path = "/dev/shm/khook-" + std::to_string(getpid());
+	int file = open(_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (file == -1) {
+		return false;
+	}
+	_size = sizeof(Metrics::Header) + capacity * sizeof(Metrics::Capsule);
+	void* view = (ftruncate(file, _size) == 0) ? mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+	// The mapping keeps the file alive
+	close(file);
+	if (view == MAP_FAILED) {
+		unlink(_path.c_str());
+		return false;
+	}
+
+	// The file is zero filled, sequence starts even
+	_block = reinterpret_cast<Metrics::Header*>(view);
+	std::memcpy(_block->magic, Metrics::BLOCK_MAGIC, sizeof(_block->magic));
+	_block->version = Metrics::BLOCK_VERSION;
+	_block->header_size = sizeof(Metrics::Header);
+	_block->capsule_size = sizeof(Metrics::Capsule);
+	_block->capacity = static_cast<std::uint32_t>(capacity);
+	_block->pointer_size = sizeof(void*);
+	_block->histogram_buckets = Metrics::HISTOGRAM_BUCKETS;
+
+	_interval_ms = (interval_ms != 0) ? interval_ms : 1;
+	_collector = std::move(collector);
+	_stop = false;
+	_thread = std::thread(&MetricsExport::Run, this);
+	return true;
+#endif
+}
+
+void MetricsExport::Stop() {
+#ifndef _WIN32
+	std::unique_lock guard(_mutex);
+	if (_block == nullptr) {
+		return;
+	}
+	_stop = true;
+	guard.unlock();
+	_wake.notify_all();
+	_thread.join();
+	guard.lock();
+
+	munmap(_block, _size);
+	unlink(_path.c_str());
+	_block = nullptr;
+	_collector = nullptr;
+#endif
+}
+
+void MetricsExport::Run() {
+	Metrics::Header header;
+	std::vector<Metrics::Capsule> capsules;
+	std::unique_lock guard(_mutex);
+	while (!_stop) {
+		guard.unlock();
+		capsules.clear();
+		std::memset(reinterpret_cast<std::uint8_t*>(&header) + UPDATED_FIELDS, 0, sizeof(header) - UPDATED_FIELDS);
+		_collector(header, capsules);
+		Publish(header, capsules);
+		guard.lock();
+		_wake.wait_for(guard, std::chrono::milliseconds(_interval_ms), [this]() { return _stop; });
+	}
+}
+
+void MetricsExport::Publish(Metrics::Header& header, std::vector<Metrics::Capsule>& capsules) {
+	header.update_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	header.interval_ms = _interval_ms;
+	std::size_t count = std::min<std::size_t>(capsules.size(), _block->capacity);
+	header.capsule_count = static_cast<std::uint32_t>(count);
+	header.dropped_capsules = capsules.size() - count;
+
+	// Seqlock, readers retry if the sequence changed or was odd while they copied
+	auto sequence = _block->sequence.load(std::memory_order_relaxed);
+	_block->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(reinterpret_cast<std::uint8_t*>(_block) + UPDATED_FIELDS, reinterpret_cast<std::uint8_t*>(&header) + UPDATED_FIELDS, sizeof(header) - UPDATED_FIELDS);
+	std::memcpy(reinterpret_cast<std::uint8_t*>(_block) + sizeof(Metrics::Header), capsules.data(), count * sizeof(Metrics::Capsule));
+	_block->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+}
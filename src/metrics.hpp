@@ -0,0 +1,52 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: ZLIB
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "khook/metrics.hpp"
+
+namespace KHook {
+	// Publishes the metrics into a shared memory block on its own thread, see khook/metrics.hpp for the layout.
+	// Collecting may take KHook's locks, only the copy into the block is done under the seqlock
+	class MetricsExport {
+	public:
+		// Fills everything below the header's sequence, and the capsules
+		using Collector = std::function<void(Metrics::Header& header, std::vector<Metrics::Capsule>& capsules)>;
+
+		~MetricsExport();
+
+		// Creates the block and starts publishing every interval_ms, false if it couldn't be created or already is
+		bool Start(std::uint32_t interval_ms, std::size_t capacity, Collector collector);
+		// The block is removed
+		void Stop();
+
+	private:
+		void Run();
+		void Publish(Metrics::Header& header, std::vector<Metrics::Capsule>& capsules);
+
+		// Guards _stop, and Start/Stop against each other
+		std::mutex _mutex;
+		std::condition_variable _wake;
+		bool _stop = false;
+		std::thread _thread;
+
+		std::uint32_t _interval_ms = 0;
+		Collector _collector;
+		Metrics::Header* _block = nullptr;
+		std::size_t _size = 0;
+		std::string _path;
+	};
+}
@@ -0,0 +1,224 @@
+#include "perf.hpp"
+#include "khook.hpp"
+
+#include <cstdlib>
+#include <ctime>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace KHook {
+
+#ifndef _WIN32
+// See tools/perf/Documentation/jitdump-specification.txt in the linux sources
+static constexpr std::uint32_t JITDUMP_MAGIC = 0x4A695444;
+static constexpr std::uint32_t JITDUMP_VERSION = 1;
+static constexpr std::uint32_t JIT_CODE_LOAD = 0;
+
+struct JitDumpHeader {
+	std::uint32_t magic;
+	std::uint32_t version;
+	std::uint32_t total_size;
+	std::uint32_t elf_mach;
+	std::uint32_t pad1;
+	std::uint32_t pid;
+	std::uint64_t timestamp;
+	std::uint64_t flags;
+};
+
+struct JitDumpCodeLoad {
+	std::uint32_t id;
+	std::uint32_t total_size;
+	std::uint64_t timestamp;
+	std::uint32_t pid;
+	std::uint32_t tid;
+	std::uint64_t vma;
+	std::uint64_t code_addr;
+	std::uint64_t code_size;
+	std::uint64_t code_index;
+	// Followed by the null terminated name and the code
+};
+
+// perf record uses the monotonic clock when told -k mono, which perf inject --jit requires
+static std::uint64_t MonotonicNanoseconds() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+PerfMap::~PerfMap() {
+	CloseMap();
+	CloseJitDump();
+}
+
+bool PerfMap::SetOutputs(std::uint8_t outputs) {
+	std::lock_guard guard(_mutex);
+	bool success = true;
+	if (outputs & PERF_MAP) {
+		success &= OpenMap();
+	} else {
+		CloseMap();
+	}
+	if (outputs & PERF_JITDUMP) {
+		success &= OpenJitDump();
+	} else {
+		CloseJitDump();
+	}
+	return success;
+}
+
+void PerfMap::Register(const void* code, std::size_t size, const std::string& name) {
+	std::lock_guard guard(_mutex);
+	auto start = reinterpret_cast<std::uintptr_t>(code);
+	auto& entry = _entries[start];
+	entry.size = size;
+	entry.name = name;
+	if (_map) {
+		WriteMap(start, entry);
+	}
+	if (_jitdump) {
+		WriteJitDump(start, entry);
+	}
+}
+
+void PerfMap::Unregister(const void* code) {
+	std::lock_guard guard(_mutex);
+	if (_entries.erase(reinterpret_cast<std::uintptr_t>(code)) != 0 && _map) {
+		RewriteMap();
+	}
+}
+
+void PerfMap::Clear() {
+	std::lock_guard guard(_mutex);
+	_entries.clear();
+	if (_map) {
+		RewriteMap();
+	}
+}
+
+bool PerfMap::OpenMap() {
+#ifdef _WIN32
+	return false;
+#else
+	if (_map) {
+		return true;
+	}
+	_map_path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+	_map = std::fopen(_map_path.c_str(), "w");
+	if (_map == nullptr) {
+		return false;
+	}
+	for (auto& it : _entries) {
+		WriteMap(it.first, it.second);
+	}
+	return true;
+#endif
+}
+
+void PerfMap::CloseMap() {
+	if (_map) {
+		std::fclose(_map);
+		_map = nullptr;
+	}
+}
+
+void PerfMap::WriteMap(std::uintptr_t start, const Entry& entry) {
+	std::fprintf(_map, "%llx %llx %s\n", static_cast<unsigned long long>(start), static_cast<unsigned long long>(entry.size), entry.name.c_str());
+	std::fflush(_map);
+}
+
+void PerfMap::RewriteMap() {
+	// The new content replaces the old one at once, perf never reads a partial file
+	std::string temp_path = _map_path + ".tmp";
+	std::FILE* temp = std::fopen(temp_path.c_str(), "w");
+	if (temp == nullptr) {
+		return;
+	}
+	std::fclose(_map);
+	_map = temp;
+	for (auto& it : _entries) {
+		WriteMap(it.first, it.second);
+	}
+	std::rename(temp_path.c_str(), _map_path.c_str());
+}
+
+bool PerfMap::OpenJitDump() {
+#ifdef _WIN32
+	return false;
+#else
+	if (_jitdump) {
+		return true;
+	}
+	const char* directory = std::getenv("JITDUMPDIR");
+	std::string path = std::string((directory != nullptr) ? directory : "/tmp") + "/jit-" + std::to_string(getpid()) + ".dump";
+	_jitdump = std::fopen(path.c_str(), "w+");
+	if (_jitdump == nullptr) {
+		return false;
+	}
+
+	JitDumpHeader header = {};
+	header.magic = JITDUMP_MAGIC;
+	header.version = JITDUMP_VERSION;
+	header.total_size = sizeof(header);
+#if defined(__x86_64__)
+	header.elf_mach = 62; // EM_X86_64
+#else
+	header.elf_mach = 3; // EM_386
+#endif
+	header.pid = static_cast<std::uint32_t>(getpid());
+	header.timestamp = MonotonicNanoseconds();
+	std::fwrite(&header, sizeof(header), 1, _jitdump);
+	std::fflush(_jitdump);
+
+	// The executable mapping is what makes perf record notice the file
+	_jitdump_marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(_jitdump), 0);
+	if (_jitdump_marker == MAP_FAILED) {
+		_jitdump_marker = nullptr;
+		CloseJitDump();
+		return false;
+	}
+
+	for (auto& it : _entries) {
+		WriteJitDump(it.first, it.second);
+	}
+	return true;
+#endif
+}
+
+void PerfMap::CloseJitDump() {
+#ifndef _WIN32
+	if (_jitdump_marker) {
+		munmap(_jitdump_marker, sysconf(_SC_PAGESIZE));
+		_jitdump_marker = nullptr;
+	}
+#endif
+	if (_jitdump) {
+		std::fclose(_jitdump);
+		_jitdump = nullptr;
+	}
+}
+
+void PerfMap::WriteJitDump(std::uintptr_t start, const Entry& entry) {
+#ifndef _WIN32
+	JitDumpCodeLoad record = {};
+	record.id = JIT_CODE_LOAD;
+	record.total_size = static_cast<std::uint32_t>(sizeof(record) + entry.name.size() + 1 + entry.size);
+	record.timestamp = MonotonicNanoseconds();
+	record.pid = static_cast<std::uint32_t>(getpid());
+	record.tid = static_cast<std::uint32_t>(syscall(SYS_gettid));
+	record.vma = start;
+	record.code_addr = start;
+	record.code_size = entry.size;
+	record.code_index = _code_index++;
+	std::fwrite(&record, sizeof(record), 1, _jitdump);
+	std::fwrite(entry.name.c_str(), entry.name.size() + 1, 1, _jitdump);
+	std::fwrite(reinterpret_cast<const void*>(start), entry.size, 1, _jitdump);
+	std::fflush(_jitdump);
+#endif
+}
+
+}
@@ -0,0 +1,57 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: ZLIB
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace KHook {
+	// Names the generated code for perf, through /tmp/perf-<pid>.map and/or a jitdump file.
+	// Code is always registered, so enabling an output later still describes everything alive
+	class PerfMap {
+	public:
+		~PerfMap();
+
+		// outputs is a combination of PerfOutput, returns false if a file couldn't be created
+		bool SetOutputs(std::uint8_t outputs);
+
+		void Register(const void* code, std::size_t size, const std::string& name);
+		// The map file is rewritten without it, jitdump has no record for unloaded code
+		void Unregister(const void* code);
+		// Forgets everything at once, the map file is emptied
+		void Clear();
+
+	private:
+		struct Entry {
+			std::size_t size;
+			std::string name;
+		};
+
+		// Must own the mutex
+		bool OpenMap();
+		void CloseMap();
+		void WriteMap(std::uintptr_t start, const Entry& entry);
+		void RewriteMap();
+		bool OpenJitDump();
+		void CloseJitDump();
+		void WriteJitDump(std::uintptr_t start, const Entry& entry);
+
+		std::mutex _mutex;
+		std::map<std::uintptr_t, Entry> _entries;
+		std::FILE* _map = nullptr;
+		std::string _map_path;
+		std::FILE* _jitdump = nullptr;
+		// perf finds the jitdump file through this mapping
+		void* _jitdump_marker = nullptr;
+		std::uint64_t _code_index = 0;
+	};
+}
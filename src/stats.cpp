@@ -0,0 +1,130 @@
+#include "stats.hpp"
+
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+namespace KHook {
+
+std::uint64_t CapsuleStats::EntryTimestamp() {
+	return __rdtsc();
+}
+
+std::uint64_t CapsuleStats::ExitTimestamp() {
+	unsigned int aux;
+	return __rdtscp(&aux);
+}
+
+std::size_t PhaseStats::BucketOf(std::uint64_t cycles) {
+	if (cycles < SUB_BUCKETS) {
+		return static_cast<std::size_t>(cycles);
+	}
+	std::size_t octave = 3;
+	while (octave < MAX_OCTAVE && (cycles >> (octave + 1)) != 0) {
+		octave++;
+	}
+	if (octave == MAX_OCTAVE) {
+		return BUCKETS - 1;
+	}
+	std::size_t sub = static_cast<std::size_t>(cycles >> (octave - 3)) & (SUB_BUCKETS - 1);
+	return (octave - 2) * SUB_BUCKETS + sub;
+}
+
+std::uint64_t PhaseStats::ValueOf(std::size_t bucket) {
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+	std::size_t octave = bucket / SUB_BUCKETS + 2;
+	std::uint64_t width = std::uint64_t(1) << (octave - 3);
+	return (SUB_BUCKETS + bucket % SUB_BUCKETS) * width + width / 2;
+}
+
+void PhaseStats::Record(std::uint64_t cycles, std::uint32_t weight) {
+	_cycles.fetch_add(cycles * weight, std::memory_order_relaxed);
+	_buckets[BucketOf(cycles)].fetch_add(weight, std::memory_order_relaxed);
+}
+
+void PhaseStats::Collect(CallbackStats& stats) const {
+	std::uint64_t counts[BUCKETS];
+	std::uint64_t total = 0;
+	for (std::size_t i = 0; i < BUCKETS; i++) {
+		counts[i] = _buckets[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+	stats.calls = total;
+	stats.cycles = _cycles.load(std::memory_order_relaxed);
+
+	// Smallest bucket reaching each rank
+	std::uint64_t* percentiles[] = { &stats.p50, &stats.p99, &stats.p999 };
+	const double ranks[] = { 0.5, 0.99, 0.999 };
+	std::uint64_t seen = 0;
+	std::size_t next = 0;
+	for (std::size_t i = 0; i < BUCKETS && next < 3; i++) {
+		seen += counts[i];
+		while (next < 3 && total != 0 && seen >= ranks[next] * total) {
+			*percentiles[next++] = ValueOf(i);
+		}
+	}
+	for (; next < 3; next++) {
+		*percentiles[next] = 0;
+	}
+}
+
+std::size_t CapsuleStats::ThreadSlot() {
+	static std::atomic<std::size_t> next_slot = 0;
+	static thread_local std::size_t slot = next_slot++ % THREAD_SLOTS;
+	return slot;
+}
+
+bool CapsuleStats::Sample() {
+	auto rate = SampleRate();
+	if (rate == 1) {
+		return true;
+	}
+	// The slot is the thread's own unless there are more threads than slots, then sampling is only approximate
+	auto& countdown = _slots[ThreadSlot()].countdown;
+	auto left = countdown.load(std::memory_order_relaxed);
+	if (left > 1 && left <= rate) {
+		countdown.store(left - 1, std::memory_order_relaxed);
+		return false;
+	}
+	countdown.store(rate, std::memory_order_relaxed);
+	return true;
+}
+
+void CapsuleStats::Record(std::uint64_t cycles, Action action) {
+	std::size_t bucket = 0;
+	for (std::uint64_t value = cycles >> 1; value != 0 && bucket < STATS_HISTOGRAM_BUCKETS - 1; value >>= 1) {
+		bucket++;
+	}
+
+	// Relaxed, readers only need every counter to be eventually accurate
+	std::uint64_t weight = SampleRate();
+	auto& slot = _slots[ThreadSlot()];
+	slot.calls.fetch_add(weight, std::memory_order_relaxed);
+	if (action == Action::Supersede) {
+		slot.supersedes.fetch_add(weight, std::memory_order_relaxed);
+	} else if (action == Action::Override) {
+		slot.overrides.fetch_add(weight, std::memory_order_relaxed);
+	}
+	slot.cycles.fetch_add(cycles * weight, std::memory_order_relaxed);
+	slot.histogram[bucket].fetch_add(weight, std::memory_order_relaxed);
+}
+
+void CapsuleStats::Collect(HookStats& stats) const {
+	stats = {};
+	stats.sample_rate = SampleRate();
+	for (auto& slot : _slots) {
+		stats.calls += slot.calls.load(std::memory_order_relaxed);
+		stats.supersedes += slot.supersedes.load(std::memory_order_relaxed);
+		stats.overrides += slot.overrides.load(std::memory_order_relaxed);
+		stats.cycles += slot.cycles.load(std::memory_order_relaxed);
+		for (std::size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+			stats.histogram[i] += slot.histogram[i].load(std::memory_order_relaxed);
+		}
+	}
+}
+
+}
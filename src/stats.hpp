@@ -0,0 +1,83 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: ZLIB
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+#include "khook.hpp"
+
+namespace KHook {
+	// Cycles distribution of one phase of the hooked calls, log-linear buckets give percentiles within 1/8 of the value
+	class PhaseStats {
+	public:
+		// A sampled call stands for weight calls
+		void Record(std::uint64_t cycles, std::uint32_t weight);
+		// Fills calls, cycles and the percentiles
+		void Collect(CallbackStats& stats) const;
+
+	private:
+		static constexpr std::size_t SUB_BUCKETS = 8;
+		// Values of 2^MAX_OCTAVE cycles or more share the last bucket
+		static constexpr std::size_t MAX_OCTAVE = 40;
+		static constexpr std::size_t BUCKETS = (MAX_OCTAVE - 2) * SUB_BUCKETS;
+
+		static std::size_t BucketOf(std::uint64_t cycles);
+		// Middle of the bucket range
+		static std::uint64_t ValueOf(std::size_t bucket);
+
+		std::atomic<std::uint64_t> _cycles{0};
+		std::atomic<std::uint64_t> _buckets[BUCKETS] = {};
+	};
+
+	// Statistics of an instrumented detour, written by the hooked threads and read concurrently
+	class CapsuleStats {
+	public:
+		// Threads are spread over that many slots, threads sharing one are still accounted correctly
+		static constexpr std::size_t THREAD_SLOTS = 16;
+
+		// Timestamp counter, the exit read waits for the previous instructions to complete
+		static std::uint64_t EntryTimestamp();
+		static std::uint64_t ExitTimestamp();
+
+		// Whether the calling thread's next call is timed, one in every SampleRate() calls is
+		bool Sample();
+		std::uint32_t SampleRate() const {
+			return _sample_rate.load(std::memory_order_relaxed);
+		}
+		// Takes effect on the next calls, the code is left untouched
+		void SetSampleRate(std::uint32_t rate) {
+			_sample_rate.store((rate != 0) ? rate : 1, std::memory_order_relaxed);
+		}
+
+		// Sampled calls are accounted SampleRate() times
+		void Record(std::uint64_t cycles, Action action);
+		void Collect(HookStats& stats) const;
+
+		// Time spent in the original function
+		PhaseStats original;
+
+	private:
+		// One cache line apart, so threads never write to the same line
+		struct alignas(64) Slot {
+			std::atomic<std::uint64_t> calls{0};
+			std::atomic<std::uint64_t> supersedes{0};
+			std::atomic<std::uint64_t> overrides{0};
+			std::atomic<std::uint64_t> cycles{0};
+			std::atomic<std::uint64_t> histogram[STATS_HISTOGRAM_BUCKETS] = {};
+			// Calls left before the next sampled one
+			std::atomic<std::uint32_t> countdown{0};
+		};
+
+		static std::size_t ThreadSlot();
+
+		std::atomic<std::uint32_t> _sample_rate{1};
+		Slot _slots[THREAD_SLOTS];
+	};
+}
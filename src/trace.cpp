@@ -0,0 +1,212 @@
+#include "trace.hpp"
+#include "stats.hpp"
+#include "audit.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace KHook {
+
+static std::uint64_t SteadyNanoseconds() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::uint64_t CurrentThreadId() {
+#ifdef _WIN32
+	return GetCurrentThreadId();
+#else
+	return static_cast<std::uint64_t>(syscall(SYS_gettid));
+#endif
+}
+
+bool TraceBuffers::Start(std::size_t records_per_thread, std::size_t threads) {
+	std::lock_guard guard(_mutex);
+	if (_rings.load(std::memory_order_relaxed) == nullptr) {
+		if (records_per_thread == 0 || threads == 0) {
+			return false;
+		}
+		// Power of two, so the ring index is a mask of the sequence number
+		std::size_t capacity = 1;
+		while (capacity < records_per_thread) {
+			capacity <<= 1;
+		}
+		auto rings = new (std::nothrow) Ring[threads];
+		auto slots = new (std::nothrow) Slot[capacity * threads];
+		if (rings == nullptr || slots == nullptr) {
+			delete[] rings;
+			delete[] slots;
+			return false;
+		}
+		for (std::size_t i = 0; i < capacity * threads; i++) {
+			slots[i].sequence.store(0, std::memory_order_relaxed);
+		}
+		for (std::size_t i = 0; i < threads; i++) {
+			rings[i].slots = slots + i * capacity;
+		}
+		_ring_count = threads;
+		_capacity = capacity;
+		_start_ticks = CapsuleStats::EntryTimestamp();
+		_start_ns = SteadyNanoseconds();
+		_rings.store(rings, std::memory_order_release);
+	}
+	_enabled.store(true, std::memory_order_release);
+	return true;
+}
+
+TraceBuffers::Ring* TraceBuffers::ThreadRing() {
+	static thread_local Ring* ring = nullptr;
+	static thread_local bool claimed = false;
+	if (!claimed) {
+		claimed = true;
+		auto rings = _rings.load(std::memory_order_acquire);
+		std::size_t index = _claimed.fetch_add(1, std::memory_order_relaxed);
+		if (rings == nullptr || index >= _ring_count) {
+			_untraced_threads.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		ring = &rings[index];
+		Audit::Syscall();
+		ring->thread.store(CurrentThreadId(), std::memory_order_relaxed);
+	}
+	return ring;
+}
+
+Trace::Record* TraceBuffers::Begin() {
+	auto ring = ThreadRing();
+	if (ring == nullptr) {
+		return nullptr;
+	}
+	auto head = ring->head.load(std::memory_order_relaxed);
+	auto& slot = ring->slots[head & (_capacity - 1)];
+	// Readers seeing 0 know the record is being overwritten
+	slot.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	return &slot.record;
+}
+
+void TraceBuffers::Commit() {
+	auto ring = ThreadRing();
+	auto head = ring->head.load(std::memory_order_relaxed);
+	ring->slots[head & (_capacity - 1)].sequence.store(head + 1, std::memory_order_release);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool TraceBuffers::Dump(const char* path) {
+	std::lock_guard guard(_mutex);
+	auto rings = _rings.load(std::memory_order_acquire);
+	if (rings == nullptr) {
+		return false;
+	}
+
+	// Everything recorded from now on is left for the next dump
+	std::size_t ring_count = std::min(_claimed.load(std::memory_order_relaxed), _ring_count);
+	struct Range {
+		Ring* ring;
+		std::uint64_t first;
+		std::uint64_t head;
+	};
+	std::vector<Range> ranges;
+	ranges.reserve(ring_count);
+	std::size_t size = sizeof(Trace::FileHeader);
+	for (std::size_t i = 0; i < ring_count; i++) {
+		auto head = rings[i].head.load(std::memory_order_acquire);
+		auto first = std::max<std::uint64_t>(rings[i].tail, (head > _capacity) ? head - _capacity : 0);
+		ranges.push_back({ &rings[i], first, head });
+		size += sizeof(Trace::RingHeader) + (head - first) * sizeof(Trace::Record);
+	}
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<std::uint64_t>(size) >> 32), static_cast<DWORD>(size), nullptr);
+	void* view = (mapping != nullptr) ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size) : nullptr;
+	if (view == nullptr) {
+		if (mapping != nullptr) {
+			CloseHandle(mapping);
+		}
+		CloseHandle(file);
+		return false;
+	}
+#else
+	int file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file == -1) {
+		return false;
+	}
+	void* view = (ftruncate(file, size) == 0) ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+	if (view == MAP_FAILED) {
+		close(file);
+		return false;
+	}
+#endif
+	auto out = reinterpret_cast<std::uint8_t*>(view);
+
+	Trace::FileHeader header = {};
+	std::memcpy(header.magic, Trace::FILE_MAGIC, sizeof(header.magic));
+	header.version = Trace::FILE_VERSION;
+	header.header_size = sizeof(Trace::FileHeader);
+	header.ring_header_size = sizeof(Trace::RingHeader);
+	header.record_size = sizeof(Trace::Record);
+	header.ring_count = static_cast<std::uint32_t>(ring_count);
+	header.pointer_size = sizeof(void*);
+	header.start_ticks = _start_ticks;
+	header.start_ns = _start_ns;
+	header.dump_ticks = CapsuleStats::EntryTimestamp();
+	header.dump_ns = SteadyNanoseconds();
+	header.untraced_threads = _untraced_threads.load(std::memory_order_relaxed);
+	std::memcpy(out, &header, sizeof(header));
+	out += sizeof(header);
+
+	for (auto& range : ranges) {
+		Trace::RingHeader ring_header = {};
+		ring_header.thread = range.ring->thread.load(std::memory_order_relaxed);
+		ring_header.first = range.first;
+		ring_header.count = range.head - range.first;
+		ring_header.overwritten = range.first - range.ring->tail;
+		auto records = reinterpret_cast<Trace::Record*>(out + sizeof(ring_header));
+		for (std::uint64_t sequence = range.first; sequence < range.head; sequence++) {
+			auto& slot = range.ring->slots[sequence & (_capacity - 1)];
+			auto& record = records[sequence - range.first];
+			// The owning thread may lap us while we copy, such records are discarded
+			auto before = slot.sequence.load(std::memory_order_acquire);
+			std::memcpy(&record, &slot.record, sizeof(record));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			auto after = slot.sequence.load(std::memory_order_relaxed);
+			if (before != sequence + 1 || after != before) {
+				std::memset(&record, 0, sizeof(record));
+				record.event = Trace::Event::Lost;
+				ring_header.overwritten++;
+			}
+		}
+		std::memcpy(out, &ring_header, sizeof(ring_header));
+		out += sizeof(ring_header) + ring_header.count * sizeof(Trace::Record);
+		range.ring->tail = range.head;
+	}
+
+#ifdef _WIN32
+	bool flushed = FlushViewOfFile(view, size) != 0;
+	UnmapViewOfFile(view);
+	CloseHandle(mapping);
+	CloseHandle(file);
+	return flushed;
+#else
+	munmap(view, size);
+	return close(file) == 0;
+#endif
+}
+
+}
@@ -0,0 +1,70 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: ZLIB
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "khook/trace.hpp"
+
+namespace KHook {
+	// Per thread ring buffers of Trace::Record, every thread writes to its own ring without locking nor allocating.
+	// The rings are allocated when tracing first starts and never freed, hooked threads may write to them at any time
+	class TraceBuffers {
+	public:
+		// Allocates the rings on the first call, later calls only resume recording
+		bool Start(std::size_t records_per_thread, std::size_t threads);
+		void Stop() {
+			_enabled.store(false, std::memory_order_relaxed);
+		}
+		bool Enabled() const {
+			return _enabled.load(std::memory_order_acquire);
+		}
+
+		// Returns the record to fill, or nullptr if the calling thread has no ring.
+		// It's published by Commit, which must be called before the thread records anything else
+		Trace::Record* Begin();
+		void Commit();
+
+		// Writes every record since the previous dump, see khook/trace.hpp for the layout
+		bool Dump(const char* path);
+
+	private:
+		struct Slot {
+			// Sequence number of the record + 1, 0 while it's being written
+			std::atomic<std::uint64_t> sequence;
+			Trace::Record record;
+		};
+
+		struct Ring {
+			std::atomic<std::uint64_t> thread{0};
+			// Records written so far, only the owning thread writes it
+			std::atomic<std::uint64_t> head{0};
+			// Records dumped so far, only Dump touches it
+			std::uint64_t tail = 0;
+			Slot* slots = nullptr;
+		};
+
+		// The calling thread's ring, claimed on its first record
+		Ring* ThreadRing();
+
+		std::atomic<bool> _enabled{false};
+		// Set once, before _enabled
+		std::atomic<Ring*> _rings{nullptr};
+		std::size_t _ring_count = 0;
+		std::size_t _capacity = 0;
+		std::atomic<std::size_t> _claimed{0};
+		std::atomic<std::uint64_t> _untraced_threads{0};
+		std::uint64_t _start_ticks = 0;
+		std::uint64_t _start_ns = 0;
+
+		std::mutex _mutex;
+	};
+}
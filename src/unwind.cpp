@@ -0,0 +1,146 @@
+#include "unwind.hpp"
+
+#include <cstring>
+
+#ifndef _WIN32
+// libgcc, the whole section is registered at once
+extern "C" void __register_frame(void* begin);
+extern "C" void __deregister_frame(void* begin);
+#endif
+
+namespace KHook {
+
+#ifndef _WIN32
+// See the DWARF 4 specification section 6.4, and the LSB for the .eh_frame differences
+static constexpr std::uint8_t DW_CFA_advance_loc4 = 0x04;
+static constexpr std::uint8_t DW_CFA_same_value = 0x08;
+static constexpr std::uint8_t DW_CFA_def_cfa = 0x0c;
+static constexpr std::uint8_t DW_CFA_offset = 0x80;
+static constexpr std::uint8_t DW_CFA_nop = 0x00;
+static constexpr std::uint8_t DW_EH_PE_absptr = 0x00;
+
+class FrameWriter {
+public:
+	void Byte(std::uint8_t value) {
+		_data.push_back(value);
+	}
+
+	template<typename T>
+	void Value(T value) {
+		auto size = _data.size();
+		_data.resize(size + sizeof(T));
+		std::memcpy(_data.data() + size, &value, sizeof(T));
+	}
+
+	void Unsigned(std::uint64_t value) {
+		do {
+			std::uint8_t byte = value & 0x7F;
+			value >>= 7;
+			Byte((value != 0) ? (byte | 0x80) : byte);
+		} while (value != 0);
+	}
+
+	void Signed(std::int64_t value) {
+		bool more = true;
+		while (more) {
+			std::uint8_t byte = value & 0x7F;
+			value >>= 7;
+			more = !((value == 0 && (byte & 0x40) == 0) || (value == -1 && (byte & 0x40) != 0));
+			Byte(more ? (byte | 0x80) : byte);
+		}
+	}
+
+	// Starts an entry, returns where its length goes
+	std::size_t Begin() {
+		auto start = _data.size();
+		Value<std::uint32_t>(0);
+		return start;
+	}
+
+	// Pads the entry to the pointer size and writes its length
+	void End(std::size_t start) {
+		while ((_data.size() - start) % sizeof(void*) != 0) {
+			Byte(DW_CFA_nop);
+		}
+		std::uint32_t length = static_cast<std::uint32_t>(_data.size() - start - sizeof(std::uint32_t));
+		std::memcpy(_data.data() + start, &length, sizeof(length));
+	}
+
+	std::size_t Size() const {
+		return _data.size();
+	}
+
+	const std::vector<std::uint8_t>& Data() const {
+		return _data;
+	}
+
+private:
+	std::vector<std::uint8_t> _data;
+};
+#endif
+
+bool UnwindInfo::Register(const void* code, std::size_t size, const std::vector<Asm::GenBuffer::UnwindRow>& rows) {
+	Deregister();
+#ifdef _WIN32
+	return false;
+#else
+	static constexpr std::int32_t data_alignment = -static_cast<std::int32_t>(sizeof(void*));
+	FrameWriter writer;
+
+	// CIE, the state at the first instruction: the return address was just pushed
+	auto cie = writer.Begin();
+	writer.Value<std::uint32_t>(0); // CIE id
+	writer.Byte(1); // Version
+	writer.Byte('z'); writer.Byte('R'); writer.Byte('\0');
+	writer.Unsigned(1); // Code alignment
+	writer.Signed(data_alignment);
+	writer.Byte(RETURN_ADDRESS);
+	writer.Unsigned(1); // Augmentation data size
+	writer.Byte(DW_EH_PE_absptr);
+	writer.Byte(DW_CFA_def_cfa); writer.Unsigned(STACK_POINTER); writer.Unsigned(sizeof(void*));
+	writer.Byte(DW_CFA_offset | RETURN_ADDRESS); writer.Unsigned(1);
+	writer.End(cie);
+
+	// FDE, one row after the other
+	auto fde = writer.Begin();
+	writer.Value<std::uint32_t>(static_cast<std::uint32_t>(writer.Size() - cie)); // Back to the CIE
+	writer.Value<std::uintptr_t>(reinterpret_cast<std::uintptr_t>(code));
+	writer.Value<std::uintptr_t>(size);
+	writer.Unsigned(0); // Augmentation data size
+	std::uint32_t location = 0;
+	for (auto& row : rows) {
+		if (row.offset != location) {
+			writer.Byte(DW_CFA_advance_loc4);
+			writer.Value<std::uint32_t>(row.offset - location);
+			location = row.offset;
+		}
+		writer.Byte(DW_CFA_def_cfa); writer.Unsigned(row.cfaReg); writer.Unsigned(row.cfaOffset);
+		if (row.fpOffset != 0) {
+			writer.Byte(DW_CFA_offset | FRAME_POINTER); writer.Unsigned(row.fpOffset / data_alignment);
+		} else {
+			writer.Byte(DW_CFA_same_value); writer.Unsigned(FRAME_POINTER);
+		}
+	}
+	writer.End(fde);
+
+	// Terminator
+	writer.Value<std::uint32_t>(0);
+
+	auto& data = writer.Data();
+	_eh_frame = std::make_unique<std::uint64_t[]>((data.size() + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t));
+	std::memcpy(_eh_frame.get(), data.data(), data.size());
+	__register_frame(_eh_frame.get());
+	return true;
+#endif
+}
+
+void UnwindInfo::Deregister() {
+#ifndef _WIN32
+	if (_eh_frame) {
+		__deregister_frame(_eh_frame.get());
+		_eh_frame.reset();
+	}
+#endif
+}
+
+}
@@ -0,0 +1,52 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: ZLIB
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "khook/asm.hpp"
+
+namespace KHook {
+	// Describes generated code to the unwinder of the process, through an .eh_frame built from the rows of the code.
+	// The code must stay alive until Deregister, which is called on destruction.
+	// Only implemented where libgcc's frame registration exists, it does nothing on Windows
+	class UnwindInfo {
+	public:
+#if defined(__x86_64__) || defined(_WIN64)
+		// DWARF register numbers
+		static constexpr std::uint8_t STACK_POINTER = 7;
+		static constexpr std::uint8_t FRAME_POINTER = 6;
+		static constexpr std::uint8_t RETURN_ADDRESS = 16;
+#else
+		static constexpr std::uint8_t STACK_POINTER = 4;
+		static constexpr std::uint8_t FRAME_POINTER = 5;
+		static constexpr std::uint8_t RETURN_ADDRESS = 8;
+#endif
+
+		UnwindInfo() = default;
+		UnwindInfo(const UnwindInfo&) = delete;
+		UnwindInfo& operator=(const UnwindInfo&) = delete;
+		~UnwindInfo() {
+			Deregister();
+		}
+
+		// Without rows, the code is described as never touching the stack
+		bool Register(const void* code, std::size_t size, const std::vector<Asm::GenBuffer::UnwindRow>& rows);
+		void Deregister();
+		bool Registered() const {
+			return _eh_frame != nullptr;
+		}
+
+	private:
+		// The unwinder reads it until deregistration, it's 8 bytes aligned
+		std::unique_ptr<std::uint64_t[]> _eh_frame;
+	};
+}
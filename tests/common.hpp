@@ -0,0 +1,61 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+#pragma once
+// Helpers shared by the tests
+
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+#include "khook.hpp"
+
+// Aborts the test with the failed condition, unlike assert it's kept in release builds
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			std::abort(); \
+		} \
+	} while (0)
+
+// Virtual hook whose setup can be handed to SetupHooks
+template<typename CLASS, typename RETURN, typename... ARGS>
+class BulkVirtual : public KHook::Virtual<CLASS, RETURN, ARGS...> {
+	using Base = KHook::Virtual<CLASS, RETURN, ARGS...>;
+public:
+	using Base::Base;
+
+	KHook::HookSetup Setup(CLASS* object, bool async) {
+		{
+			std::lock_guard guard(this->_m_hooked_this);
+			this->_hooked_this.insert(object);
+		}
+		KHook::HookSetup setup = {};
+		setup.vtable = *reinterpret_cast<void***>(object);
+		setup.index = this->_vtbl_index;
+		setup.context = this;
+		setup.removed_function = KHook::ExtractMFP(&BulkVirtual::_KHook_RemovedHook);
+		setup.pre = KHook::ExtractMFP(&BulkVirtual::_KHook_Callback_PRE);
+		setup.post = KHook::ExtractMFP(&BulkVirtual::_KHook_Callback_POST);
+		setup.make_return = KHook::ExtractMFP(&BulkVirtual::_KHook_MakeReturn);
+		setup.make_call_original = KHook::ExtractMFP(&BulkVirtual::_KHook_MakeOriginalCall);
+		setup.async = async;
+		return setup;
+	}
+
+	// Once SetupHooks filled the id, so the hook is removed with this object
+	void Created(const KHook::HookSetup& setup) {
+		if (setup.id != KHook::INVALID_HOOK) {
+			std::lock_guard guard(this->_hooks_stored);
+			this->_hook_ids_addr[setup.id] = setup.vtable[setup.index];
+			this->_addr_hook_ids[setup.vtable[setup.index]] = setup.id;
+		}
+	}
+};
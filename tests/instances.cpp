@@ -0,0 +1,62 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Instances added to Virtual hooks, and those their cleanup detour removed, are reported by GetMemoryStats
+
+#include "common.hpp"
+
+class Target {
+public:
+	virtual ~Target() {}
+	virtual int Method(int a) { return a; }
+};
+
+KHook::Return<int> Pre(Target*, int) {
+	return { KHook::Action::Ignore, 0 };
+}
+
+#ifdef _WIN32
+// Scalar deleting destructor
+constexpr std::int32_t DELETING_DESTRUCTOR = 0;
+#else
+// After the complete destructor
+constexpr std::int32_t DELETING_DESTRUCTOR = 1;
+#endif
+
+int main() {
+	auto hook = new KHook::Virtual<Target, int, int>(&Target::Method, &Pre, nullptr);
+	Target* first = new Target;
+	Target* second = new Target;
+	hook->Add(first);
+	hook->Add(second);
+	hook->Add(first);
+	auto stats = KHook::GetMemoryStats();
+	CHECK(stats.hooked_instances == 2 && stats.instance_cleanups == 0);
+
+	// Cleanup detours don't count the instances they mirror
+	hook->SetCleanup(DELETING_DESTRUCTOR);
+	Target* third = new Target;
+	hook->Add(third);
+	CHECK(KHook::GetMemoryStats().hooked_instances == 3);
+
+	delete second;
+	stats = KHook::GetMemoryStats();
+	CHECK(stats.hooked_instances == 2 && stats.instance_cleanups == 1);
+	hook->Remove(first);
+	stats = KHook::GetMemoryStats();
+	CHECK(stats.hooked_instances == 1 && stats.instance_cleanups == 1);
+
+	delete hook;
+	CHECK(KHook::GetMemoryStats().hooked_instances == 0);
+	delete first;
+	delete third;
+	KHook::Shutdown();
+	std::printf("OK\n");
+	return 0;
+}
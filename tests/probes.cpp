@@ -0,0 +1,45 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Probe sites of code bigger than a slab, past its first SLAB_SIZE bytes, are patched through the writable view
+
+#include "common.hpp"
+#include "khook/asm.hpp"
+
+int main() {
+	KHook::Asm::GenBuffer jit;
+	// xor eax, eax
+	jit.push<std::uint8_t>(0x31);
+	jit.push<std::uint8_t>(0xC0);
+	while (jit.GetSize() < KHook::Asm::CPageAlloc::SLAB_SIZE + 4096) {
+		jit.nop(8);
+	}
+	jit.probe(0);
+	// ret
+	jit.push<std::uint8_t>(0xC3);
+	jit.probe_target();
+	// mov eax, 1 ; ret
+	jit.push<std::uint8_t>(0xB8);
+	jit.push<std::int32_t>(1);
+	jit.push<std::uint8_t>(0xC3);
+
+	auto code = reinterpret_cast<int (*)()>(jit.finalize());
+	CHECK(code != nullptr);
+	CHECK(code() == 0);
+	for (int i = 0; i < 4; i++) {
+		CHECK(jit.set_probes(true));
+		CHECK(code() == 1);
+		CHECK(jit.set_probes(false));
+		CHECK(code() == 0);
+	}
+	jit.clear();
+	KHook::Shutdown();
+	std::printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,110 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Concurrent SetupHooks calls sharing targets, every entry must get a hook even if the other call builds its detour
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+
+constexpr int METHODS = 16;
+constexpr int ROUNDS = 8;
+
+std::atomic<int> g_calls[METHODS];
+
+template<int ROUND>
+class Target {
+public:
+	virtual int M0(int a) { return a; }
+	virtual int M1(int a) { return a; }
+	virtual int M2(int a) { return a; }
+	virtual int M3(int a) { return a; }
+	virtual int M4(int a) { return a; }
+	virtual int M5(int a) { return a; }
+	virtual int M6(int a) { return a; }
+	virtual int M7(int a) { return a; }
+	virtual int M8(int a) { return a; }
+	virtual int M9(int a) { return a; }
+	virtual int M10(int a) { return a; }
+	virtual int M11(int a) { return a; }
+	virtual int M12(int a) { return a; }
+	virtual int M13(int a) { return a; }
+	virtual int M14(int a) { return a; }
+	virtual int M15(int a) { return a; }
+};
+
+template<int ROUND>
+KHook::Return<int> Pre(Target<ROUND>*, int method) {
+	g_calls[method]++;
+	return { KHook::Action::Ignore, 0 };
+}
+
+template<int ROUND>
+void Round() {
+	using T = Target<ROUND>;
+	using Hook = BulkVirtual<T, int, int>;
+	int (T::*methods[METHODS])(int) = {
+		&T::M0, &T::M1, &T::M2, &T::M3, &T::M4, &T::M5, &T::M6, &T::M7,
+		&T::M8, &T::M9, &T::M10, &T::M11, &T::M12, &T::M13, &T::M14, &T::M15
+	};
+	// Detours are built in the mode set when they're created, alternate between both
+	KHook::SetDispatchMode((ROUND % 2) ? KHook::DispatchMode::Shared : KHook::DispatchMode::Dedicated);
+	T* object = new T;
+	for (auto& calls : g_calls) {
+		calls = 0;
+	}
+
+	// The first thread hooks the first three quarters, the second the last three, both the middle half
+	std::vector<std::unique_ptr<Hook>> hooks[2];
+	std::atomic<int> ready = 0;
+	auto setup = [&](int thread) {
+		std::vector<KHook::HookSetup> setups;
+		for (int i = thread * METHODS / 4; i < thread * METHODS / 4 + METHODS * 3 / 4; i++) {
+			hooks[thread].push_back(std::make_unique<Hook>(methods[i], &Pre<ROUND>, nullptr));
+			setups.push_back(hooks[thread].back()->Setup(object, (i % 2) == 0));
+		}
+		ready++;
+		while (ready != 2) {
+		}
+		CHECK(KHook::SetupHooks(setups.data(), setups.size(), 2) == setups.size());
+		for (std::size_t i = 0; i < setups.size(); i++) {
+			CHECK(setups[i].id != KHook::INVALID_HOOK);
+			hooks[thread][i]->Created(setups[i]);
+			CHECK(KHook::WaitActive(setups[i].id, 1000));
+		}
+	};
+	std::thread other(setup, 1);
+	setup(0);
+	other.join();
+
+	for (int i = 0; i < METHODS; i++) {
+		CHECK((object->*methods[i])(i) == i);
+		bool shared = i >= METHODS / 4 && i < METHODS * 3 / 4;
+		CHECK(g_calls[i] == (shared ? 2 : 1));
+	}
+	hooks[0].clear();
+	hooks[1].clear();
+	delete object;
+}
+
+template<int... ROUND>
+void Rounds(std::integer_sequence<int, ROUND...>) {
+	(Round<ROUND>(), ...);
+}
+
+int main() {
+	Rounds(std::make_integer_sequence<int, ROUNDS>());
+	KHook::Shutdown();
+	std::printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,62 @@
+/* ======== KHook ========
+* Copyright (C) 2025
+* No warranties of any kind
+*
+* License: zLib License
+*
+* Author(s): Benoist "Kenzzer" ANDRÉ
+* ============================
+*/
+// Shutdown while a hooked call is in flight, its callback setting up and removing hooks must not deadlock
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "common.hpp"
+
+class Target {
+public:
+	virtual int Slow(int a) { return a; }
+	virtual int Other(int a) { return a; }
+};
+
+std::atomic<bool> g_in_call = false;
+Target* g_target = nullptr;
+KHook::Virtual<Target, int, int>* g_other = nullptr;
+
+KHook::Return<int> OtherPre(Target*, int) {
+	return { KHook::Action::Ignore, 0 };
+}
+
+KHook::Return<int> SlowPre(Target*, int) {
+	g_in_call = true;
+	// Long enough for Shutdown to be waiting on this call
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	g_other->Add(g_target);
+	KHook::RemoveHook(KHook::INVALID_HOOK, false);
+	return { KHook::Action::Ignore, 0 };
+}
+
+int main() {
+	g_target = new Target;
+	KHook::Virtual<Target, int, int> slow(&Target::Slow, &SlowPre, nullptr);
+	g_other = new KHook::Virtual<Target, int, int>(&Target::Other, &OtherPre, nullptr);
+	slow.Add(g_target);
+	g_other->Add(g_target);
+	CHECK(KHook::WaitActive(0, 1000) && KHook::WaitActive(1, 1000));
+	// Left for Shutdown to finish
+	KHook::RemoveHook(1, true);
+
+	std::thread caller([]() {
+		Target* volatile target = g_target;
+		CHECK(target->Slow(1) == 1);
+	});
+	while (!g_in_call) {
+		std::this_thread::yield();
+	}
+	KHook::Shutdown();
+	caller.join();
+	std::printf("OK\n");
+	return 0;
+}
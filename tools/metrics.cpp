@@ -0,0 +1,146 @@
+// Prints the metrics a process publishes with KHook::StartMetricsExport, as a table or as JSON
+//
+// Usage: khook_metrics <pid or block path> [json]
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "khook/metrics.hpp"
+
+using namespace KHook;
+
+// Consistent copy of the header and the capsules, seqlock readers never block the writer
+static bool Snapshot(const std::uint8_t* block, std::size_t size, Metrics::Header& header, std::vector<Metrics::Capsule>& capsules) {
+	auto published = reinterpret_cast<const Metrics::Header*>(block);
+	for (int attempt = 0; attempt < 1000; attempt++) {
+		auto before = published->sequence.load(std::memory_order_acquire);
+		if (before & 1) {
+			std::this_thread::yield();
+			continue;
+		}
+		std::memcpy(reinterpret_cast<std::uint8_t*>(&header), block, sizeof(header));
+		std::size_t count = header.capsule_count;
+		if (published->header_size + count * published->capsule_size > size) {
+			count = 0;
+		}
+		capsules.assign(count, Metrics::Capsule{});
+		for (std::size_t i = 0; i < count; i++) {
+			std::memcpy(&capsules[i], block + published->header_size + i * published->capsule_size, sizeof(Metrics::Capsule));
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (published->sequence.load(std::memory_order_relaxed) == before) {
+			header.capsule_count = static_cast<std::uint32_t>(count);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void PrintJson(const Metrics::Header& header, const std::vector<Metrics::Capsule>& capsules) {
+	std::printf("{\"version\":%u,\"pointer_size\":%u,\"update_ns\":%" PRIu64 ",\"interval_ms\":%u,\"dropped_capsules\":%" PRIu64
+		",\"pending_inserts\":%" PRIu64 ",\"pending_deletes\":%" PRIu64,
+		header.version, header.pointer_size, header.update_ns, header.interval_ms, header.dropped_capsules,
+		header.pending_inserts, header.pending_deletes);
+	std::printf(",\"memory\":{\"code_mapped\":%" PRIu64 ",\"code_used\":%" PRIu64 ",\"code_fragmented\":%" PRIu64 ",\"detour_code\":%" PRIu64
+		",\"callbacks\":%" PRIu64 ",\"table_bytes\":%" PRIu64 ",\"dispatch_threads\":%" PRIu64 ",\"dispatch_thread_bytes\":%" PRIu64
+		",\"hooked_instances\":%" PRIu64 ",\"instance_cleanups\":%" PRIu64 "}",
+		header.code_mapped, header.code_used, header.code_fragmented, header.detour_code,
+		header.callbacks, header.table_bytes, header.dispatch_threads, header.dispatch_thread_bytes,
+		header.hooked_instances, header.instance_cleanups);
+	std::printf(",\"capsules\":[");
+	for (std::size_t i = 0; i < capsules.size(); i++) {
+		auto& capsule = capsules[i];
+		std::printf("%s{\"function\":\"0x%" PRIx64 "\",\"hooks\":%u,\"sample_rate\":%u,\"calls\":%" PRIu64 ",\"supersedes\":%" PRIu64
+			",\"overrides\":%" PRIu64 ",\"cycles\":%" PRIu64 ",\"histogram\":[",
+			(i != 0) ? "," : "", capsule.function, capsule.hooks, capsule.sample_rate, capsule.calls, capsule.supersedes,
+			capsule.overrides, capsule.cycles);
+		for (std::uint32_t b = 0; b < Metrics::HISTOGRAM_BUCKETS; b++) {
+			std::printf("%s%" PRIu64, (b != 0) ? "," : "", capsule.histogram[b]);
+		}
+		std::printf("]}");
+	}
+	std::printf("]}\n");
+}
+
+static void PrintTable(const Metrics::Header& header, const std::vector<Metrics::Capsule>& capsules) {
+	std::printf("pending inserts %" PRIu64 ", pending deletes %" PRIu64 "\n", header.pending_inserts, header.pending_deletes);
+	std::printf("code %" PRIu64 " bytes used of %" PRIu64 " mapped, %" PRIu64 " fragmented, %" PRIu64 " in detours\n",
+		header.code_used, header.code_mapped, header.code_fragmented, header.detour_code);
+	std::printf("%" PRIu64 " callbacks, %" PRIu64 " table bytes, %" PRIu64 " dispatch threads holding %" PRIu64 " bytes\n",
+		header.callbacks, header.table_bytes, header.dispatch_threads, header.dispatch_thread_bytes);
+	std::printf("%" PRIu64 " hooked instances, %" PRIu64 " removed by cleanup\n\n", header.hooked_instances, header.instance_cleanups);
+
+	std::printf("%-18s %6s %6s %14s %12s %12s %14s\n", "function", "hooks", "rate", "calls", "supersedes", "overrides", "cycles/call");
+	for (auto& capsule : capsules) {
+		if (capsule.sample_rate == 0) {
+			std::printf("0x%-16" PRIx64 " %6u %6s %14s %12s %12s %14s\n", capsule.function, capsule.hooks, "-", "-", "-", "-", "-");
+			continue;
+		}
+		double per_call = (capsule.calls != 0) ? static_cast<double>(capsule.cycles) / capsule.calls : 0.0;
+		std::printf("0x%-16" PRIx64 " %6u %6u %14" PRIu64 " %12" PRIu64 " %12" PRIu64 " %14.1f\n",
+			capsule.function, capsule.hooks, capsule.sample_rate, capsule.calls, capsule.supersedes, capsule.overrides, per_call);
+	}
+	if (header.dropped_capsules != 0) {
+		std::printf("... and %" PRIu64 " detours the block had no room for\n", header.dropped_capsules);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		std::fprintf(stderr, "Usage: %s <pid or block path> [json]\n", argv[0]);
+		return 1;
+	}
+	bool json = (argc >= 3 && std::strcmp(argv[2], "json") == 0);
+
+	std::string path = argv[1];
+	if (path.find('/') == std::string::npos) {
+		path = "/dev/shm/khook-" + path;
+	}
+	int file = open(path.c_str(), O_RDONLY);
+	if (file == -1) {
+		std::fprintf(stderr, "Couldn't open %s\n", path.c_str());
+		return 1;
+	}
+	struct stat info;
+	std::size_t size = (fstat(file, &info) == 0) ? static_cast<std::size_t>(info.st_size) : 0;
+	void* view = (size >= sizeof(Metrics::Header)) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+	close(file);
+	if (view == MAP_FAILED) {
+		std::fprintf(stderr, "%s is too small to be a metrics block\n", path.c_str());
+		return 1;
+	}
+	auto block = reinterpret_cast<const std::uint8_t*>(view);
+	auto published = reinterpret_cast<const Metrics::Header*>(block);
+	if (std::memcmp(published->magic, Metrics::BLOCK_MAGIC, sizeof(published->magic)) != 0 || published->version != Metrics::BLOCK_VERSION) {
+		std::fprintf(stderr, "%s isn't a version %u metrics block\n", path.c_str(), Metrics::BLOCK_VERSION);
+		return 1;
+	}
+	if (published->header_size < sizeof(Metrics::Header) || published->capsule_size < sizeof(Metrics::Capsule)
+		|| published->histogram_buckets != Metrics::HISTOGRAM_BUCKETS) {
+		std::fprintf(stderr, "%s has truncated structures\n", path.c_str());
+		return 1;
+	}
+
+	Metrics::Header header;
+	std::vector<Metrics::Capsule> capsules;
+	if (!Snapshot(block, size, header, capsules)) {
+		std::fprintf(stderr, "%s is being updated too often to be read\n", path.c_str());
+		return 1;
+	}
+	if (json) {
+		PrintJson(header, capsules);
+	} else {
+		PrintTable(header, capsules);
+	}
+	munmap(view, size);
+	return 0;
+}
@@ -0,0 +1,166 @@
+// Converts a file written by KHook::DumpTrace to CSV or JSON
+//
+// Usage: khook_trace <trace file> [csv|json]
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "khook/trace.hpp"
+
+using namespace KHook;
+
+static const char* EventName(Trace::Event event) {
+	switch (event) {
+	case Trace::Event::Entry:
+		return "entry";
+	case Trace::Event::Exit:
+		return "exit";
+	default:
+		return "lost";
+	}
+}
+
+static const char* ActionName(std::uint32_t action) {
+	switch (action) {
+	case 0:
+		return "ignore";
+	case 1:
+		return "override";
+	case 2:
+		return "supersede";
+	default:
+		return "unknown";
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		std::fprintf(stderr, "Usage: %s <trace file> [csv|json]\n", argv[0]);
+		return 1;
+	}
+	bool json = (argc >= 3 && std::strcmp(argv[2], "json") == 0);
+
+	std::ifstream file(argv[1], std::ios::binary);
+	if (!file) {
+		std::fprintf(stderr, "Couldn't open %s\n", argv[1]);
+		return 1;
+	}
+	std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	Trace::FileHeader header = {};
+	if (data.size() < sizeof(header)) {
+		std::fprintf(stderr, "%s is too small to be a trace\n", argv[1]);
+		return 1;
+	}
+	std::memcpy(&header, data.data(), sizeof(header));
+	if (std::memcmp(header.magic, Trace::FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != Trace::FILE_VERSION) {
+		std::fprintf(stderr, "%s isn't a version %u trace\n", argv[1], Trace::FILE_VERSION);
+		return 1;
+	}
+	if (header.header_size < sizeof(Trace::FileHeader) || header.ring_header_size < sizeof(Trace::RingHeader) || header.record_size < sizeof(Trace::Record)) {
+		std::fprintf(stderr, "%s has truncated structures\n", argv[1]);
+		return 1;
+	}
+
+	// Timestamps are converted to nanoseconds since tracing started
+	double ns_per_tick = 0.0;
+	if (header.dump_ticks > header.start_ticks) {
+		ns_per_tick = static_cast<double>(header.dump_ns - header.start_ns) / static_cast<double>(header.dump_ticks - header.start_ticks);
+	}
+	auto to_ns = [&header, ns_per_tick](std::uint64_t ticks) {
+		return static_cast<double>(static_cast<std::int64_t>(ticks - header.start_ticks)) * ns_per_tick;
+	};
+
+	if (json) {
+		std::printf("{\"pointer_size\":%u,\"untraced_threads\":%" PRIu64 ",\"ns_per_tick\":%.6f,\"threads\":[",
+			header.pointer_size, header.untraced_threads, ns_per_tick);
+	} else {
+		std::printf("thread,sequence,event,time_ns,function,return_address,hook,action");
+		for (std::uint32_t i = 0; i < Trace::INT_REGS; i++) {
+			std::printf(",int_reg%u", i);
+		}
+		for (std::uint32_t i = 0; i < Trace::FLOAT_REGS; i++) {
+			std::printf(",float_reg%u", i);
+		}
+		for (std::uint32_t i = 0; i < Trace::STACK_WORDS; i++) {
+			std::printf(",stack%u", i);
+		}
+		std::printf("\n");
+	}
+
+	std::size_t offset = header.header_size;
+	for (std::uint32_t ring = 0; ring < header.ring_count; ring++) {
+		Trace::RingHeader ring_header = {};
+		if (offset + header.ring_header_size > data.size()) {
+			std::fprintf(stderr, "%s is truncated\n", argv[1]);
+			return 1;
+		}
+		std::memcpy(&ring_header, data.data() + offset, sizeof(ring_header));
+		offset += header.ring_header_size;
+		if (json) {
+			std::printf("%s{\"thread\":%" PRIu64 ",\"first\":%" PRIu64 ",\"overwritten\":%" PRIu64 ",\"records\":[",
+				(ring != 0) ? "," : "", ring_header.thread, ring_header.first, ring_header.overwritten);
+		}
+
+		for (std::uint64_t i = 0; i < ring_header.count; i++) {
+			Trace::Record record = {};
+			if (offset + header.record_size > data.size()) {
+				std::fprintf(stderr, "%s is truncated\n", argv[1]);
+				return 1;
+			}
+			std::memcpy(&record, data.data() + offset, sizeof(record));
+			offset += header.record_size;
+
+			std::uint64_t sequence = ring_header.first + i;
+			double time_ns = (record.event == Trace::Event::Lost) ? 0.0 : to_ns(record.timestamp);
+			int hook = (record.hook == 0xFFFFFFFF) ? -1 : static_cast<int>(record.hook);
+			if (json) {
+				std::printf("%s{\"sequence\":%" PRIu64 ",\"event\":\"%s\",\"time_ns\":%.1f,\"function\":\"0x%" PRIx64 "\"",
+					(i != 0) ? "," : "", sequence, EventName(record.event), time_ns, record.function);
+				if (record.event == Trace::Event::Entry) {
+					std::printf(",\"return_address\":\"0x%" PRIx64 "\",\"int_regs\":[", record.return_address);
+					for (std::uint32_t r = 0; r < Trace::INT_REGS; r++) {
+						std::printf("%s\"0x%" PRIx64 "\"", (r != 0) ? "," : "", record.int_regs[r]);
+					}
+					std::printf("],\"float_regs\":[");
+					for (std::uint32_t r = 0; r < Trace::FLOAT_REGS; r++) {
+						std::printf("%s\"0x%" PRIx64 "\"", (r != 0) ? "," : "", record.float_regs[r]);
+					}
+					std::printf("],\"stack\":[");
+					for (std::uint32_t r = 0; r < Trace::STACK_WORDS; r++) {
+						std::printf("%s\"0x%" PRIx64 "\"", (r != 0) ? "," : "", record.stack[r]);
+					}
+					std::printf("]");
+				} else if (record.event == Trace::Event::Exit) {
+					std::printf(",\"hook\":%d,\"action\":\"%s\"", hook, ActionName(record.action));
+				}
+				std::printf("}");
+			} else {
+				std::printf("%" PRIu64 ",%" PRIu64 ",%s,%.1f,0x%" PRIx64 ",0x%" PRIx64 ",%d,%s",
+					ring_header.thread, sequence, EventName(record.event), time_ns, record.function, record.return_address,
+					hook, (record.event == Trace::Event::Exit) ? ActionName(record.action) : "");
+				for (std::uint32_t r = 0; r < Trace::INT_REGS; r++) {
+					std::printf(",0x%" PRIx64, record.int_regs[r]);
+				}
+				for (std::uint32_t r = 0; r < Trace::FLOAT_REGS; r++) {
+					std::printf(",0x%" PRIx64, record.float_regs[r]);
+				}
+				for (std::uint32_t r = 0; r < Trace::STACK_WORDS; r++) {
+					std::printf(",0x%" PRIx64, record.stack[r]);
+				}
+				std::printf("\n");
+			}
+		}
+		if (json) {
+			std::printf("]}");
+		}
+	}
+	if (json) {
+		std::printf("]}\n");
+	}
+	return 0;
+}